@@ -0,0 +1,175 @@
+///
+/// Copyright 2026 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "cgroup.h"
+#include "run.h"
+#include "log.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static bool writeFile(const std::string& path, const std::string& content) {
+    int fd = open(path.c_str(), O_WRONLY|O_CLOEXEC);
+    if(fd < 0)
+        return false;
+    bool ok = write(fd, content.data(), content.size()) == ssize_t(content.size());
+    close(fd);
+    return ok;
+}
+
+bool cgroupInit(const std::string& root) {
+    if(access((root + "/cgroup.controllers").c_str(), R_OK) != 0) {
+        LLOG(ERROR, "Not a cgroup v2 directory", root);
+        return false;
+    }
+
+    std::string leaf = root + "/laminard";
+    if(mkdir(leaf.c_str(), 0755) != 0 && errno != EEXIST) {
+        LLOG(ERROR, "Could not create cgroup", leaf, strerror(errno));
+        return false;
+    }
+
+    // Move everything out of the root (typically just laminard itself)
+    // so that controllers can be enabled for the run cgroups
+    if(FILE* fp = fopen((root + "/cgroup.procs").c_str(), "r")) {
+        int pid;
+        while(fscanf(fp, "%d", &pid) == 1)
+            writeFile(leaf + "/cgroup.procs", std::to_string(pid));
+        fclose(fp);
+    }
+    if(!writeFile(leaf + "/cgroup.procs", std::to_string(getpid()))) {
+        LLOG(ERROR, "Could not move laminard into cgroup", leaf, strerror(errno));
+        return false;
+    }
+
+    // Not every controller may have been delegated, so enable them one
+    // by one and just use whatever is available
+    for(const char* controller : {"+cpu", "+memory", "+io"}) {
+        if(!writeFile(root + "/cgroup.subtree_control", controller))
+            LLOG(WARNING, "Could not enable cgroup controller", controller, strerror(errno));
+    }
+    return true;
+}
+
+std::string cgroupCreate(const std::string& root, const std::string& name, const CgroupLimits& limits) {
+    std::string path = root + "/" + name;
+    if(mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+        LLOG(ERROR, "Could not create cgroup", path, strerror(errno));
+        return std::string();
+    }
+    if(limits.cpuWeight && !writeFile(path + "/cpu.weight", std::to_string(limits.cpuWeight)))
+        LLOG(WARNING, "Could not set cpu.weight", path, strerror(errno));
+    if(!limits.memoryMax.empty() && !writeFile(path + "/memory.max", limits.memoryMax))
+        LLOG(WARNING, "Could not set memory.max", path, strerror(errno));
+    if(!limits.ioMax.empty() && !writeFile(path + "/io.max", limits.ioMax))
+        LLOG(WARNING, "Could not set io.max", path, strerror(errno));
+    return path;
+}
+
+bool cgroupEnter(const std::string& path) {
+    // writing 0 moves the writing process
+    return writeFile(path + "/cgroup.procs", "0");
+}
+
+bool cgroupUsage(const std::string& path, RunUsage& usage) {
+    bool found = false;
+    char line[512];
+
+    if(FILE* fp = fopen((path + "/cpu.stat").c_str(), "r")) {
+        unsigned long long usec;
+        while(fgets(line, sizeof(line), fp)) {
+            if(sscanf(line, "usage_usec %llu", &usec) == 1) {
+                usage.cpuTime = usec / 1000;
+                found = true;
+                break;
+            }
+        }
+        fclose(fp);
+    }
+
+    // memory.peak requires Linux 5.19
+    if(FILE* fp = fopen((path + "/memory.peak").c_str(), "r")) {
+        unsigned long long bytes;
+        if(fscanf(fp, "%llu", &bytes) == 1) {
+            usage.peakMemory = bytes;
+            found = true;
+        }
+        fclose(fp);
+    }
+
+    // one line per device of the form
+    // "8:0 rbytes=1 wbytes=2 rios=3 wios=4 dbytes=5 dios=6"
+    if(FILE* fp = fopen((path + "/io.stat").c_str(), "r")) {
+        ulong total = 0;
+        while(fgets(line, sizeof(line), fp)) {
+            unsigned long long rbytes, wbytes;
+            if(sscanf(line, "%*s rbytes=%llu wbytes=%llu", &rbytes, &wbytes) == 2)
+                total += rbytes + wbytes;
+        }
+        usage.ioBytes = total;
+        found = true;
+        fclose(fp);
+    }
+
+    return found;
+}
+
+bool cgroupKill(const std::string& path) {
+    if(writeFile(path + "/cgroup.kill", "1"))
+        return true;
+
+    // Older kernels: kill whatever is listed. Processes may fork while we
+    // do this, so repeat until the cgroup is empty
+    for(int attempt = 0; attempt < 10; ++attempt) {
+        FILE* fp = fopen((path + "/cgroup.procs").c_str(), "r");
+        if(!fp)
+            return false;
+        int pid, n = 0;
+        while(fscanf(fp, "%d", &pid) == 1) {
+            kill(pid, SIGKILL);
+            n++;
+        }
+        fclose(fp);
+        if(n == 0)
+            return true;
+    }
+    return false;
+}
+
+bool cgroupRemove(const std::string& path) {
+    // child cgroups, such as the one the leader creates for its scripts,
+    // have to be removed first
+    if(DIR* dir = opendir(path.c_str())) {
+        while(struct dirent* de = readdir(dir)) {
+            if(de->d_type == DT_DIR && de->d_name[0] != '.')
+                cgroupRemove(path + "/" + de->d_name);
+        }
+        closedir(dir);
+    }
+    if(rmdir(path.c_str()) != 0) {
+        LLOG(WARNING, "Could not remove cgroup", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,63 @@
+///
+/// Copyright 2026 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#pragma once
+
+#include <string>
+
+struct RunUsage;
+
+// Resource limits applied to the cgroup of a run. Empty/zero values
+// leave the kernel default in place.
+struct CgroupLimits {
+    int cpuWeight = 0;
+    std::string memoryMax;
+    std::string ioMax;
+
+    // fill any unset limit from the given fallback
+    void inherit(const CgroupLimits& other) {
+        if(!cpuWeight) cpuWeight = other.cpuWeight;
+        if(memoryMax.empty()) memoryMax = other.memoryMax;
+        if(ioMax.empty()) ioMax = other.ioMax;
+    }
+};
+
+// Prepares a delegated cgroup v2 directory (e.g. from systemd's Delegate=yes)
+// to contain runs. Because cgroup v2 does not allow processes in inner nodes,
+// laminard moves itself into a "laminard" leaf below root and enables the
+// cpu, memory and io controllers for the sibling run cgroups. Returns false
+// if root is not a usable cgroup v2 directory.
+bool cgroupInit(const std::string& root);
+
+// Creates a cgroup for a run below root and applies the given limits.
+// Returns the path of the new cgroup, or an empty string on failure.
+std::string cgroupCreate(const std::string& root, const std::string& name, const CgroupLimits& limits);
+
+// Moves the calling process into the cgroup at path. Descendants
+// forked afterwards will inherit it.
+bool cgroupEnter(const std::string& path);
+
+// Reads accumulated CPU time, peak memory and IO of the cgroup at path.
+bool cgroupUsage(const std::string& path, RunUsage& usage);
+
+// Sends SIGKILL to every process in the cgroup at path. Uses cgroup.kill
+// where available (Linux 5.14), which cannot race with forking processes.
+bool cgroupKill(const std::string& path);
+
+// Removes the cgroup at path and any (empty) child cgroups
+bool cgroupRemove(const std::string& path);
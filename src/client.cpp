@@ -23,6 +23,7 @@
 #include <kj/vector.h>
 
 #include <iostream>
+#include <vector>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -34,14 +35,30 @@
 // Definition needed for musl
 typedef unsigned int uint;
 
-template<typename T>
-static int setParams(int argc, char** argv, T& request) {
-    int n = 0;
+// A job from the command line with its parameters
+struct JobArgs {
+    const char* name;
+    std::vector<std::pair<const char*, const char*>> params;
+};
+
+// Parses the JOB_LIST starting at argv
+static std::vector<JobArgs> parseJobList(int argc, char** argv) {
+    std::vector<JobArgs> jobs;
     for(int i = 0; i < argc; ++i) {
-        if(strchr(argv[i], '=') == NULL)
-            break;
-        n++;
+        char* val = strchr(argv[i], '=');
+        if(val && !jobs.empty()) {
+            *val++ = '\0';
+            jobs.back().params.emplace_back(argv[i], val);
+        } else {
+            jobs.push_back({argv[i], {}});
+        }
     }
+    return jobs;
+}
+
+template<typename T>
+static void setParams(const JobArgs& args, T& request) {
+    int n = args.params.size();
 
     char* job = getenv("JOB");
     char* num = getenv("RUN");
@@ -50,15 +67,10 @@ static int setParams(int argc, char** argv, T& request) {
     auto params = request.initParams(n + (job&&num?2:0) + (reason?1:0));
 
     for(int i = 0; i < n; ++i) {
-        char* name = argv[i];
-        char* val = strchr(name, '=');
-        *val++ = '\0';
-        params[i].setName(name);
-        params[i].setValue(val);
+        params[i].setName(args.params[i].first);
+        params[i].setValue(args.params[i].second);
     }
 
-    int argsConsumed = n;
-
     if(job && num) {
         params[n].setName("=parentJob");
         params[n++].setValue(job);
@@ -69,8 +81,6 @@ static int setParams(int argc, char** argv, T& request) {
         params[n].setName("=reason");
         params[n].setValue(reason);
     }
-
-    return argsConsumed;
 }
 
 static void printTriggerLink(const char* job, uint run) {
@@ -85,6 +95,25 @@ static void printTriggerLink(const char* job, uint run) {
     }
 }
 
+// Prints the output streamed by laminard for "laminarc tail"
+class LogPrinter : public LaminarCi::LogSink::Server {
+    kj::Promise<void> write(WriteContext context) override {
+        auto chunk = context.getParams().getChunk();
+        fwrite(chunk.begin(), 1, chunk.size(), stdout);
+        fflush(stdout);
+        return kj::READY_NOW;
+    }
+};
+
+// Prints the events streamed by laminard for "laminarc watch", one per line
+class EventPrinter : public LaminarCi::EventSink::Server {
+    kj::Promise<void> event(EventContext context) override {
+        printf("%s\n", context.getParams().getJson().cStr());
+        fflush(stdout);
+        return kj::READY_NOW;
+    }
+};
+
 static void usage(std::ostream& out) {
     out << "laminarc version " << laminar_version() << "\n";
     out << "Usage: laminarc [-h|--help] COMMAND\n";
@@ -101,6 +130,10 @@ static void usage(std::ostream& out) {
     out << "  show-jobs             lists all known jobs.\n";
     out << "  show-queued           lists currently queued jobs.\n";
     out << "  show-running          lists currently running jobs.\n";
+    out << "  tail NAME [NUMBER]    prints the output of the run identified by NAME and NUMBER (by\n";
+    out << "                        default the latest) as it is produced, until the run completes.\n";
+    out << "  watch [NAME]          prints the status of the job NAME, or of all jobs, followed by\n";
+    out << "                        every change to it, as JSON, one per line.\n";
     out << "JOB_LIST is of the form:\n";
     out << "  [JOB_NAME [PARAMETER_LIST...]]...\n";
     out << "PARAMETER_LIST is of the form:\n";
@@ -136,6 +169,7 @@ int main(int argc, char** argv) {
 
     int jobNameIndex = 2;
     bool frontOfQueue = false;
+    std::vector<JobArgs> jobs;
 
     if(strcmp(argv[1], "queue") == 0 || strcmp(argv[1], "start") == 0 || strcmp(argv[1], "run") == 0) {
         if(argc < 3 || (strcmp(argv[2], "--next") == 0 && argc < 4)) {
@@ -146,54 +180,73 @@ int main(int argc, char** argv) {
             frontOfQueue = true;
             jobNameIndex++;
         }
+        jobs = parseJobList(argc - jobNameIndex, &argv[jobNameIndex]);
     }
 
     if(strcmp(argv[1], "queue") == 0) {
-        do {
-            auto req = laminar.queueRequest();
-            req.setJobName(argv[jobNameIndex]);
-            req.setFrontOfQueue(frontOfQueue);
-            int n = setParams(argc - jobNameIndex - 1, &argv[jobNameIndex + 1], req);
-            ts.add(req.send().then([&ret,argv,jobNameIndex](capnp::Response<LaminarCi::QueueResults> resp){
-                if(resp.getResult() != LaminarCi::MethodResult::SUCCESS) {
-                    fprintf(stderr, "Failed to queue job '%s'\n", argv[jobNameIndex]);
+        // queue them all in one go, unless the server is too old for that
+        auto batch = laminar.queueBatchRequest();
+        batch.setFrontOfQueue(frontOfQueue);
+        auto batchJobs = batch.initJobs(jobs.size());
+        for(size_t i = 0; i < jobs.size(); ++i) {
+            batchJobs[i].setJobName(jobs[i].name);
+            setParams(jobs[i], batchJobs[i]);
+        }
+        ts.add(batch.send().then([&ret,&jobs](capnp::Response<LaminarCi::QueueBatchResults> resp){
+            auto runs = resp.getRuns();
+            for(size_t i = 0; i < jobs.size() && i < runs.size(); ++i) {
+                if(runs[i].getBuildNum() == 0) {
+                    fprintf(stderr, "Failed to queue job '%s'\n", jobs[i].name);
                     ret = EXIT_OPERATION_FAILED;
                 } else
-                    printTriggerLink(argv[jobNameIndex], resp.getBuildNum());
-            }));
-            jobNameIndex += n + 1;
-        } while(jobNameIndex < argc);
+                    printTriggerLink(jobs[i].name, runs[i].getBuildNum());
+            }
+        }, [&ts,&ret,&jobs,&laminar,frontOfQueue](kj::Exception&& e){
+            if(e.getType() != kj::Exception::Type::UNIMPLEMENTED)
+                return kj::throwFatalException(kj::mv(e));
+            for(const JobArgs& job : jobs) {
+                auto req = laminar.queueRequest();
+                req.setJobName(job.name);
+                req.setFrontOfQueue(frontOfQueue);
+                setParams(job, req);
+                ts.add(req.send().then([&ret,name=job.name](capnp::Response<LaminarCi::QueueResults> resp){
+                    if(resp.getResult() != LaminarCi::MethodResult::SUCCESS) {
+                        fprintf(stderr, "Failed to queue job '%s'\n", name);
+                        ret = EXIT_OPERATION_FAILED;
+                    } else
+                        printTriggerLink(name, resp.getBuildNum());
+                }));
+            }
+        }));
     } else if(strcmp(argv[1], "start") == 0) {
-        do {
+        for(const JobArgs& job : jobs) {
             auto req = laminar.startRequest();
-            req.setJobName(argv[jobNameIndex]);
+            req.setJobName(job.name);
             req.setFrontOfQueue(frontOfQueue);
-            int n = setParams(argc - jobNameIndex - 1, &argv[jobNameIndex + 1], req);
-            ts.add(req.send().then([&ret,argv,jobNameIndex](capnp::Response<LaminarCi::StartResults> resp){
+            setParams(job, req);
+            ts.add(req.send().then([&ret,name=job.name](capnp::Response<LaminarCi::StartResults> resp){
                 if(resp.getResult() != LaminarCi::MethodResult::SUCCESS) {
-                    fprintf(stderr, "Failed to start job '%s'\n", argv[2]);
+                    fprintf(stderr, "Failed to start job '%s'\n", name);
                     ret = EXIT_OPERATION_FAILED;
                 } else
-                    printTriggerLink(argv[jobNameIndex], resp.getBuildNum());
+                    printTriggerLink(name, resp.getBuildNum());
             }));
-            jobNameIndex += n + 1;
-        } while(jobNameIndex < argc);
+        }
     } else if(strcmp(argv[1], "run") == 0) {
-        do {
+        for(const JobArgs& job : jobs) {
             auto req = laminar.runRequest();
-            req.setJobName(argv[jobNameIndex]);
+            req.setJobName(job.name);
             req.setFrontOfQueue(frontOfQueue);
-            int n = setParams(argc - jobNameIndex - 1, &argv[jobNameIndex + 1], req);
-            ts.add(req.send().then([&ret,argv,jobNameIndex](capnp::Response<LaminarCi::RunResults> resp){
+            setParams(job, req);
+            ts.add(req.send().then([&ret,name=job.name](capnp::Response<LaminarCi::RunResults> resp){
                 if(resp.getResult() == LaminarCi::JobResult::UNKNOWN)
-                    fprintf(stderr, "Failed to start job '%s'\n", argv[2]);
+                    fprintf(stderr, "Failed to start job '%s'\n", name);
                 else
-                    printTriggerLink(argv[jobNameIndex], resp.getBuildNum());
+                    printTriggerLink(name, resp.getBuildNum());
                 if(resp.getResult() != LaminarCi::JobResult::SUCCESS)
                     ret = EXIT_RUN_FAILED;
             }));
-            jobNameIndex += n + 1;
-        } while(jobNameIndex < argc);
+        }
     } else if(strcmp(argv[1], "set") == 0) {
         if(argc < 3) {
             fprintf(stderr, "Usage %s set param=value\n", argv[0]);
@@ -244,6 +297,32 @@ int main(int argc, char** argv) {
         for(auto it : running.getResult()) {
             printf("%s:%d\n", it.getJob().cStr(), it.getBuildNum());
         }
+    } else if(strcmp(argv[1], "tail") == 0) {
+        if(argc != 3 && argc != 4) {
+            fprintf(stderr, "Usage: %s tail <jobName> [<jobNumber>]\n", argv[0]);
+            return EXIT_BAD_ARGUMENT;
+        }
+        auto req = laminar.tailRequest();
+        req.getRun().setJob(argv[2]);
+        req.getRun().setBuildNum(argc == 4 ? atoi(argv[3]) : 0);
+        req.setSink(kj::heap<LogPrinter>());
+        ts.add(req.send().then([&ret,argv](capnp::Response<LaminarCi::TailResults> resp){
+            if(resp.getResult() == LaminarCi::JobResult::UNKNOWN) {
+                fprintf(stderr, "Unknown run '%s'\n", argv[2]);
+                ret = EXIT_OPERATION_FAILED;
+            } else if(resp.getResult() != LaminarCi::JobResult::SUCCESS)
+                ret = EXIT_RUN_FAILED;
+        }));
+    } else if(strcmp(argv[1], "watch") == 0) {
+        if(argc > 3) {
+            fprintf(stderr, "Usage: %s watch [<jobName>]\n", argv[0]);
+            return EXIT_BAD_ARGUMENT;
+        }
+        auto req = laminar.watchRequest();
+        req.setJob(argc == 3 ? argv[2] : "");
+        req.setSink(kj::heap<EventPrinter>());
+        // only returns if laminard goes away
+        ts.add(req.send().ignoreResult());
     } else {
         fprintf(stderr, "Unknown command %s\n", argv[1]);
         return EXIT_BAD_ARGUMENT;
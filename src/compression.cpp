@@ -0,0 +1,215 @@
+///
+/// Copyright 2026 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "compression.h"
+#include "log.h"
+
+#include <algorithm>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#if defined(LAMINAR_ZSTD)
+#include <zstd.h>
+#include <zdict.h>
+
+// Logs are compressed off the event loop, so it is worth spending some
+// more time than zstd's default level for smaller rows
+#define LOG_ZSTD_LEVEL 9
+
+// The size zstd's own tools default to
+#define LOG_DICT_SIZE (112 << 10)
+// Smaller dictionaries are not worth storing
+#define LOG_DICT_MIN_SIZE 1024
+#endif
+
+LogCodec defaultLogCodec() {
+#if defined(LAMINAR_ZSTD)
+    return LOG_CODEC_ZSTD;
+#else
+    return LOG_CODEC_ZLIB;
+#endif
+}
+
+std::string compressLog(const std::string& log, LogCodec codec, const std::string* dict) {
+    if(log.length() < COMPRESS_LOG_MIN_SIZE)
+        return log;
+#if defined(LAMINAR_ZSTD)
+    if(codec == LOG_CODEC_ZSTD) {
+        std::string zipped(ZSTD_compressBound(log.size()), '\0');
+        ZSTD_CCtx* cctx = ZSTD_createCCtx();
+        size_t res = ZSTD_compress_usingDict(cctx, zipped.data(), zipped.size(), log.data(), log.size(),
+                                             dict ? dict->data() : nullptr, dict ? dict->size() : 0, LOG_ZSTD_LEVEL);
+        ZSTD_freeCCtx(cctx);
+        if(ZSTD_isError(res)) {
+            LLOG(ERROR, "Failed to compress log", ZSTD_getErrorName(res));
+            return log;
+        }
+        zipped.resize(res);
+        return zipped;
+    }
+#endif
+    std::string zipped(compressBound(log.size()), '\0');
+    unsigned long zippedSize = zipped.size();
+    if(::compress((uint8_t*) zipped.data(), &zippedSize,
+                  (const uint8_t*) log.data(), log.size()) != Z_OK) {
+        LLOG(ERROR, "Failed to compress log");
+        return log;
+    }
+    zipped.resize(zippedSize);
+    return zipped;
+}
+
+std::string uncompressLog(const std::string& stored, size_t length, LogCodec codec, const std::string* dict) {
+    if(length < COMPRESS_LOG_MIN_SIZE)
+        return stored;
+    std::string log(length, '\0');
+    if(codec == LOG_CODEC_ZSTD) {
+#if defined(LAMINAR_ZSTD)
+        ZSTD_DCtx* dctx = ZSTD_createDCtx();
+        size_t res = ZSTD_decompress_usingDict(dctx, log.data(), log.size(), stored.data(), stored.size(),
+                                               dict ? dict->data() : nullptr, dict ? dict->size() : 0);
+        ZSTD_freeDCtx(dctx);
+        if(ZSTD_isError(res) || res != length) {
+            LLOG(ERROR, "Failed to uncompress log", ZSTD_isError(res) ? ZSTD_getErrorName(res) : "size mismatch");
+            return std::string();
+        }
+        return log;
+#else
+        LLOG(ERROR, "Log is compressed with zstd, but laminard was built without LAMINAR_ZSTD");
+        return std::string();
+#endif
+    }
+    unsigned long sz = length;
+    int res = ::uncompress((uint8_t*) log.data(), &sz,
+                           (const uint8_t*) stored.data(), stored.size());
+    if(res != Z_OK) {
+        LLOG(ERROR, "Failed to uncompress log", res);
+        return std::string();
+    }
+    return log;
+}
+
+const char* logContentCoding(LogCodec codec, bool withDictionary) {
+    if(codec == LOG_CODEC_ZLIB)
+        return "deflate";
+    if(codec == LOG_CODEC_ZSTD && !withDictionary)
+        return "zstd";
+    return nullptr;
+}
+
+std::string trainLogDictionary(const std::vector<std::string>& samples) {
+#if defined(LAMINAR_ZSTD)
+    std::string joined;
+    std::vector<size_t> sizes;
+    for(const std::string& sample : samples) {
+        joined.append(sample);
+        sizes.push_back(sample.size());
+    }
+    // A dictionary much larger than a fraction of the samples is just
+    // a copy of them, and ZDICT refuses to build it anyway
+    size_t capacity = std::min<size_t>(LOG_DICT_SIZE, joined.size() / 16);
+    if(capacity < LOG_DICT_MIN_SIZE)
+        return std::string();
+    std::string dict(capacity, '\0');
+    size_t res = ZDICT_trainFromBuffer(dict.data(), dict.size(), joined.data(), sizes.data(), unsigned(sizes.size()));
+    if(ZDICT_isError(res)) {
+        LLOG(WARNING, "Could not train log dictionary", ZDICT_getErrorName(res));
+        return std::string();
+    }
+    dict.resize(res);
+    return dict;
+#else
+    return std::string();
+#endif
+}
+
+CompressionPool::CompressionPool(kj::LowLevelAsyncIoProvider& provider, unsigned nThreads) {
+    efd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+    LASSERT(efd >= 0, "Could not create eventfd", strerror(errno));
+    wake = provider.wrapInputFd(efd);
+    collector = collectResults().eagerlyEvaluate([](kj::Exception&& e){
+        LLOG(ERROR, "Compression pool failed", e.getDescription());
+    });
+    for(unsigned i = 0; i < nThreads; ++i)
+        threads.emplace_back([this](){ work(); });
+}
+
+CompressionPool::~CompressionPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        // jobs which have not started yet are abandoned
+        jobs.clear();
+    }
+    jobAvailable.notify_all();
+    for(std::thread& t : threads)
+        t.join();
+    collector = nullptr;
+    wake = nullptr;
+    close(efd);
+}
+
+kj::Promise<std::string> CompressionPool::run(std::function<std::string()> job) {
+    auto paf = kj::newPromiseAndFulfiller<std::string>();
+    uint64_t id = nextId++;
+    pending.emplace(id, kj::mv(paf.fulfiller));
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(Job{id, kj::mv(job)});
+    }
+    jobAvailable.notify_one();
+    return kj::mv(paf.promise);
+}
+
+void CompressionPool::work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true) {
+        jobAvailable.wait(lock, [this]{ return stopping || !jobs.empty(); });
+        if(stopping)
+            return;
+        Job job = kj::mv(jobs.front());
+        jobs.pop_front();
+        lock.unlock();
+        std::string result = job.fn();
+        lock.lock();
+        results.emplace_back(job.id, kj::mv(result));
+        // one wakeup may cover the results of several jobs
+        if(results.size() == 1)
+            eventfd_write(efd, 1);
+    }
+}
+
+kj::Promise<void> CompressionPool::collectResults() {
+    return wake->read(&wakeups, sizeof(wakeups)).then([this](){
+        std::vector<std::pair<uint64_t, std::string>> done;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::swap(done, results);
+        }
+        for(auto& result : done) {
+            auto it = pending.find(result.first);
+            // the fulfiller is still called if the promise was dropped,
+            // it just has no effect
+            it->second->fulfill(kj::mv(result.second));
+            pending.erase(it);
+        }
+        return collectResults();
+    });
+}
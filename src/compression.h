@@ -0,0 +1,103 @@
+///
+/// Copyright 2026 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#pragma once
+
+#include <kj/async-io.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Logs shorter than this are stored in the database uncompressed,
+// whatever the codec
+#define COMPRESS_LOG_MIN_SIZE 1024
+
+// Codec of a log stored in the database, as recorded in the outputCodec
+// column. Rows from before the column was added are NULL, i.e. zlib.
+enum LogCodec {
+    LOG_CODEC_ZLIB = 0,
+    LOG_CODEC_ZSTD = 1,
+};
+
+// The codec for newly stored logs: zstd if built with LAMINAR_ZSTD
+LogCodec defaultLogCodec();
+
+// Compresses the log of a run for storage in the database. Returns the
+// log as it is if it is too short to be worth compressing. A dictionary
+// may be given for zstd, which then is also needed to decompress it.
+std::string compressLog(const std::string& log, LogCodec codec = LOG_CODEC_ZLIB, const std::string* dict = nullptr);
+
+// The inverse of compressLog, given the length of the original log.
+// Returns an empty string if the data could not be decompressed.
+std::string uncompressLog(const std::string& stored, size_t length, LogCodec codec = LOG_CODEC_ZLIB, const std::string* dict = nullptr);
+
+// The HTTP content coding in which a stored log can be sent to clients
+// as it is, or nullptr if it has to be decompressed. What HTTP calls
+// deflate is in fact a zlib stream. Logs compressed with a dictionary
+// can only be read with it, so they are never sent as they are.
+const char* logContentCoding(LogCodec codec, bool withDictionary);
+
+// Trains a zstd dictionary from sample logs, typically recent logs of the
+// same job. Returns an empty string if there is not enough sample data,
+// or if built without LAMINAR_ZSTD.
+std::string trainLogDictionary(const std::vector<std::string>& samples);
+
+// A small pool of threads to keep (de)compression of large logs off the
+// event loop. Jobs run in parallel on as many threads as were requested,
+// and their results are delivered back to the event loop through an
+// eventfd, so the returned promises resolve on the thread which created
+// the pool. Jobs must not throw and must not touch state of the event
+// loop thread.
+class CompressionPool {
+public:
+    CompressionPool(kj::LowLevelAsyncIoProvider& provider, unsigned threads);
+    ~CompressionPool();
+
+    kj::Promise<std::string> run(std::function<std::string()> job);
+
+private:
+    void work();
+    kj::Promise<void> collectResults();
+
+    struct Job {
+        uint64_t id;
+        std::function<std::string()> fn;
+    };
+
+    // shared with the worker threads
+    std::mutex mutex;
+    std::condition_variable jobAvailable;
+    std::deque<Job> jobs;
+    std::vector<std::pair<uint64_t, std::string>> results;
+    bool stopping = false;
+
+    // only touched by the event loop thread
+    uint64_t nextId = 0;
+    std::unordered_map<uint64_t, kj::Own<kj::PromiseFulfiller<std::string>>> pending;
+    int efd;
+    kj::Own<kj::AsyncInputStream> wake;
+    uint64_t wakeups;
+    kj::Promise<void> collector = nullptr;
+
+    std::vector<std::thread> threads;
+};
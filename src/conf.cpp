@@ -23,6 +23,9 @@
 template <>
 int StringMap::convert(std::string e) { return atoi(e.c_str()); }
 
+template <>
+double StringMap::convert(std::string e) { return atof(e.c_str()); }
+
 StringMap parseConfFile(const char* path) {
     StringMap result;
     std::ifstream f(path);
@@ -34,6 +34,8 @@ private:
 };
 template <>
 int StringMap::convert(std::string e);
+template <>
+double StringMap::convert(std::string e);
 
 // Reads a file by line into a list of key/value pairs
 // separated by the first '=' character. Discards lines
@@ -18,6 +18,9 @@
 ///
 #pragma once
 
+#include "sysload.h"
+#include "cgroup.h"
+
 #include <string>
 #include <set>
 class Run;
@@ -33,5 +36,9 @@ public:
     int numExecutors;
     int busyExecutors = 0;
     std::set<std::string> jobPatterns;
+    // If enabled, runs are held in the queue while the host is too busy
+    LoadLimits loadLimits;
+    // Default resource limits for runs in this context, if cgroups are used
+    CgroupLimits cgroupLimits;
 };
 
@@ -63,6 +63,16 @@ Database::~Database() {
     sqlite3_close(hdl);
 }
 
+void Database::begin() {
+    if(depth++ == 0)
+        exec("BEGIN TRANSACTION");
+}
+
+void Database::commit() {
+    if(depth > 0 && --depth == 0)
+        exec("COMMIT");
+}
+
 Database::Statement::Statement(sqlite3 *db, const char *query) :
     stmt(nullptr)
 {
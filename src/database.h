@@ -143,9 +143,17 @@ public:
     }
     // shorthand
     bool exec(const char* q) { return Statement(hdl, q).exec(); }
+
+    // Group the following statements into a single transaction, which
+    // is written out by the matching commit(). Nested calls join the
+    // outermost transaction, so only its commit() writes anything.
+    void begin();
+    void commit();
+    bool inTransaction() const { return depth > 0; }
 private:
 
     sqlite3* hdl;
+    int depth = 0;
 };
 
 // specialization declarations, defined in source file
@@ -23,6 +23,34 @@
 
 #include "laminar.h"
 
+#include <kj/async-io.h>
+#include <rapidjson/document.h>
+#include <chrono>
+#include <climits>
+#include <fcntl.h>
+#include <algorithm>
+#include <future>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+
+// Number of recent events kept for SSE clients resuming with Last-Event-ID
+#define EVENT_REPLAY_SIZE 256
+
+// Number of subscriptions a WebSocket client may have open at once. The
+// frontend needs one for the current view and one for a log
+#define WS_MAX_CHANNELS 64
+
+// Formats an event for a client. Over SSE (channel < 0) the id is sent back
+// by the client in the Last-Event-ID header when it reconnects. Over a
+// WebSocket, the channel tells the client which subscription it is for.
+static std::string formatEvent(int channel, uint64_t seq, const std::string& data) {
+    if(channel < 0)
+        return "id: " + std::to_string(seq) + "\ndata: " + data + "\n\n";
+    return "{\"channel\":" + std::to_string(channel) + ",\"id\":\"" + std::to_string(seq) + "\",\"data\":" + data + "}";
+}
+
 // Helper class which wraps another class with calls to
 // adding and removing a pointer to itself from a passed
 // std::set reference. Used to keep track of currently
@@ -44,15 +72,173 @@ private:
 
 struct EventPeer {
     MonitorScope scope;
+    // the WebSocket channel of the subscription, or -1 for SSE
+    int channel = -1;
     std::list<std::string> pendingOutput;
     kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+    // Until the initial status has been fetched, events are held back
+    // along with their sequence number
+    bool awaitingStatus = false;
+    std::list<std::pair<uint64_t, std::string>> heldBack;
+
+    void push(uint64_t seq, std::string message) {
+        if(awaitingStatus) {
+            heldBack.emplace_back(seq, kj::mv(message));
+        } else {
+            pendingOutput.push_back(kj::mv(message));
+            if(fulfiller)
+                fulfiller->fulfill();
+        }
+    }
+
+    std::string format(uint64_t seq, const std::string& data) const {
+        return formatEvent(channel, seq, data);
+    }
+
+    // An empty message, sent when there has been no activity for a while
+    std::string keepalive() const {
+        if(channel < 0)
+            return ":\n\n";
+        return "{\"channel\":" + std::to_string(channel) + "}";
+    }
+
+    // The status sent to the client reflects all events up to seq
+    void statusSent(uint64_t seq) {
+        awaitingStatus = false;
+        for(auto& e : heldBack) {
+            if(e.first > seq)
+                pendingOutput.push_back(kj::mv(e.second));
+        }
+        heldBack.clear();
+    }
 };
 
 struct LogWatcher {
     std::string job;
+    // zero while the latest run of job is still being looked up
     uint run;
     std::list<std::string> pendingOutput;
-    kj::Own<kj::PromiseFulfiller<bool>> fulfiller;
+    bool complete = false;
+    kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+    // Until the log so far has been fetched, chunks are held back along
+    // with their sequence number
+    bool awaitingLog = false;
+    struct Chunk {
+        uint64_t seq;
+        uint run;
+        std::string data;
+        bool eot;
+    };
+    std::list<Chunk> heldBack;
+
+    bool wants(const std::string& j, uint r) const {
+        return job == j && (run == r || (awaitingLog && run == 0));
+    }
+
+    void push(uint64_t seq, uint r, std::string chunk, bool eot) {
+        if(awaitingLog) {
+            heldBack.push_back({seq, r, kj::mv(chunk), eot});
+        } else {
+            pendingOutput.push_back(kj::mv(chunk));
+            complete = complete || eot;
+            if(fulfiller)
+                fulfiller->fulfill();
+        }
+    }
+
+    // The log of run r sent to the client contains all chunks up to seq
+    void logSent(uint r, uint64_t seq) {
+        run = r;
+        awaitingLog = false;
+        for(Chunk& c : heldBack) {
+            if(c.run == r && c.seq > seq)
+                push(c.seq, c.run, kj::mv(c.data), c.eot);
+        }
+        heldBack.clear();
+    }
+};
+
+// Serves HTTP connections on a thread with its own event loop. Requests
+// involving the Laminar object are passed back to the primary thread,
+// which in turn forwards notifications for the clients of this thread.
+class HttpWorker {
+public:
+    HttpWorker(Laminar& laminar, Http& primary) :
+        primaryThread(kj::getCurrentThreadExecutor())
+    {
+        std::promise<void> ready;
+        thread = std::thread([this, &laminar, &primary, &ready](){
+            run(laminar, primary, ready);
+        });
+        ready.get_future().wait();
+    }
+
+    ~HttpWorker() {
+        executor->executeSync([this](){
+            stop->fulfill();
+        });
+        thread.join();
+    }
+
+    // Takes ownership of fd, a connected socket
+    kj::Promise<void> serve(int fd) {
+        return executor->executeAsync([this, fd](){
+            auto stream = io->wrapSocketFd(fd, kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP |
+                                               kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC |
+                                               kj::LowLevelAsyncIoProvider::ALREADY_NONBLOCK);
+            connections->add(server->listenHttp(kj::mv(stream)));
+        });
+    }
+
+    kj::Promise<void> notifyEvent(std::string data, std::string job, uint64_t seq) {
+        return executor->executeAsync([this, data = kj::mv(data), job = kj::mv(job), seq](){
+            http->deliverEvent(data.c_str(), job, seq);
+        });
+    }
+
+    kj::Promise<void> notifyLog(std::string job, uint run, std::string chunk, bool eot, uint64_t seq) {
+        return executor->executeAsync([this, job = kj::mv(job), run, chunk = kj::mv(chunk), eot, seq](){
+            http->deliverLog(job, run, chunk, eot, seq);
+        });
+    }
+
+    kj::Promise<void> setIndex(std::string index) {
+        return executor->executeAsync([this, index = kj::mv(index)](){
+            http->setIndex(index);
+        });
+    }
+
+private:
+    void run(Laminar& laminar, Http& primary, std::promise<void>& ready) {
+        auto ioContext = kj::setupAsyncIo();
+        Http worker(laminar, primary, primaryThread);
+        if(!primary.index.empty())
+            worker.setIndex(primary.index);
+        kj::HttpServer httpServer(ioContext.provider->getTimer(), *worker.headerTable, worker);
+        kj::TaskSet workerConnections(worker);
+        auto paf = kj::newPromiseAndFulfiller<void>();
+
+        io = ioContext.lowLevelProvider.get();
+        http = &worker;
+        server = &httpServer;
+        connections = &workerConnections;
+        executor = &kj::getCurrentThreadExecutor();
+        stop = kj::mv(paf.fulfiller);
+        ready.set_value();
+
+        paf.promise.exclusiveJoin(worker.cleanupPeers(ioContext.provider->getTimer())).wait(ioContext.waitScope);
+        stop = nullptr;
+    }
+
+    const kj::Executor& primaryThread;
+    std::thread thread;
+    // set up by the worker thread before it signals readiness
+    const kj::Executor* executor;
+    kj::LowLevelAsyncIoProvider* io;
+    Http* http;
+    kj::HttpServer* server;
+    kj::TaskSet* connections;
+    kj::Own<kj::PromiseFulfiller<void>> stop;
 };
 
 kj::Maybe<MonitorScope> fromUrl(std::string resource, char* query) {
@@ -107,6 +293,61 @@ kj::Maybe<MonitorScope> fromUrl(std::string resource, char* query) {
     return kj::mv(scope);
 }
 
+// Returns the content codings listed in an Accept-Encoding header,
+// except those explicitly refused with q=0
+static std::set<std::string> acceptedEncodings(kj::Maybe<kj::StringPtr> header) {
+    std::set<std::string> encodings;
+    KJ_IF_MAYBE(h, header) {
+        std::istringstream iss(h->cStr());
+        for(std::string coding; std::getline(iss, coding, ',');) {
+            std::string params;
+            if(size_t semi = coding.find(';'); semi != std::string::npos) {
+                params = coding.substr(semi + 1);
+                coding.erase(semi);
+            }
+            coding.erase(0, coding.find_first_not_of(" \t"));
+            coding.erase(coding.find_last_not_of(" \t") + 1);
+            params.erase(std::remove_if(params.begin(), params.end(), [](char c){ return c == ' ' || c == '\t'; }), params.end());
+            if(params.rfind("q=0", 0) == 0 && params.find_first_not_of("0.", 2) == std::string::npos)
+                continue;
+            if(!coding.empty())
+                encodings.insert(coding);
+        }
+    }
+    return encodings;
+}
+
+// Returns the value of a parameter in a query string, without modifying
+// it as fromUrl does
+static std::string queryParam(const char* query, const char* name) {
+    if(query) {
+        std::istringstream iss(query);
+        for(std::string param; std::getline(iss, param, '&');) {
+            size_t eq = param.find('=');
+            if(eq != std::string::npos && param.compare(0, eq, name) == 0)
+                return param.substr(eq + 1);
+        }
+    }
+    return std::string();
+}
+
+// Whether an If-None-Match header lists the given entity tag. The
+// comparison is weak, as RFC 9110 requires for this header
+static bool etagMatches(kj::Maybe<kj::StringPtr> header, kj::StringPtr etag) {
+    KJ_IF_MAYBE(h, header) {
+        std::istringstream iss(h->cStr());
+        for(std::string tag; std::getline(iss, tag, ',');) {
+            tag.erase(0, tag.find_first_not_of(" \t"));
+            tag.erase(tag.find_last_not_of(" \t") + 1);
+            if(tag.rfind("W/", 0) == 0)
+                tag.erase(0, 2);
+            if(tag == "*" || tag == etag.cStr())
+                return true;
+        }
+    }
+    return false;
+}
+
 // Parses the url of the form /log/NAME/NUMBER, filling in the passed
 // references and returning true if successful. /log/NAME/latest is
 // also allowed, in which case the num reference is set to 0
@@ -119,7 +360,7 @@ bool Http::parseLogEndpoint(kj::StringPtr url, std::string& name, uint& num) {
             num = static_cast<uint>(atoi(tail.begin()));
             name.erase(*sep);
             if(tail == "latest")
-                num = laminar.latestRun(name);
+                return true;
             if(num > 0)
                 return true;
         }
@@ -127,6 +368,18 @@ bool Http::parseLogEndpoint(kj::StringPtr url, std::string& name, uint& num) {
     return false;
 }
 
+template<typename Fn>
+auto Http::withLaminar(Fn&& fn) {
+    if(primaryThread) {
+        return primaryThread->executeAsync([&l = laminar, fn = kj::fwd<Fn>(fn)]() mutable {
+            return fn(l);
+        });
+    }
+    return kj::evalNow([&](){
+        return fn(laminar);
+    });
+}
+
 kj::Promise<void> Http::cleanupPeers(kj::Timer& timer)
 {
     return timer.afterDelay(15 * kj::SECONDS).then([&]{
@@ -137,8 +390,7 @@ kj::Promise<void> Http::cleanupPeers(kj::Timer& timer)
             // removed it from the eventPeers list, we will see a null fulfiller
             // here
             if(p->fulfiller) {
-                // an empty SSE message is a colon followed by two newlines
-                p->pendingOutput.push_back(":\n\n");
+                p->pendingOutput.push_back(p->keepalive());
                 p->fulfiller->fulfill();
             }
         }
@@ -147,9 +399,13 @@ kj::Promise<void> Http::cleanupPeers(kj::Timer& timer)
 }
 
 kj::Promise<void> writeEvents(EventPeer* peer, kj::AsyncOutputStream* stream) {
-    auto paf = kj::newPromiseAndFulfiller<void>();
-    peer->fulfiller = kj::mv(paf.fulfiller);
-    return paf.promise.then([=]{
+    kj::Promise<void> ready = kj::READY_NOW;
+    if(peer->pendingOutput.empty()) {
+        auto paf = kj::newPromiseAndFulfiller<void>();
+        peer->fulfiller = kj::mv(paf.fulfiller);
+        ready = kj::mv(paf.promise);
+    }
+    return ready.then([=]{
         kj::Promise<void> p = kj::READY_NOW;
         std::list<std::string> chunks = kj::mv(peer->pendingOutput);
         for(std::string& s : chunks) {
@@ -164,9 +420,14 @@ kj::Promise<void> writeEvents(EventPeer* peer, kj::AsyncOutputStream* stream) {
 }
 
 kj::Promise<void> writeLogChunk(LogWatcher* client, kj::AsyncOutputStream* stream) {
-    auto paf = kj::newPromiseAndFulfiller<bool>();
-    client->fulfiller = kj::mv(paf.fulfiller);
-    return paf.promise.then([=](bool done){
+    kj::Promise<void> ready = kj::READY_NOW;
+    if(client->pendingOutput.empty() && !client->complete) {
+        auto paf = kj::newPromiseAndFulfiller<void>();
+        client->fulfiller = kj::mv(paf.fulfiller);
+        ready = kj::mv(paf.promise);
+    }
+    return ready.then([=](){
+        bool done = client->complete;
         kj::Promise<void> p = kj::READY_NOW;
         std::list<std::string> chunks = kj::mv(client->pendingOutput);
         for(std::string& s : chunks) {
@@ -180,10 +441,207 @@ kj::Promise<void> writeLogChunk(LogWatcher* client, kj::AsyncOutputStream* strea
     });
 }
 
+// A WebSocket connection over which a client subscribes to any number of
+// event scopes and logs. Each subscription is identified by a channel
+// number chosen by the client. Events are sent as text messages, log
+// output as binary messages prefixed by the channel as 32-bit big endian.
+struct WebSocketClient {
+    WebSocketClient(kj::Own<kj::WebSocket>&& ws) :
+        ws(kj::mv(ws)),
+        sendQueue(kj::Promise<void>(kj::READY_NOW).fork())
+    {}
+
+    // Messages have to be sent one at a time. The returned promise
+    // resolves when this one has been sent
+    kj::Promise<void> send(std::string message, bool binary = false) {
+        enqueue(kj::mv(message), binary);
+        return sendQueue.addBranch();
+    }
+
+    // Replies to a command which could not be handled. A channel of -1
+    // means the command was not understood well enough to tell
+    void sendError(int channel, const char* error) {
+        enqueue(std::string("{") + (channel < 0 ? "" : "\"channel\":" + std::to_string(channel) + ",")
+                + "\"error\":\"" + error + "\"}");
+    }
+
+    kj::Promise<void> sendLog(uint channel, std::string chunk) {
+        char prefix[4] = { char(channel >> 24), char(channel >> 16), char(channel >> 8), char(channel) };
+        return send(std::string(prefix, sizeof(prefix)) + chunk, true);
+    }
+
+    kj::Own<kj::WebSocket> ws;
+    kj::ForkedPromise<void> sendQueue;
+    // Cancelling the promise of a subscription unregisters it
+    std::map<uint, kj::Promise<void>> channels;
+    // Subscriptions which ended by themselves, like the log of a completed
+    // run. Their promises cannot remove themselves from channels, so this
+    // is done when the next command is received
+    std::vector<uint> ended;
+
+private:
+    void enqueue(std::string message, bool binary = false) {
+        sendQueue = sendQueue.addBranch().then([this, message = kj::mv(message), binary]{
+            if(binary)
+                return ws->send(kj::arrayPtr(reinterpret_cast<const kj::byte*>(message.data()), message.size()));
+            return ws->send(kj::arrayPtr(message.data(), message.size()));
+        }).fork();
+    }
+};
+
+static kj::Promise<void> sendEvents(EventPeer* peer, WebSocketClient* client) {
+    kj::Promise<void> ready = kj::READY_NOW;
+    if(peer->pendingOutput.empty()) {
+        auto paf = kj::newPromiseAndFulfiller<void>();
+        peer->fulfiller = kj::mv(paf.fulfiller);
+        ready = kj::mv(paf.promise);
+    }
+    return ready.then([=]{
+        kj::Promise<void> p = kj::READY_NOW;
+        for(std::string& s : peer->pendingOutput)
+            p = client->send(kj::mv(s));
+        peer->pendingOutput.clear();
+        return p.then([=]{
+            return sendEvents(peer, client);
+        });
+    });
+}
+
+static kj::Promise<void> sendLog(LogWatcher* lw, WebSocketClient* client, uint channel) {
+    kj::Promise<void> ready = kj::READY_NOW;
+    if(lw->pendingOutput.empty() && !lw->complete) {
+        auto paf = kj::newPromiseAndFulfiller<void>();
+        lw->fulfiller = kj::mv(paf.fulfiller);
+        ready = kj::mv(paf.promise);
+    }
+    return ready.then([=]{
+        kj::Promise<void> p = kj::READY_NOW;
+        for(std::string& s : lw->pendingOutput) {
+            if(!s.empty())
+                p = client->sendLog(channel, kj::mv(s));
+        }
+        lw->pendingOutput.clear();
+        if(lw->complete)
+            return p.then([=]{
+                return client->send("{\"channel\":" + std::to_string(channel) + ",\"eot\":true}");
+            });
+        return p.then([=]{
+            return sendLog(lw, client, channel);
+        });
+    });
+}
+
+kj::Promise<Http::EventSnapshot> Http::eventSnapshot(MonitorScope scope, int channel, uint64_t lastEventId)
+{
+    return withLaminar([scope = kj::mv(scope), channel, lastEventId, &primary = primary](Laminar& l){
+        // the missed events if possible, otherwise the whole status
+        std::list<std::string> output;
+        if(!lastEventId || !primary.replayEvents(scope, channel, lastEventId, output))
+            output.push_back(formatEvent(channel, primary.notifySeq, l.getStatus(scope)));
+        return EventSnapshot(kj::mv(output), primary.notifySeq);
+    });
+}
+
+kj::Promise<void> Http::receiveCommands(WebSocketClient* client)
+{
+    return client->ws->receive().then([this, client](kj::WebSocket::Message&& message) -> kj::Promise<void> {
+        if(message.is<kj::WebSocket::Close>())
+            return kj::READY_NOW;
+        if(message.is<kj::String>())
+            handleCommand(client, message.get<kj::String>());
+        return receiveCommands(client);
+    });
+}
+
+// Commands are JSON objects with an "op" and the "channel" it refers to:
+//   {"op":"watch", "channel":1, "path":"/jobs/foo", "query":"page=1", "lastEventId":"123"}
+//   {"op":"log", "channel":2, "job":"foo", "run":3, "offset":1024}
+//   {"op":"close", "channel":1}
+// A channel which is open has to be closed before it can be reused, and
+// at most WS_MAX_CHANNELS may be open at once. Commands which cannot be
+// handled are answered with {"channel":1, "error":"..."}. A client which
+// reconnects resumes its subscriptions with the lastEventId and offset
+// (the length of the log it already has) it got so far.
+void Http::handleCommand(WebSocketClient* client, kj::StringPtr command)
+{
+    rapidjson::Document d;
+    d.Parse(command.cStr());
+    if(d.HasParseError() || !d.IsObject() || !d.HasMember("op") || !d["op"].IsString()
+            || !d.HasMember("channel") || !d["channel"].IsUint() || d["channel"].GetUint() > INT_MAX) {
+        client->sendError(-1, "Invalid command");
+        return;
+    }
+    std::string op = d["op"].GetString();
+    uint channel = d["channel"].GetUint();
+    auto str = [&](const char* key) -> std::string {
+        return d.HasMember(key) && d[key].IsString() ? d[key].GetString() : "";
+    };
+
+    for(uint c : client->ended)
+        client->channels.erase(c);
+    client->ended.clear();
+
+    if(op == "close") {
+        client->channels.erase(channel);
+        return;
+    }
+    if(client->channels.count(channel)) {
+        client->sendError(int(channel), "Channel in use");
+        return;
+    }
+    if(client->channels.size() >= WS_MAX_CHANNELS) {
+        client->sendError(int(channel), "Too many channels");
+        return;
+    }
+
+    if(op == "watch") {
+        std::string query = str("query");
+        KJ_IF_MAYBE(s, fromUrl(str("path"), query.empty() ? nullptr : query.data())) {
+            auto peer = kj::heap<WithSetRef<EventPeer>>(eventPeers);
+            peer->scope = *s;
+            peer->channel = int(channel);
+            peer->awaitingStatus = true;
+            uint64_t lastEventId = strtoull(str("lastEventId").c_str(), nullptr, 10);
+            client->channels.emplace(channel, eventSnapshot(*s, int(channel), lastEventId).then([client, peer = kj::mv(peer)](EventSnapshot snapshot) mutable {
+                peer->pendingOutput = kj::mv(snapshot.first);
+                peer->statusSent(snapshot.second);
+                return sendEvents(peer.get(), client).attach(kj::mv(peer));
+            }).eagerlyEvaluate(nullptr));
+        } else {
+            client->sendError(int(channel), "Not Found");
+        }
+    } else if(op == "log" && d.HasMember("run") && d["run"].IsUint() && d["run"].GetUint() > 0) {
+        std::string name = str("job");
+        uint num = d["run"].GetUint();
+        size_t offset = d.HasMember("offset") && d["offset"].IsUint64() ? d["offset"].GetUint64() : 0;
+        auto lw = kj::heap<WithSetRef<LogWatcher>>(logWatchers);
+        lw->job = name;
+        lw->run = num;
+        lw->awaitingLog = true;
+        client->channels.emplace(channel, withLaminar([name, num, &primary = primary](Laminar& l) {
+            uint64_t seq = primary.notifySeq;
+            return l.handleLogRequest(name, num).then([seq](kj::Maybe<Laminar::RunLog> log){
+                return std::make_pair(kj::mv(log), seq);
+            });
+        }).then([client, channel, offset, lw = kj::mv(lw)](std::pair<kj::Maybe<Laminar::RunLog>, uint64_t> snapshot) mutable -> kj::Promise<void> {
+            KJ_IF_MAYBE(log, snapshot.first) {
+                lw->pendingOutput.push_back(log->output.substr(std::min(offset, log->output.size())));
+                lw->complete = log->complete;
+                lw->logSent(lw->run, snapshot.second);
+                return sendLog(lw.get(), client, channel).attach(kj::mv(lw));
+            }
+            return client->send("{\"channel\":" + std::to_string(channel) + ",\"error\":\"Not Found\"}");
+        }).then([client, channel]{
+            client->ended.push_back(channel);
+        }).eagerlyEvaluate(nullptr));
+    } else {
+        client->sendError(int(channel), "Invalid command");
+    }
+}
+
 kj::Promise<void> Http::request(kj::HttpMethod method, kj::StringPtr url, const kj::HttpHeaders &headers, kj::AsyncInputStream &requestBody, HttpService::Response &response)
 {
-    const char* start, *end, *content_type;
-    std::string badge;
+    Resources::Content content;
     // for log requests
     std::string name;
     uint num;
@@ -208,102 +666,281 @@ kj::Promise<void> Http::request(kj::HttpMethod method, kj::StringPtr url, const
     }
 
     if(is_sse) {
+        // EventSource sends the header when it reconnects by itself. A client
+        // which reconnects with a new EventSource can use the query instead
+        uint64_t lastEventId = strtoull(queryParam(queryString, "lastEventId").c_str(), nullptr, 10);
+        KJ_IF_MAYBE(id, headers.get(LAST_EVENT_ID)) {
+            lastEventId = strtoull(id->cStr(), nullptr, 10);
+        }
         KJ_IF_MAYBE(s, fromUrl(url.cStr(), queryString)) {
             responseHeaders.set(kj::HttpHeaderId::CONTENT_TYPE, "text/event-stream");
             // Disables nginx reverse-proxy's buffering. Necessary for streamed events.
             responseHeaders.add("X-Accel-Buffering", "no");
+            // Registered right away, so that no event is missed while the
+            // status is being fetched
             auto peer = kj::heap<WithSetRef<EventPeer>>(eventPeers);
             peer->scope = *s;
-            std::string st = "data: " + laminar.getStatus(peer->scope) + "\n\n";
+            peer->awaitingStatus = true;
             auto stream = response.send(200, "OK", responseHeaders);
-            return stream->write(st.data(), st.size()).attach(kj::mv(st)).then([=,s=stream.get(),p=peer.get()]{
-                return writeEvents(p,s);
-            }).attach(kj::mv(stream)).attach(kj::mv(peer));
+            return eventSnapshot(*s, -1, lastEventId).then([stream = kj::mv(stream), peer = kj::mv(peer)](EventSnapshot snapshot) mutable {
+                peer->pendingOutput = kj::mv(snapshot.first);
+                peer->statusSent(snapshot.second);
+                auto s = stream.get();
+                return writeEvents(peer.get(), s).attach(kj::mv(stream)).attach(kj::mv(peer));
+            });
         }
+    } else if(url == "/ws" && headers.isWebSocket()) {
+        auto client = kj::heap<WebSocketClient>(response.acceptWebSocket(responseHeaders));
+        auto c = client.get();
+        return receiveCommands(c).attach(kj::mv(client));
     } else if(url.startsWith("/archive/")) {
-        KJ_IF_MAYBE(file, laminar.getArtefact(url.slice(strlen("/archive/")))) {
-            auto array = (*file)->mmap(0, (*file)->stat().size);
-            responseHeaders.add("Content-Transfer-Encoding", "binary");
-            auto stream = response.send(200, "OK", responseHeaders, array.size());
-            return stream->write(array.begin(), array.size()).attach(kj::mv(array)).attach(kj::mv(file)).attach(kj::mv(stream));
-        }
+        return withLaminar([path = std::string(url.slice(strlen("/archive/")).cStr())](Laminar& l){
+            return l.getArtefact(path);
+        }).then([&response, responseHeaders = kj::mv(responseHeaders)](kj::Maybe<kj::Own<const kj::ReadableFile>> artefact) mutable -> kj::Promise<void> {
+            KJ_IF_MAYBE(file, artefact) {
+                auto array = (*file)->mmap(0, (*file)->stat().size);
+                responseHeaders.add("Content-Transfer-Encoding", "binary");
+                auto stream = response.send(200, "OK", responseHeaders, array.size());
+                return stream->write(array.begin(), array.size()).attach(kj::mv(array)).attach(kj::mv(*file)).attach(kj::mv(stream));
+            }
+            return response.sendError(404, "Not Found", responseHeaders);
+        });
     } else if(parseLogEndpoint(url, name, num)) {
-        bool complete;
-        std::string output;
-        if(laminar.handleLogRequest(name, num, output, complete)) {
-            responseHeaders.set(kj::HttpHeaderId::CONTENT_TYPE, "text/plain; charset=utf-8");
-            responseHeaders.add("Content-Transfer-Encoding", "binary");
-            // Disables nginx reverse-proxy's buffering. Necessary for dynamic log output.
-            responseHeaders.add("X-Accel-Buffering", "no");
-            auto stream = response.send(200, "OK", responseHeaders, nullptr);
-            auto s = stream.get();
-            auto lw = kj::heap<WithSetRef<LogWatcher>>(logWatchers);
-            lw->job = name;
-            lw->run = num;
-            auto promise = writeLogChunk(lw.get(), stream.get()).attach(kj::mv(stream)).attach(kj::mv(lw));
-            return s->write(output.data(), output.size()).attach(kj::mv(output)).then([p=kj::mv(promise),complete]() mutable {
-                if(complete)
-                    return kj::Promise<void>(kj::READY_NOW);
-                return kj::mv(p);
+        // Registered right away, so that no output is missed while the
+        // log so far is being fetched
+        auto lw = kj::heap<WithSetRef<LogWatcher>>(logWatchers);
+        lw->job = name;
+        lw->run = num;
+        lw->awaitingLog = true;
+        struct LogSnapshot {
+            kj::Maybe<Laminar::RunLog> log;
+            uint num;
+            uint64_t seq;
+        };
+        return withLaminar([name, num, &primary = primary, encodings = acceptedEncodings(headers.get(ACCEPT_ENCODING))](Laminar& l) -> kj::Promise<LogSnapshot> {
+            uint n = num ? num : l.latestRun(name);
+            uint64_t seq = primary.notifySeq;
+            if(n == 0)
+                return LogSnapshot{nullptr, n, seq};
+            return l.handleLogRequest(name, n, encodings).then([n, seq](kj::Maybe<Laminar::RunLog> log){
+                return LogSnapshot{kj::mv(log), n, seq};
             });
+        }).then([&response, responseHeaders = kj::mv(responseHeaders), lw = kj::mv(lw)](LogSnapshot snapshot) mutable -> kj::Promise<void> {
+            KJ_IF_MAYBE(log, snapshot.log) {
+                responseHeaders.set(kj::HttpHeaderId::CONTENT_TYPE, "text/plain; charset=utf-8");
+                responseHeaders.add("Content-Transfer-Encoding", "binary");
+                responseHeaders.add("Vary", "Accept-Encoding");
+                if(log->encoding) {
+                    // a completed log, sent just as it is stored
+                    responseHeaders.add("Content-Encoding", log->encoding);
+                    auto stream = response.send(200, "OK", responseHeaders, log->output.size());
+                    return stream->write(log->output.data(), log->output.size()).attach(kj::mv(log->output)).attach(kj::mv(stream));
+                }
+                lw->logSent(snapshot.num, snapshot.seq);
+                // Disables nginx reverse-proxy's buffering. Necessary for dynamic log output.
+                responseHeaders.add("X-Accel-Buffering", "no");
+                auto stream = response.send(200, "OK", responseHeaders, nullptr);
+                auto s = stream.get();
+                auto promise = writeLogChunk(lw.get(), stream.get()).attach(kj::mv(stream)).attach(kj::mv(lw));
+                return s->write(log->output.data(), log->output.size()).attach(kj::mv(log->output)).then([p=kj::mv(promise),complete=log->complete]() mutable {
+                    if(complete)
+                        return kj::Promise<void>(kj::READY_NOW);
+                    return kj::mv(p);
+                });
+            }
+            return response.sendError(404, "Not Found", responseHeaders);
+        });
+    } else if(resources->handleRequest(url.cStr(), acceptedEncodings(headers.get(ACCEPT_ENCODING)), content)) {
+        // each coding of a resource is a representation of its own
+        kj::String etag = content.content_encoding
+                ? kj::str("\"", content.hash, "-", content.content_encoding, "\"")
+                : kj::str("\"", content.hash, "\"");
+        responseHeaders.set(kj::HttpHeaderId::CONTENT_TYPE, content.content_type);
+        if(content.content_encoding)
+            responseHeaders.add("Content-Encoding", content.content_encoding);
+        responseHeaders.add("Vary", "Accept-Encoding");
+        // The URLs generated by Resources::renderIndex carry the hash of the
+        // content they refer to, so it never changes. Anything else has to be
+        // revalidated, which is cheap with the ETag
+        if(queryParam(queryString, "v") == content.hash)
+            responseHeaders.add("Cache-Control", "public, max-age=31536000, immutable");
+        else
+            responseHeaders.add("Cache-Control", "no-cache");
+        if(etagMatches(headers.get(IF_NONE_MATCH), etag)) {
+            responseHeaders.add("ETag", kj::mv(etag));
+            response.send(304, "Not Modified", responseHeaders, uint64_t(0));
+            return kj::READY_NOW;
         }
-    } else if(resources->handleRequest(url.cStr(), &start, &end, &content_type)) {
-        responseHeaders.set(kj::HttpHeaderId::CONTENT_TYPE, content_type);
-        responseHeaders.add("Content-Encoding", "gzip");
+        responseHeaders.add("ETag", kj::mv(etag));
         responseHeaders.add("Content-Transfer-Encoding", "binary");
-        auto stream = response.send(200, "OK", responseHeaders, end-start);
-        return stream->write(start, end-start).attach(kj::mv(stream));
-    } else if(url.startsWith("/badge/") && url.endsWith(".svg") && laminar.handleBadgeRequest(std::string(url.begin()+7, url.size()-11), badge)) {
-        responseHeaders.set(kj::HttpHeaderId::CONTENT_TYPE, "image/svg+xml");
-        responseHeaders.add("Cache-Control", "no-cache");
-        auto stream = response.send(200, "OK", responseHeaders, badge.size());
-        return stream->write(badge.data(), badge.size()).attach(kj::mv(badge)).attach(kj::mv(stream));
+        auto stream = response.send(200, "OK", responseHeaders, content.end - content.start);
+        return stream->write(content.start, content.end - content.start).attach(kj::mv(stream));
+    } else if(url.startsWith("/badge/") && url.endsWith(".svg")) {
+        struct Badge {
+            bool found;
+            std::string svg;
+            std::string etag;
+        };
+        kj::Maybe<kj::String> ifNoneMatch = headers.get(IF_NONE_MATCH).map([](kj::StringPtr h){ return kj::str(h); });
+        return withLaminar([job = std::string(url.begin()+7, url.size()-11)](Laminar& l){
+            Badge badge;
+            badge.found = l.handleBadgeRequest(job, badge.svg, badge.etag);
+            return badge;
+        }).then([&response, ifNoneMatch = kj::mv(ifNoneMatch), responseHeaders = kj::mv(responseHeaders)](Badge badge) mutable -> kj::Promise<void> {
+            if(!badge.found)
+                return response.sendError(404, "Not Found", responseHeaders);
+            responseHeaders.set(kj::HttpHeaderId::CONTENT_TYPE, "image/svg+xml");
+            // caches may keep the badge but must revalidate it, which is
+            // cheap because the badge is kept in memory with its ETag
+            responseHeaders.add("Cache-Control", "no-cache");
+            responseHeaders.add("ETag", kj::str(badge.etag));
+            if(etagMatches(ifNoneMatch.map([](kj::String& h) -> kj::StringPtr { return h; }), badge.etag.c_str())) {
+                response.send(304, "Not Modified", responseHeaders, uint64_t(0));
+                return kj::READY_NOW;
+            }
+            auto stream = response.send(200, "OK", responseHeaders, badge.svg.size());
+            return stream->write(badge.svg.data(), badge.svg.size()).attach(kj::mv(badge.svg)).attach(kj::mv(stream));
+        });
     }
     return response.sendError(404, "Not Found", responseHeaders);
 }
 
 Http::Http(Laminar &li) :
   laminar(li),
-  resources(kj::heap<Resources>())
+  primary(*this),
+  primaryThread(nullptr),
+  resources(kj::heap<Resources>()),
+  notifySeq(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count()),
+  replayFrom(notifySeq),
+  nextWorker(0),
+  workerTasks(kj::heap<kj::TaskSet>(*this))
 {
     kj::HttpHeaderTable::Builder builder;
     ACCEPT = builder.add("Accept");
+    ACCEPT_ENCODING = builder.add("Accept-Encoding");
+    IF_NONE_MATCH = builder.add("If-None-Match");
+    LAST_EVENT_ID = builder.add("Last-Event-ID");
+    headerTable = builder.build();
+}
+
+Http::Http(Laminar& li, Http& primary, const kj::Executor& primaryThread) :
+  laminar(li),
+  primary(primary),
+  primaryThread(&primaryThread),
+  resources(kj::heap<Resources>()),
+  notifySeq(0),
+  replayFrom(0),
+  nextWorker(0),
+  workerTasks(kj::heap<kj::TaskSet>(*this))
+{
+    kj::HttpHeaderTable::Builder builder;
+    ACCEPT = builder.add("Accept");
+    ACCEPT_ENCODING = builder.add("Accept-Encoding");
+    IF_NONE_MATCH = builder.add("If-None-Match");
+    LAST_EVENT_ID = builder.add("Last-Event-ID");
     headerTable = builder.build();
 }
 
 Http::~Http()
 {
+    // cancel calls still on their way to the workers before stopping them
+    workerTasks = nullptr;
+    workers.clear();
     LASSERT(logWatchers.size() == 0);
     LASSERT(eventPeers.size() == 0);
 }
 
+void Http::startWorkers(int threads)
+{
+    for(int i = 0; i < threads; ++i)
+        workers.push_back(kj::heap<HttpWorker>(laminar, *this));
+}
+
 kj::Promise<void> Http::startServer(kj::Timer& timer, kj::Own<kj::ConnectionReceiver>&& listener)
 {
+    if(!workers.empty()) {
+        kj::ConnectionReceiver& l = *listener;
+        return dispatchConnections(l).attach(kj::mv(listener));
+    }
     kj::Own<kj::HttpServer> server = kj::heap<kj::HttpServer>(timer, *headerTable, *this);
     return server->listenHttp(*listener).attach(cleanupPeers(timer)).attach(kj::mv(listener)).attach(kj::mv(server));
 }
 
-void Http::notifyEvent(const char *data, std::string job)
+kj::Promise<void> Http::dispatchConnections(kj::ConnectionReceiver& listener)
 {
-    for(EventPeer* c : eventPeers) {
-        if(c->scope.wantsStatus(job)) {
-            c->pendingOutput.push_back("data: " + std::string(data) + "\n\n");
-            c->fulfiller->fulfill();
+    return listener.accept().then([this,&listener](kj::Own<kj::AsyncIoStream>&& connection) {
+        // The connection is bound to this thread's event loop, so hand
+        // over a duplicate of its descriptor instead
+        KJ_IF_MAYBE(fd, connection->getFd()) {
+            int dup = fcntl(*fd, F_DUPFD_CLOEXEC, 0);
+            if(dup >= 0)
+                workerTasks->add(workers[nextWorker++ % workers.size()]->serve(dup));
+            else
+                LLOG(ERROR, "Could not hand over HTTP connection", strerror(errno));
         }
+        return dispatchConnections(listener);
+    });
+}
+
+void Http::notifyEvent(const char *data, std::string job)
+{
+    uint64_t seq = ++notifySeq;
+    replayBuffer.push_back({seq, job, data});
+    if(replayBuffer.size() > EVENT_REPLAY_SIZE) {
+        replayFrom = replayBuffer.front().seq;
+        replayBuffer.pop_front();
     }
+    deliverEvent(data, job, seq);
+    for(auto& worker : workers)
+        workerTasks->add(worker->notifyEvent(data, job, seq));
 }
 
 void Http::notifyLog(std::string job, uint run, std::string log_chunk, bool eot)
+{
+    uint64_t seq = ++notifySeq;
+    deliverLog(job, run, log_chunk, eot, seq);
+    for(auto& worker : workers)
+        workerTasks->add(worker->notifyLog(job, run, log_chunk, eot, seq));
+}
+
+void Http::deliverEvent(const char *data, std::string job, uint64_t seq)
+{
+    for(EventPeer* c : eventPeers) {
+        if(c->scope.wantsStatus(job))
+            c->push(seq, c->format(seq, data));
+    }
+}
+
+bool Http::replayEvents(const MonitorScope& scope, int channel, uint64_t since, std::list<std::string>& output) const
+{
+    // also rejects ids from before a restart or from another server
+    if(since < replayFrom || since > notifySeq)
+        return false;
+    for(const ReplayEvent& e : replayBuffer) {
+        if(e.seq > since && scope.wantsStatus(e.job))
+            output.push_back(formatEvent(channel, e.seq, e.data));
+    }
+    return true;
+}
+
+void Http::deliverLog(std::string job, uint run, std::string log_chunk, bool eot, uint64_t seq)
 {
     for(LogWatcher* lw : logWatchers) {
-        if(lw->job == job && lw->run == run) {
-            lw->pendingOutput.push_back(log_chunk);
-            lw->fulfiller->fulfill(kj::mv(eot));
-        }
+        if(lw->wants(job, run))
+            lw->push(seq, run, log_chunk, eot);
     }
 }
 
-void Http::setHtmlTemplate(std::string tmpl)
+void Http::setIndex(std::string index)
+{
+    this->index = index;
+    resources->setIndex(index);
+    for(auto& worker : workers)
+        workerTasks->add(worker->setIndex(index));
+}
+
+void Http::taskFailed(kj::Exception&& exception)
 {
-    resources->setHtmlTemplate(tmpl);
+    LLOG(ERROR, exception.getDescription());
 }
@@ -20,8 +20,12 @@
 
 #include <kj/memory.h>
 #include <kj/compat/http.h>
+#include <deque>
+#include <list>
 #include <string>
 #include <set>
+#include <utility>
+#include <vector>
 
 // Definition needed for musl
 typedef unsigned int uint;
@@ -29,39 +33,108 @@ typedef unsigned long ulong;
 
 class Laminar;
 class Resources;
+struct MonitorScope;
+class HttpWorker;
+struct WebSocketClient;
 struct LogWatcher;
 struct EventPeer;
 
-class Http : public kj::HttpService {
+class Http : public kj::HttpService, private kj::TaskSet::ErrorHandler {
 public:
     Http(Laminar&li);
     virtual ~Http();
 
+    // Serve HTTP connections on the given number of threads, each with an
+    // event loop of its own. The calling thread then only accepts
+    // connections and hands them over. Must be called before startServer.
+    void startWorkers(int threads);
+
     kj::Promise<void> startServer(kj::Timer &timer, kj::Own<kj::ConnectionReceiver> &&listener);
 
     void notifyEvent(const char* data, std::string job = nullptr);
     void notifyLog(std::string job, uint run, std::string log_chunk, bool eot);
 
-    // Allows supplying a custom HTML template. Pass an empty string to use the default.
-    void setHtmlTemplate(std::string tmpl = std::string());
+    // Serve the given output of Resources::renderIndex as the index page
+    void setIndex(std::string index);
 
 private:
+    friend class HttpWorker;
+
+    // An instance serving connections on a worker thread. All calls to
+    // laminar are executed on the thread of primary.
+    Http(Laminar& li, Http& primary, const kj::Executor& primaryThread);
+
     virtual kj::Promise<void> request(kj::HttpMethod method, kj::StringPtr url, const kj::HttpHeaders& headers,
                                       kj::AsyncInputStream& requestBody, Response& response) override;
     bool parseLogEndpoint(kj::StringPtr url, std::string &name, uint &num);
 
+    // Runs fn(laminar) on the thread which owns the Laminar object
+    template<typename Fn>
+    auto withLaminar(Fn&& fn);
+
+    // Deliver a notification with the given sequence number to the clients
+    // connected to this instance
+    void deliverEvent(const char* data, std::string job, uint64_t seq);
+    void deliverLog(std::string job, uint run, std::string log_chunk, bool eot, uint64_t seq);
+
+    // The events to send a new subscriber to scope, either the status or
+    // the events missed since lastEventId, and the sequence number of the
+    // latest notification they reflect
+    typedef std::pair<std::list<std::string>, uint64_t> EventSnapshot;
+    kj::Promise<EventSnapshot> eventSnapshot(MonitorScope scope, int channel, uint64_t lastEventId);
+
+    // Handles subscriptions requested over a WebSocket connection
+    kj::Promise<void> receiveCommands(WebSocketClient* client);
+    void handleCommand(WebSocketClient* client, kj::StringPtr command);
+
+    // Appends the events for scope which followed the one with the given
+    // sequence number to output, formatted for the given WebSocket channel
+    // or SSE if negative. Returns false if some of them have already been
+    // dropped from replayBuffer. Only used on the primary.
+    bool replayEvents(const MonitorScope& scope, int channel, uint64_t since, std::list<std::string>& output) const;
+
+    kj::Promise<void> dispatchConnections(kj::ConnectionReceiver& listener);
+
     // With SSE, there is no notification if a client disappears. Also, an idle
     // client must be kept alive if there is no activity in their MonitorScope.
     // Deal with these by sending a periodic keepalive and reaping the client if
     // the write fails.
     kj::Promise<void> cleanupPeers(kj::Timer &timer);
 
+    void taskFailed(kj::Exception&& exception) override;
+
     Laminar& laminar;
+    Http& primary;
+    const kj::Executor* primaryThread;
     std::set<EventPeer*> eventPeers;
     kj::Own<kj::HttpHeaderTable> headerTable;
     kj::Own<Resources> resources;
     std::set<LogWatcher*> logWatchers;
 
+    // Number of the latest notification. A client which fetched a status or
+    // log at a given number has to skip notifications up to that number,
+    // which may still be on their way to its worker thread.
+    // On the primary, this starts at the time of startup in microseconds, so
+    // that a client which reconnects after a restart cannot have seen any
+    // of the notifications with the same number. Also used as event ids.
+    uint64_t notifySeq;
+    // The latest events sent to SSE clients, so that a reconnecting client
+    // can be sent those it missed instead of the status. All events after
+    // replayFrom are still here.
+    struct ReplayEvent {
+        uint64_t seq;
+        std::string job;
+        std::string data;
+    };
+    std::deque<ReplayEvent> replayBuffer;
+    uint64_t replayFrom;
+    std::string index;
+    std::vector<kj::Own<HttpWorker>> workers;
+    size_t nextWorker;
+    kj::Own<kj::TaskSet> workerTasks;
+
     kj::HttpHeaderId ACCEPT;
+    kj::HttpHeaderId ACCEPT_ENCODING;
+    kj::HttpHeaderId IF_NONE_MATCH;
+    kj::HttpHeaderId LAST_EVENT_ID;
 };
-
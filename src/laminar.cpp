@@ -22,18 +22,40 @@
 #include "log.h"
 #include "http.h"
 #include "rpc.h"
+#include "resources.h"
 
 #include <sys/wait.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <string.h>
+#include <spawn.h>
+#include <signal.h>
 #include <fnmatch.h>
 #include <fstream>
-#include <zlib.h>
 
-#define COMPRESS_LOG_MIN_SIZE 1024
+// With LAMINAR_LOG_DICTIONARIES, a job's log dictionary is retrained
+// from its latest LOG_DICT_SAMPLES logs every LOG_DICT_TRAIN_INTERVAL
+// runs. Only the beginning of each log is used, which bounds the time
+// spent training and is where most of the boilerplate is anyway
+#define LOG_DICT_TRAIN_INTERVAL 16
+#define LOG_DICT_SAMPLES 32
+#define LOG_DICT_SAMPLE_SIZE (128 << 10)
 
+// Interval in seconds between samples of the system load, when a
+// context has configured load limits
+#define LOAD_SAMPLE_INTERVAL 5
+
+// Time in seconds after which a cache key script is killed and the run
+// goes ahead without using the cache
+#define CACHE_KEY_TIMEOUT 60
+
+// Processes killed at the end of a run may take a moment to exit, during
+// which their cgroup cannot be removed. Retry this often, once a second
+#define CGROUP_REMOVE_ATTEMPTS 10
+
+#include <rapidjson/document.h>
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
 
@@ -72,6 +94,14 @@ inline kj::Path operator/(const std::string& p, const T& ext) {
 
 typedef std::string str;
 
+static CgroupLimits cgroupLimitsFromConf(StringMap& conf) {
+    CgroupLimits limits;
+    limits.cpuWeight = conf.get<int>("CPU_WEIGHT", 0);
+    limits.memoryMax = conf.get<std::string>("MEMORY_MAX");
+    limits.ioMax = conf.get<std::string>("IO_MAX");
+    return limits;
+}
+
 Laminar::Laminar(Server &server, Settings settings) :
     srv(server),
     homePath(kj::Path::parse(&settings.home[1])),
@@ -91,6 +121,7 @@ Laminar::Laminar(Server &server, Settings settings) :
         archiveUrl.append("/");
 
     numKeepRunDirs = 0;
+    useLogDictionaries = settings.log_dictionaries && defaultLogCodec() == LOG_CODEC_ZSTD;
 
     db = new Database((homePath/"laminar.sqlite").toString(true).cStr());
     // Prepare database for first use
@@ -111,24 +142,65 @@ Laminar::Laminar(Server &server, Settings settings) :
     .fetch<int>([&](int has_old_index) {
         if (has_old_index) {
             LLOG(INFO, "Migrating table to the new primary key");
-            db->exec("BEGIN TRANSACTION");
+            db->begin();
             db->exec("ALTER TABLE builds RENAME TO builds_old");
             db->exec(create_table_stmt);
             db->exec("INSERT INTO builds SELECT * FROM builds_old");
             db->exec("DROP TABLE builds_old");
-            db->exec("COMMIT");
+            db->commit();
         }
     });
 
     db->exec("CREATE INDEX IF NOT EXISTS idx_completion_time ON builds("
              "completedAt DESC)");
 
+    // Columns added since the original schema
+    std::set<str> columns;
+    db->stmt("PRAGMA table_info(builds)")
+    .fetch<int,str>([&](int, str name){
+        columns.insert(kj::mv(name));
+    });
+    for(const char* column : {"cpuTime INT", "peakMemory INT", "ioBytes INT", "cacheKey TEXT", "cacheHit INT",
+                              "outputCodec INT", "outputDict INT", "params TEXT"}) {
+        if(!columns.count(str(column, strchr(column, ' '))))
+            db->exec((str("ALTER TABLE builds ADD COLUMN ") + column).c_str());
+    }
+
+    // Dictionaries are kept as long as there may be logs compressed with them
+    db->exec("CREATE TABLE IF NOT EXISTS logdicts("
+             "id INTEGER PRIMARY KEY, name TEXT, number INT, createdAt INT, dict BLOB)");
+    db->stmt("SELECT id, name, number, dict FROM logdicts WHERE id IN "
+             "(SELECT MAX(id) FROM logdicts GROUP BY name)")
+    .fetch<int,str,uint,str>([this](int id, str name, uint build, str dict){
+        LogDictionary& ld = logDictionaries[name];
+        ld.id = id;
+        ld.trainedAt = build;
+        ld.data = std::make_shared<const std::string>(kj::mv(dict));
+    });
+
+    db->exec("CREATE INDEX IF NOT EXISTS idx_cache_key ON builds("
+             "name, cacheKey)");
+
+    // Only covers the few runs which have not completed, for recoverRuns
+    db->exec("CREATE INDEX IF NOT EXISTS idx_incomplete ON builds("
+             "queuedAt) WHERE completedAt IS NULL");
+
+    // Fan-ins waiting for their fan-out runs, keyed by the upstream run
+    db->exec("CREATE TABLE IF NOT EXISTS fanins("
+             "name TEXT, number INT, job TEXT, params TEXT, runs TEXT, "
+             "PRIMARY KEY (name, number))");
+
     // retrieve the last build numbers
     db->stmt("SELECT name, MAX(number) FROM builds GROUP BY name")
     .fetch<str,uint>([this](str name, uint build){
         buildNums[name] = build;
     });
 
+    if(const char* cgroup = getenv("LAMINAR_CGROUP")) {
+        if(cgroupInit(cgroup))
+            cgroupRoot = cgroup;
+    }
+
     srv.watchPaths([this]{
         LLOG(INFO, "Reloading configuration");
         loadConfiguration();
@@ -145,19 +217,37 @@ Laminar::Laminar(Server &server, Settings settings) :
     }).addPath((homePath/"custom").toString(true).cStr());
 
     srv.listenRpc(*rpc, settings.bind_rpc);
+    http->startWorkers(settings.http_threads);
     srv.listenHttp(*http, settings.bind_http);
 
     // Load configuration, may be called again in response to an inotify event
     // that the configuration files have been modified
     loadConfiguration();
+
+    recoverRuns();
+    recoverFanIns();
+    assignNewJobs();
+    // Each checkpoint compresses and stores the whole log so far of every
+    // running job whose log has grown since the last one
+    logCheckpointInterval = settings.log_checkpoint_interval;
+    if(logCheckpointInterval > 0)
+        logCheckpointer = checkpointLogs();
 }
 
 void Laminar::loadCustomizations() {
-    KJ_IF_MAYBE(templ, fsHome->tryOpenFile(kj::Path{"custom","index.html"})) {
-        http->setHtmlTemplate((*templ)->readAllText().cStr());
-    } else {
-        http->setHtmlTemplate();
+    std::string templ;
+    KJ_IF_MAYBE(file, fsHome->tryOpenFile(kj::Path{"custom","index.html"})) {
+        templ = (*file)->readAllText().cStr();
     }
+    // Rendering involves deflating the template, so is done on the compression
+    // pool. A later reload may overtake this one, in which case it is dropped
+    uint generation = ++indexGeneration;
+    srv.addTask(srv.compress([templ = kj::mv(templ)](){
+        return Resources::renderIndex(templ);
+    }).then([this, generation](std::string index){
+        if(generation == indexGeneration)
+            http->setIndex(kj::mv(index));
+    }));
 }
 
 uint Laminar::latestRun(std::string job) {
@@ -166,33 +256,44 @@ uint Laminar::latestRun(std::string job) {
     return 0;
 }
 
-bool Laminar::handleLogRequest(std::string name, uint num, std::string& output, bool& complete) {
-    if(Run* run = activeRun(name, num)) {
-        output = run->log;
-        complete = false;
-        return true;
-    } else { // it must be finished, fetch it from the database
-        db->stmt("SELECT output, outputLen FROM builds WHERE name = ? AND number = ?")
-                .bind(name, num)
-                .fetch<str,int>([&](str maybeZipped, unsigned long sz) {
-            str log(sz,'\0');
-            if(sz >= COMPRESS_LOG_MIN_SIZE) {
-                int res = ::uncompress((uint8_t*) log.data(), &sz,
-                                       (const uint8_t*) maybeZipped.data(), maybeZipped.size());
-                if(res == Z_OK)
-                    std::swap(output, log);
-                else
-                    LLOG(ERROR, "Failed to uncompress log", res);
-            } else {
-                std::swap(output, maybeZipped);
-            }
-        });
-        if(output.size()) {
-            complete = true;
-            return true;
-        }
+kj::Promise<kj::Maybe<Laminar::RunLog>> Laminar::handleLogRequest(std::string name, uint num, std::set<std::string> acceptedEncodings) {
+    if(Run* run = activeRun(name, num))
+        return kj::Maybe<RunLog>(RunLog{run->log, false, nullptr, RunState::RUNNING});
+    if(auto it = storingLogs.find({name, num}); it != storingLogs.end())
+        return kj::Maybe<RunLog>(RunLog{it->second->log, true, nullptr, it->second->result});
+
+    // it must be finished, fetch it from the database
+    std::string stored, dict;
+    size_t length = 0;
+    LogCodec codec = LOG_CODEC_ZLIB;
+    RunState result = RunState::UNKNOWN;
+    db->stmt("SELECT output, outputLen, IFNULL(outputCodec, 0), IFNULL(logdicts.dict, ''), result FROM builds "
+             "LEFT JOIN logdicts ON logdicts.id = builds.outputDict "
+             "WHERE builds.name = ? AND builds.number = ?")
+            .bind(name, num)
+            .fetch<str,int,int,str,int>([&](str maybeZipped, unsigned long sz, int c, str d, int r) {
+        stored = kj::mv(maybeZipped);
+        length = sz;
+        codec = LogCodec(c);
+        dict = kj::mv(d);
+        result = RunState(r);
+    });
+    if(length < COMPRESS_LOG_MIN_SIZE) {
+        if(stored.empty())
+            return kj::Maybe<RunLog>(nullptr);
+        return kj::Maybe<RunLog>(RunLog{kj::mv(stored), true, nullptr, result});
     }
-    return false;
+    // the client can decompress it just as well
+    const char* coding = logContentCoding(codec, !dict.empty());
+    if(coding && acceptedEncodings.count(coding))
+        return kj::Maybe<RunLog>(RunLog{kj::mv(stored), true, coding, result});
+    return srv.compress([stored = kj::mv(stored), length, codec, dict = kj::mv(dict)](){
+        return uncompressLog(stored, length, codec, dict.empty() ? nullptr : &dict);
+    }).then([result](std::string log) -> kj::Maybe<RunLog> {
+        if(log.empty())
+            return nullptr;
+        return RunLog{kj::mv(log), true, nullptr, result};
+    });
 }
 
 bool Laminar::setParam(std::string job, uint buildNum, std::string param, std::string value) {
@@ -217,6 +318,11 @@ std::list<std::string> Laminar::listKnownJobs() {
         for(kj::Directory::Entry& entry : (*dir)->listEntries()) {
             if(entry.name.endsWith(".run")) {
                 res.emplace_back(entry.name.cStr(), entry.name.findLast('.').orDefault(0));
+            } else if(entry.name.endsWith(".d") && entry.type == kj::FsNode::Type::DIRECTORY) {
+                // jobs consisting only of steps
+                std::string name(entry.name.cStr(), entry.name.size() - 2);
+                if(!(*dir)->exists(kj::Path{name + ".run"}))
+                    res.push_back(name);
             }
         }
     }
@@ -250,15 +356,21 @@ std::string Laminar::getStatus(MonitorScope scope) {
     j.set("time", time(nullptr));
     j.startObject("data");
     if(scope.type == MonitorScope::RUN) {
-        db->stmt("SELECT queuedAt,startedAt,completedAt,result,reason,parentJob,parentBuild,q.lr IS NOT NULL,q.lr FROM builds "
+        db->stmt("SELECT queuedAt,startedAt,completedAt,result,reason,parentJob,parentBuild,q.lr IS NOT NULL,q.lr,cpuTime,peakMemory,ioBytes,cacheHit FROM builds "
                  "LEFT JOIN (SELECT name n, MAX(number), completedAt-startedAt lr FROM builds WHERE result IS NOT NULL GROUP BY n) q ON q.n = name "
                  "WHERE name = ? AND number = ?")
         .bind(scope.job, scope.num)
-        .fetch<time_t, time_t, time_t, int, std::string, std::string, uint, uint, uint>([&](time_t queued, time_t started, time_t completed, int result, std::string reason, std::string parentJob, uint parentBuild, uint lastRuntimeKnown, uint lastRuntime) {
+        .fetch<time_t, time_t, time_t, int, std::string, std::string, uint, uint, uint, ulong, ulong, ulong, uint>([&](time_t queued, time_t started, time_t completed, int result, std::string reason, std::string parentJob, uint parentBuild, uint lastRuntimeKnown, uint lastRuntime, ulong cpuTime, ulong peakMemory, ulong ioBytes, uint cacheHit) {
             j.set("queued", queued);
             j.set("started", started);
-            if(completed)
+            if(completed) {
               j.set("completed", completed);
+              j.set("cpuTime", cpuTime);
+              j.set("peakMemory", peakMemory);
+              j.set("ioBytes", ioBytes);
+            }
+            if(cacheHit)
+              j.set("cacheHit", cacheHit);
             j.set("result", to_string(completed ? RunState(result) : started ? RunState::RUNNING : RunState::QUEUED));
             j.set("reason", reason);
             j.startObject("upstream").set("name", parentJob).set("num", parentBuild).EndObject(2);
@@ -302,6 +414,20 @@ std::string Laminar::getStatus(MonitorScope scope) {
              .EndObject();
         });
         j.EndArray();
+        // resource usage of the most recent runs, oldest first
+        j.startArray("usage");
+        db->stmt("SELECT * FROM (SELECT number,cpuTime,peakMemory,ioBytes FROM builds "
+                 "WHERE name = ? AND result IS NOT NULL ORDER BY number DESC LIMIT ?) ORDER BY number")
+        .bind(scope.job, runsPerPage)
+        .fetch<uint,ulong,ulong,ulong>([&](uint build, ulong cpuTime, ulong peakMemory, ulong ioBytes){
+            j.StartObject();
+            j.set("number", build)
+             .set("cpuTime", cpuTime)
+             .set("peakMemory", peakMemory)
+             .set("ioBytes", ioBytes)
+             .EndObject();
+        });
+        j.EndArray();
         db->stmt("SELECT COUNT(*),AVG(completedAt-startedAt) FROM builds WHERE name = ? AND result IS NOT NULL")
         .bind(scope.job)
         .fetch<uint,uint>([&](uint nRuns, uint averageRuntime){
@@ -507,6 +633,8 @@ std::string Laminar::getStatus(MonitorScope scope) {
 }
 
 Laminar::~Laminar() noexcept try {
+    if(pendingCommit != nullptr)
+        db->commit();
     delete db;
 } catch (std::exception& e) {
     LLOG(ERROR, e.what());
@@ -542,6 +670,14 @@ bool Laminar::loadConfiguration() {
             }
             context->jobPatterns.swap(jobPtnsList);
 
+            context->loadLimits.maxLoad = conf.get<double>("MAX_LOAD", 0);
+            context->loadLimits.maxCpuPressure = conf.get<double>("MAX_CPU_PRESSURE", 0);
+            context->loadLimits.maxMemoryPressure = conf.get<double>("MAX_MEMORY_PRESSURE", 0);
+            context->loadLimits.maxIoPressure = conf.get<double>("MAX_IO_PRESSURE", 0);
+            context->loadLimits.minFreeMemory = conf.get<int>("MIN_FREE_MEMORY", 0);
+
+            context->cgroupLimits = cgroupLimitsFromConf(conf);
+
             knownContexts.insert(name);
         }
     }
@@ -564,6 +700,18 @@ bool Laminar::loadConfiguration() {
         contexts.emplace("default", context);
     }
 
+    // Only pay for sampling the system load if some context needs it
+    bool admissionControl = false;
+    for(const auto& it : contexts)
+        admissionControl |= it.second->loadLimits.enabled();
+    if(!admissionControl) {
+        loadSampler = nullptr;
+    } else if(loadSampler == nullptr) {
+        systemLoad = sampleSystemLoad();
+        runsSinceSample = 0;
+        loadSampler = sampleLoad();
+    }
+
     KJ_IF_MAYBE(jobsDir, fsHome->tryOpenSubdir(kj::Path{"cfg","jobs"})) {
         for(kj::Directory::Entry& entry : (*jobsDir)->listEntries()) {
             if(!entry.name.endsWith(".conf"))
@@ -592,6 +740,17 @@ bool Laminar::loadConfiguration() {
             if(!desc.empty()) {
                 jobDescriptions[jobName] = desc;
             }
+
+            jobCgroupLimits[jobName] = cgroupLimitsFromConf(conf);
+
+            std::vector<std::string> fanOut;
+            std::istringstream fanOutList(conf.get<std::string>("FANOUT"));
+            for(std::string job; std::getline(fanOutList, job, ',');) {
+                if(!job.empty())
+                    fanOut.push_back(job);
+            }
+            jobFanOut[jobName].swap(fanOut);
+            jobFanIn[jobName] = conf.get<std::string>("FANIN");
         }
     }
 
@@ -604,8 +763,12 @@ bool Laminar::loadConfiguration() {
     return true;
 }
 
-std::shared_ptr<Run> Laminar::queueJob(std::string name, ParamMap params, bool frontOfQueue) {
-    if(!fsHome->exists(kj::Path{"cfg","jobs",name+".run"})) {
+bool Laminar::jobExists(const std::string& name) const {
+    return fsHome->exists(kj::Path{"cfg","jobs",name+".run"}) || fsHome->exists(kj::Path{"cfg","jobs",name+".d"});
+}
+
+std::shared_ptr<Run> Laminar::createRun(std::string name, ParamMap params) {
+    if(!jobExists(name)) {
         LLOG(ERROR, "Non-existent job", name);
         return nullptr;
     }
@@ -615,15 +778,31 @@ std::shared_ptr<Run> Laminar::queueJob(std::string name, ParamMap params, bool f
         jobContexts.at(name).insert("default");
 
     std::shared_ptr<Run> run = std::make_shared<Run>(name, ++buildNums[name], kj::mv(params), homePath.clone());
+
+    // kept so that the run can be requeued by recoverRuns, which tells
+    // from a NULL that the run was queued before parameters were stored
+    Json storedParams;
+    for(const auto& param : run->params)
+        storedParams.set(param.first.c_str(), param.second);
+
+    batchWrites();
+    db->stmt("INSERT INTO builds(name,number,queuedAt,parentJob,parentBuild,reason,params) VALUES(?,?,?,?,?,?,?)")
+     .bind(run->name, run->build, run->queuedAt, run->parentName, run->parentBuild, run->reason(), storedParams.str())
+     .exec();
+
+    return run;
+}
+
+std::shared_ptr<Run> Laminar::queueJob(std::string name, ParamMap params, bool frontOfQueue) {
+    std::shared_ptr<Run> run = createRun(name, kj::mv(params));
+    if(!run)
+        return nullptr;
+
     if(frontOfQueue)
         queuedJobs.push_front(run);
     else
         queuedJobs.push_back(run);
 
-    db->stmt("INSERT INTO builds(name,number,queuedAt,parentJob,parentBuild,reason) VALUES(?,?,?,?,?,?)")
-     .bind(run->name, run->build, run->queuedAt, run->parentName, run->parentBuild, run->reason())
-     .exec();
-
     // notify clients
     Json j;
     j.set("type", "job_queued")
@@ -634,12 +813,60 @@ std::shared_ptr<Run> Laminar::queueJob(std::string name, ParamMap params, bool f
         .set("queueIndex", frontOfQueue ? 0 : (queuedJobs.size() - 1))
         .set("reason", run->reason())
         .EndObject();
-    http->notifyEvent(j.str(), name.c_str());
+    const char* data = j.str();
+    http->notifyEvent(data, name.c_str());
+    rpc->notifyEvent(data, name.c_str());
 
     assignNewJobs();
     return run;
 }
 
+std::vector<std::shared_ptr<Run>> Laminar::queueJobs(std::vector<JobRequest> jobs, bool frontOfQueue) {
+    std::vector<std::shared_ptr<Run>> runs;
+    // queued runs of each job, with their index in the queue
+    std::map<std::string, std::vector<std::pair<Run*, size_t>>> queued;
+    // at the front of the queue, the jobs keep the order they were given in
+    auto front = queuedJobs.begin();
+    size_t frontIndex = 0;
+
+    for(JobRequest& job : jobs) {
+        std::shared_ptr<Run> run = createRun(job.name, kj::mv(job.params));
+        runs.push_back(run);
+        if(!run)
+            continue;
+        if(frontOfQueue) {
+            queuedJobs.insert(front, run);
+            queued[run->name].emplace_back(run.get(), frontIndex++);
+        } else {
+            queuedJobs.push_back(run);
+            queued[run->name].emplace_back(run.get(), queuedJobs.size() - 1);
+        }
+    }
+
+    // notify clients
+    for(auto& job : queued) {
+        Json j;
+        j.set("type", "jobs_queued")
+            .startArray("data");
+        for(auto& q : job.second) {
+            j.StartObject();
+            j.set("name", job.first)
+                .set("number", q.first->build)
+                .set("result", to_string(RunState::QUEUED))
+                .set("queueIndex", q.second)
+                .set("reason", q.first->reason());
+            j.EndObject();
+        }
+        j.EndArray();
+        const char* data = j.str();
+        http->notifyEvent(data, job.first);
+        rpc->notifyEvent(data, job.first);
+    }
+
+    assignNewJobs();
+    return runs;
+}
+
 bool Laminar::abort(std::string job, uint buildNum) {
     if(Run* run = activeRun(job, buildNum))
         return run->abort();
@@ -652,10 +879,177 @@ void Laminar::abortAll() {
     }
 }
 
+void Laminar::recoverRuns() {
+    std::vector<std::pair<str, uint>> interrupted;
+    db->stmt("SELECT name, number, queuedAt, IFNULL(startedAt, 0), IFNULL(parentJob, ''), IFNULL(parentBuild, 0), "
+             "IFNULL(reason, ''), IFNULL(params, ''), params IS NULL FROM builds WHERE completedAt IS NULL ORDER BY queuedAt, number")
+    .fetch<str,uint,long,long,str,int,str,str,int>([&](str name, uint build, long queuedAt, long startedAt,
+                                                      str parentJob, int parentBuild, str reason, str storedParams, int noParams){
+        // A run which had started cannot be resumed, and one of a job which
+        // has since been removed cannot be started. Nor can one which was
+        // queued before its parameters were stored, it would run without them
+        if(startedAt || !jobExists(name) || noParams) {
+            interrupted.emplace_back(kj::mv(name), build);
+            return;
+        }
+        ParamMap params;
+        rapidjson::Document d;
+        if(!d.Parse(storedParams.c_str()).HasParseError() && d.IsObject()) {
+            for(const auto& param : d.GetObject()) {
+                if(param.value.IsString())
+                    params[param.name.GetString()] = param.value.GetString();
+            }
+        }
+        if(!parentJob.empty()) {
+            params["=parentJob"] = parentJob;
+            params["=parentBuild"] = std::to_string(parentBuild);
+        }
+        if(!reason.empty())
+            params["=reason"] = reason;
+
+        if(jobContexts[name].empty())
+            jobContexts.at(name).insert("default");
+
+        std::shared_ptr<Run> run = std::make_shared<Run>(name, build, kj::mv(params), homePath.clone());
+        run->queuedAt = queuedAt;
+        queuedJobs.push_back(run);
+    });
+
+    // whatever was checkpointed of their logs remains
+    if(!interrupted.empty()) {
+        time_t completedAt = time(nullptr);
+        db->begin();
+        for(const auto& run : interrupted) {
+            db->stmt("UPDATE builds SET completedAt = ?, result = ? WHERE name = ? AND number = ?")
+             .bind(completedAt, int(RunState::ABORTED), run.first, run.second)
+             .exec();
+        }
+        db->commit();
+    }
+
+    if(!queuedJobs.empty() || !interrupted.empty())
+        LLOG(INFO, "Recovered runs", queuedJobs.size(), interrupted.size());
+}
+
+void Laminar::recoverFanIns() {
+    struct Stored { str name; uint build; str job; str params; str runs; };
+    std::vector<Stored> stored;
+    db->stmt("SELECT name, number, job, params, runs FROM fanins")
+    .fetch<str,uint,str,str,str>([&](str name, uint build, str job, str params, str runs){
+        stored.push_back({kj::mv(name), build, kj::mv(job), kj::mv(params), kj::mv(runs)});
+    });
+
+    int recovered = 0;
+    for(Stored& s : stored) {
+        std::shared_ptr<FanIn> fanIn = std::make_shared<FanIn>(FanIn{s.job, ParamMap(), 0, false, s.name, s.build});
+        rapidjson::Document d;
+        if(!d.Parse(s.params.c_str()).HasParseError() && d.IsObject()) {
+            for(const auto& param : d.GetObject()) {
+                if(param.value.IsString())
+                    fanIn->params[param.name.GetString()] = param.value.GetString();
+            }
+        }
+
+        // Whether each fan-out run is still awaited follows from its stored
+        // result. Runs interrupted by the restart were aborted by recoverRuns
+        std::vector<std::pair<str, uint>> waiting;
+        rapidjson::Document runs;
+        const rapidjson::Value* list = nullptr;
+        if(!runs.Parse(s.runs.c_str()).HasParseError() && runs.IsObject() && runs.HasMember("runs") && runs["runs"].IsArray())
+            list = &runs["runs"];
+        else
+            fanIn->cancelled = true;
+        for(rapidjson::SizeType i = 0; list && i < list->Size(); ++i) {
+            const rapidjson::Value& r = (*list)[i];
+            if(!r.IsObject() || !r.HasMember("name") || !r["name"].IsString() || !r.HasMember("number") || !r["number"].IsUint()) {
+                fanIn->cancelled = true;
+                break;
+            }
+            bool found = false, completed = false;
+            int result = 0;
+            db->stmt("SELECT completedAt IS NOT NULL, IFNULL(result, 0) FROM builds WHERE name = ? AND number = ?")
+             .bind(r["name"].GetString(), r["number"].GetUint())
+             .fetch<int,int>([&](int c, int res){
+                found = true;
+                completed = c;
+                result = res;
+            });
+            if(!found || (completed && RunState(result) != RunState::SUCCESS)) {
+                fanIn->cancelled = true;
+                break;
+            }
+            if(!completed)
+                waiting.emplace_back(r["name"].GetString(), r["number"].GetUint());
+        }
+
+        if(fanIn->cancelled || waiting.empty()) {
+            db->stmt("DELETE FROM fanins WHERE name = ? AND number = ?")
+             .bind(s.name, s.build)
+             .exec();
+            if(fanIn->cancelled)
+                LLOG(INFO, "Not queueing fan-in job after failure", fanIn->job, s.name, s.build);
+            else
+                queueJob(fanIn->job, fanIn->params);
+            continue;
+        }
+        fanIn->remaining = waiting.size();
+        for(auto& run : waiting)
+            pendingFanIns[kj::mv(run)] = fanIn;
+        recovered++;
+    }
+
+    if(recovered)
+        LLOG(INFO, "Recovered fan-ins", recovered);
+}
+
+kj::Promise<void> Laminar::checkpointLogs() {
+    return srv.addTimeout(logCheckpointInterval, [this](){
+        for(std::shared_ptr<Run> run : activeJobs) {
+            size_t length = run->log.length();
+            // quiet runs, e.g. those waiting on a long compile, cost nothing
+            if(length == run->logCheckpoint)
+                continue;
+            run->logCheckpoint = length;
+            LogCodec codec = defaultLogCodec();
+            kj::Promise<std::string> stored = length < COMPRESS_LOG_MIN_SIZE
+                    ? kj::Promise<std::string>(str(run->log))
+                    : srv.compress([log = run->log, codec](){
+                          return compressLog(log, codec);
+                      });
+            srv.addTask(stored.then([this, run, length, codec](std::string storedLog){
+                // the run may have completed and stored its whole log meanwhile
+                batchWrites();
+                db->stmt("UPDATE builds SET output = ?, outputLen = ?, outputCodec = ? "
+                         "WHERE name = ? AND number = ? AND completedAt IS NULL")
+                 .bind(storedLog, length, int(codec), run->name, run->build)
+                 .exec();
+            }));
+        }
+    }).then([this](){
+        return checkpointLogs();
+    }).eagerlyEvaluate(nullptr);
+}
+
+kj::Promise<void> Laminar::sampleLoad() {
+    return srv.addTimeout(LOAD_SAMPLE_INTERVAL, [this](){
+        systemLoad = sampleSystemLoad();
+        runsSinceSample = 0;
+        // runs may have been deferred while the load was too high
+        if(!queuedJobs.empty())
+            assignNewJobs();
+    }).then([this](){
+        return sampleLoad();
+    }).eagerlyEvaluate(nullptr);
+}
+
 bool Laminar::canQueue(const Context& ctx, const Run& run) const {
     if(ctx.busyExecutors >= ctx.numExecutors)
         return false;
 
+    // defer while the host is too busy, sampleLoad will retry
+    if(ctx.loadLimits.exceededBy(systemLoad, runsSinceSample))
+        return false;
+
     // match may be jobs as defined by the context...
     for(std::string p : ctx.jobPatterns) {
         if(fnmatch(p.c_str(), run.name.c_str(), FNM_EXTMATCH) == 0)
@@ -676,6 +1070,30 @@ bool Laminar::tryStartRun(std::shared_ptr<Run> run, int queueIndex) {
         std::shared_ptr<Context> ctx = sc.second;
 
         if(canQueue(*ctx, *run)) {
+            // A job with a cache key script stays queued until its key is known
+            if(!run->cacheKeyEvaluated && fsHome->exists(kj::Path{"cfg","jobs",run->name+".cachekey"})) {
+                if(!run->cacheKeyPending) {
+                    run->cacheKeyPending = true;
+                    srv.addTask(evaluateCacheKey(run, ctx->name));
+                }
+                return false;
+            }
+
+            uint cachedBuild = 0;
+            if(!run->cacheKey.empty()) {
+                db->stmt("SELECT IFNULL(cacheHit, number) FROM builds WHERE name = ? AND cacheKey = ? AND result = ? "
+                         "ORDER BY number DESC LIMIT 1")
+                 .bind(run->name, run->cacheKey, int(RunState::SUCCESS))
+                 .fetch<uint>([&](uint build){
+                    cachedBuild = build;
+                });
+            }
+            if(cachedBuild) {
+                reuseCachedRun(run, ctx, cachedBuild);
+                notifyRunStarted(*run, queueIndex);
+                return true;
+            }
+
             RunState lastResult = RunState::UNKNOWN;
 
             // set the last known result if exists. Runs which haven't started yet should
@@ -686,24 +1104,35 @@ bool Laminar::tryStartRun(std::shared_ptr<Run> run, int queueIndex) {
                 lastResult = RunState(result);
             });
 
-            kj::Promise<RunState> onRunFinished = run->start(lastResult, ctx, *fsHome,[this](kj::Maybe<pid_t>& pid){return srv.onChildExit(pid);});
+            if(!cgroupRoot.empty()) {
+                CgroupLimits limits;
+                if(auto it = jobCgroupLimits.find(run->name); it != jobCgroupLimits.end())
+                    limits = it->second;
+                limits.inherit(ctx->cgroupLimits);
+                run->cgroup = cgroupCreate(cgroupRoot, "run-" + run->name + "-" + std::to_string(run->build), limits);
+            }
+
+            kj::Promise<RunState> onRunFinished = run->start(lastResult, ctx, *fsHome, srv);
 
-            db->stmt("UPDATE builds SET node = ?, startedAt = ? WHERE name = ? AND number = ?")
-             .bind(ctx->name, run->startedAt, run->name, run->build)
+            batchWrites();
+            db->stmt("UPDATE builds SET node = ?, startedAt = ?, cacheKey = ? WHERE name = ? AND number = ?")
+             .bind(ctx->name, run->startedAt, run->cacheKey, run->name, run->build)
              .exec();
 
             ctx->busyExecutors++;
+            runsSinceSample++;
 
             kj::Promise<void> exec = srv.readDescriptor(run->output_fd, [this, run](const char*b, size_t n){
                 // handle log output
                 std::string s(b, n);
                 run->log += s;
                 http->notifyLog(run->name, run->build, s, false);
+                rpc->notifyLog(run->name, run->build, s, false);
             }).then([run, p = kj::mv(onRunFinished)]() mutable {
                 // wait until leader reaped
                 return kj::mv(p);
             }).then([this, run](RunState){
-                handleRunFinished(run.get());
+                return finishRun(run);
             });
             if(run->timeout > 0) {
                 exec = exec.attach(srv.addTimeout(run->timeout, [r=run.get()](){
@@ -713,29 +1142,160 @@ bool Laminar::tryStartRun(std::shared_ptr<Run> run, int queueIndex) {
             srv.addTask(kj::mv(exec));
             LLOG(INFO, "Started job", run->name, run->build, ctx->name);
 
-            // notify clients
-            Json j;
-            j.set("type", "job_started")
-             .startObject("data")
-             .set("queueIndex", queueIndex)
-             .set("name", run->name)
-             .set("queued", run->queuedAt)
-             .set("started", run->startedAt)
-             .set("number", run->build)
-             .set("reason", run->reason());
-            db->stmt("SELECT completedAt - startedAt FROM builds WHERE name = ? ORDER BY completedAt DESC LIMIT 1")
-             .bind(run->name)
-             .fetch<uint>([&](uint etc){
-                j.set("etc", time(nullptr) + etc);
-            });
-            j.EndObject();
-            http->notifyEvent(j.str(), run->name.c_str());
+            notifyRunStarted(*run, queueIndex);
             return true;
         }
     }
     return false;
 }
 
+void Laminar::notifyRunStarted(const Run& run, int queueIndex) {
+    Json j;
+    j.set("type", "job_started")
+     .startObject("data")
+     .set("queueIndex", queueIndex)
+     .set("name", run.name)
+     .set("queued", run.queuedAt)
+     .set("started", run.startedAt)
+     .set("number", run.build)
+     .set("reason", run.reason());
+    db->stmt("SELECT completedAt - startedAt FROM builds WHERE name = ? ORDER BY completedAt DESC LIMIT 1")
+     .bind(run.name)
+     .fetch<uint>([&](uint etc){
+        j.set("etc", time(nullptr) + etc);
+    });
+    j.EndObject();
+    const char* data = j.str();
+    http->notifyEvent(data, run.name.c_str());
+    rpc->notifyEvent(data, run.name.c_str());
+}
+
+kj::Promise<void> Laminar::evaluateCacheKey(std::shared_ptr<Run> run, std::string context) {
+    // The cache key script gets the same environment as the run would in
+    // the context it is waiting for. It is executed in $LAMINAR_HOME through
+    // sh, since posix_spawn cannot portably change the working directory.
+    std::vector<std::string> envStrings;
+    for(auto& it : run->environment(context))
+        envStrings.push_back(it.first + "=" + it.second);
+    std::vector<char*> envp;
+    for(std::string& e : envStrings)
+        envp.push_back(e.data());
+    envp.push_back(nullptr);
+
+    std::string script = (homePath/"cfg"/"jobs"/(run->name+".cachekey")).toString(true).cStr();
+    std::string home = homePath.toString(true).cStr();
+    char* argv[] = { (char*) "sh", (char*) "-c", (char*) "cd \"$1\" && exec \"$0\"", script.data(), home.data(), nullptr };
+
+    // close-on-exec, so that leaders spawned meanwhile don't hold it open
+    int out[2];
+    LSYSCALL(pipe2(out, O_CLOEXEC));
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+    // in its own process group, so that a timeout kills its children too
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+    pid_t pid;
+    int err = posix_spawn(&pid, "/bin/sh", &actions, &attr, argv, envp.data());
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    close(out[1]);
+    if(err != 0) {
+        LLOG(ERROR, "Could not execute cache key script", script, strerror(err));
+        close(out[0]);
+        run->cacheKeyEvaluated = true;
+        assignNewJobs();
+        return kj::READY_NOW;
+    }
+
+    // must wait for the process right away, see Server::onChildExit. It is
+    // waited for in any case, also after it was killed because of a timeout
+    auto maybePid = kj::heap<kj::Maybe<pid_t>>(pid);
+    auto exited = kj::heap<kj::ForkedPromise<int>>(srv.onChildExit(*maybePid).fork());
+    auto output = kj::heap<std::string>();
+    // Otherwise a script which hangs would keep the run queued forever. The
+    // timeout covers both reading its output and waiting for it to exit.
+    // Reading stops too, in case something which escaped the process group
+    // still holds the pipe open
+    kj::Promise<bool> finished = srv.readDescriptor(out[0], [o=output.get()](const char* b, size_t n){
+        o->append(b, n);
+    }).then([e=exited.get()](){
+        return e->addBranch().ignoreResult();
+    }).then([](){
+        return true;
+    });
+    kj::Promise<bool> timeout = srv.addTimeout(CACHE_KEY_TIMEOUT, [p=maybePid.get()](){
+        KJ_IF_MAYBE(pid, *p) {
+            kill(-*pid, SIGKILL);
+        }
+    }).then([](){
+        return false;
+    });
+    return finished.exclusiveJoin(kj::mv(timeout)).then([e=exited.get()](bool inTime){
+        return e->addBranch().then([inTime](int status){
+            return std::make_pair(inTime, status);
+        });
+    }).then([this, run, o=output.get()](std::pair<bool, int> exit){
+        int status = exit.second;
+        if(!exit.first) {
+            LLOG(WARNING, "Cache key script timed out, not using the cache", run->name, run->build);
+        } else if(WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            // trailing whitespace is not significant
+            o->erase(o->find_last_not_of(" \t\r\n") + 1);
+            run->cacheKey = kj::mv(*o);
+        } else {
+            LLOG(WARNING, "Cache key script failed, not using the cache", run->name, run->build);
+        }
+        run->cacheKeyEvaluated = true;
+        assignNewJobs();
+    }).attach(kj::mv(maybePid), kj::mv(exited), kj::mv(output));
+}
+
+void Laminar::reuseCachedRun(std::shared_ptr<Run> run, std::shared_ptr<Context> ctx, uint cachedBuild) {
+    LLOG(INFO, "Reusing cached result", run->name, run->build, cachedBuild);
+    run->log = "[laminar] Cache hit, reusing the result of #" + std::to_string(cachedBuild) + "\n";
+    run->reuseResult(ctx, RunState::SUCCESS);
+
+    // the archive is that of the run whose result is reused
+    fsHome->symlink(kj::Path{"archive", run->name, std::to_string(run->build)}, std::to_string(cachedBuild),
+                    kj::WriteMode::CREATE|kj::WriteMode::CREATE_PARENT);
+
+    batchWrites();
+    db->stmt("UPDATE builds SET node = ?, startedAt = ?, cacheKey = ?, cacheHit = ? WHERE name = ? AND number = ?")
+     .bind(ctx->name, run->startedAt, run->cacheKey, cachedBuild, run->name, run->build)
+     .exec();
+
+    // released again in handleRunFinished
+    ctx->busyExecutors++;
+
+    // assignNewJobs first has to move the run to activeJobs
+    srv.addTask(kj::evalLater([this, run](){
+        return finishRun(run);
+    }));
+}
+
+void Laminar::batchWrites() {
+    if(pendingCommit != nullptr)
+        return;
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    pendingCommit = paf.promise.fork();
+    db->begin();
+    srv.addTask(kj::evalLater([this, fulfiller = kj::mv(paf.fulfiller)]() mutable {
+        db->commit();
+        pendingCommit = nullptr;
+        fulfiller->fulfill();
+    }));
+}
+
+kj::Promise<void> Laminar::whenCommitted() {
+    KJ_IF_MAYBE(commit, pendingCommit) {
+        return commit->addBranch();
+    }
+    return kj::READY_NOW;
+}
+
 void Laminar::assignNewJobs() {
     auto it = queuedJobs.begin();
     while(it != queuedJobs.end()) {
@@ -748,6 +1308,53 @@ void Laminar::assignNewJobs() {
     }
 }
 
+kj::Promise<void> Laminar::finishRun(std::shared_ptr<Run> run) {
+    // The executor is freed and the completion published right away,
+    // compressing a large log can take a while
+    handleRunFinished(run.get());
+
+    LogCodec codec = defaultLogCodec();
+    if(run->log.length() < COMPRESS_LOG_MIN_SIZE) {
+        storeLog(*run, run->log, codec, 0);
+        return kj::READY_NOW;
+    }
+    std::shared_ptr<const std::string> dict;
+    int dictId = 0;
+    if(auto it = logDictionaries.find(run->name); useLogDictionaries && it != logDictionaries.end()) {
+        dict = it->second.data;
+        dictId = it->second.id;
+    }
+    // Nothing appends to the log of a finished run, but it is still served
+    // from memory until it is stored, so the pool works on a copy
+    storingLogs[{run->name, run->build}] = run;
+    return srv.compress([log = run->log, codec, dict](){
+        return compressLog(log, codec, dict.get());
+    }).then([this, run, codec, dictId](std::string storedLog){
+        storeLog(*run, kj::mv(storedLog), codec, dictId);
+        storingLogs.erase({run->name, run->build});
+    });
+}
+
+void Laminar::removeCgroup(std::string path, int attempts) {
+    if(cgroupRemove(path) || --attempts == 0)
+        return;
+    srv.addTask(srv.addTimeout(1, [this, path, attempts](){
+        removeCgroup(path, attempts);
+    }));
+}
+
+void Laminar::storeLog(const Run& run, std::string storedLog, LogCodec codec, int dictId) {
+    // without a dictionary, NULL lets the LEFT JOIN on logdicts skip the lookup
+    batchWrites();
+    db->stmt("UPDATE builds SET output = ?, outputLen = ?, outputCodec = ?, outputDict = NULLIF(?, 0) WHERE name = ? AND number = ?")
+     .bind(storedLog, run.log.length(), int(codec), dictId, run.name, run.build)
+     .exec();
+
+    // samples the stored logs, including this one
+    if(useLogDictionaries)
+        updateLogDictionary(run.name, run.build);
+}
+
 void Laminar::handleRunFinished(Run * r) {
     std::shared_ptr<Context> ctx = r->context;
 
@@ -755,23 +1362,26 @@ void Laminar::handleRunFinished(Run * r) {
     LLOG(INFO, "Run completed", r->name, to_string(r->result));
     time_t completedAt = time(nullptr);
 
-    // compress log
-    std::string maybeZipped = r->log;
-    size_t logsize = r->log.length();
-    if(r->log.length() >= COMPRESS_LOG_MIN_SIZE) {
-        std::string zipped(r->log.size(), '\0');
-        unsigned long zippedSize = zipped.size();
-        if(::compress((uint8_t*) zipped.data(), &zippedSize,
-            (const uint8_t*) r->log.data(), logsize) == Z_OK) {
-            zipped.resize(zippedSize);
-            std::swap(maybeZipped, zipped);
-        }
+    if(!r->cgroup.empty()) {
+        // Its accounting replaces what the leader reported because it also
+        // covers processes which escaped and the peak memory of the whole tree
+        cgroupUsage(r->cgroup, r->usage);
+        // The leader has been reaped, but orphans of a leader which died
+        // abnormally, or of scripts which moved to another cgroup, may
+        // still be running. They must not outlive the run
+        cgroupKill(r->cgroup);
+        removeCgroup(r->cgroup, CGROUP_REMOVE_ATTEMPTS);
     }
 
-    db->stmt("UPDATE builds SET completedAt = ?, result = ?, output = ?, outputLen = ? WHERE name = ? AND number = ?")
-     .bind(completedAt, int(r->result), maybeZipped, logsize, r->name, r->build)
+    // the log follows in storeLog, until then the last checkpoint remains
+    batchWrites();
+    db->stmt("UPDATE builds SET completedAt = ?, result = ?, cpuTime = ?, peakMemory = ?, ioBytes = ? "
+             "WHERE name = ? AND number = ?")
+     .bind(completedAt, int(r->result), r->usage.cpuTime, r->usage.peakMemory, r->usage.ioBytes, r->name, r->build)
      .exec();
 
+    updateBadge(r->name, r->build, r->result);
+
     // notify clients
     Json j;
     j.set("type", "job_completed")
@@ -782,16 +1392,21 @@ void Laminar::handleRunFinished(Run * r) {
             .set("completed", completedAt)
             .set("started", r->startedAt)
             .set("result", to_string(r->result))
-            .set("reason", r->reason());
+            .set("reason", r->reason())
+            .set("cpuTime", r->usage.cpuTime)
+            .set("peakMemory", r->usage.peakMemory)
+            .set("ioBytes", r->usage.ioBytes);
     j.startArray("artifacts");
     populateArtifacts(j, r->name, r->build);
     j.EndArray();
     j.EndObject();
-    http->notifyEvent(j.str(), r->name);
+    const char* data = j.str();
+    http->notifyEvent(data, r->name);
+    rpc->notifyEvent(data, r->name);
     http->notifyLog(r->name, r->build, "", true);
-    // erase reference to run from activeJobs. Since runFinished is called in a
-    // lambda whose context contains a shared_ptr<Run>, the run won't be deleted
-    // until the context is destroyed at the end of the lambda execution.
+    rpc->notifyLog(r->name, r->build, "", true);
+    // erase reference to run from activeJobs. Since finishRun holds a
+    // shared_ptr<Run>, the run won't be deleted until its log is stored.
     activeJobs.byRunPtr().erase(r);
 
     // remove old run directories
@@ -823,24 +1438,142 @@ void Laminar::handleRunFinished(Run * r) {
 
     fsHome->symlink(kj::Path{"archive", r->name, "latest"}, std::to_string(r->build), kj::WriteMode::CREATE|kj::WriteMode::MODIFY);
 
+    queueDownstream(r);
+
     // in case we freed up an executor, check the queue
     assignNewJobs();
 }
 
+void Laminar::updateLogDictionary(std::string job, uint build) {
+    LogDictionary& ld = logDictionaries[job];
+    if(build < ld.trainedAt + LOG_DICT_TRAIN_INTERVAL)
+        return;
+    // also when training fails, don't retry before the next interval
+    ld.trainedAt = build;
+
+    struct Sample {
+        std::string stored;
+        size_t length;
+        LogCodec codec;
+        std::string dict;
+    };
+    auto samples = std::make_shared<std::vector<Sample>>();
+    db->stmt("SELECT output, outputLen, IFNULL(outputCodec, 0), IFNULL(logdicts.dict, '') FROM builds "
+             "LEFT JOIN logdicts ON logdicts.id = builds.outputDict "
+             "WHERE builds.name = ? AND completedAt IS NOT NULL ORDER BY builds.number DESC LIMIT ?")
+     .bind(job, LOG_DICT_SAMPLES)
+     .fetch<str,int,int,str>([&](str stored, unsigned long length, int codec, str dict){
+        samples->push_back(Sample{kj::mv(stored), length, LogCodec(codec), kj::mv(dict)});
+    });
+
+    srv.addTask(srv.compress([samples](){
+        std::vector<std::string> logs;
+        for(const Sample& s : *samples) {
+            std::string log = uncompressLog(s.stored, s.length, s.codec, s.dict.empty() ? nullptr : &s.dict);
+            if(log.size() > LOG_DICT_SAMPLE_SIZE)
+                log.resize(LOG_DICT_SAMPLE_SIZE);
+            if(!log.empty())
+                logs.push_back(kj::mv(log));
+        }
+        return trainLogDictionary(logs);
+    }).then([this, job, build](std::string dict){
+        if(dict.empty())
+            return;
+        db->stmt("INSERT INTO logdicts(name, number, createdAt, dict) VALUES(?,?,?,?)")
+         .bind(job, build, time(nullptr), dict)
+         .exec();
+        LogDictionary& ld = logDictionaries[job];
+        db->stmt("SELECT last_insert_rowid()").fetch<int>([&](int id){
+            ld.id = id;
+        });
+        ld.data = std::make_shared<const std::string>(kj::mv(dict));
+        LLOG(INFO, "Trained log dictionary", job, ld.id, ld.data->size());
+    }));
+}
+
+void Laminar::queueDownstream(Run* r) {
+    // this run may be one of a fan-out whose fan-in is waiting for it
+    if(auto it = pendingFanIns.find({r->name, r->build}); it != pendingFanIns.end()) {
+        std::shared_ptr<FanIn> fanIn = it->second;
+        pendingFanIns.erase(it);
+        if(r->result != RunState::SUCCESS) {
+            if(!fanIn->cancelled) {
+                LLOG(INFO, "Not queueing fan-in job after failure", fanIn->job, r->name, r->build);
+                db->stmt("DELETE FROM fanins WHERE name = ? AND number = ?")
+                 .bind(fanIn->upstream, fanIn->upstreamBuild)
+                 .exec();
+            }
+            fanIn->cancelled = true;
+        } else if(--fanIn->remaining == 0 && !fanIn->cancelled) {
+            db->stmt("DELETE FROM fanins WHERE name = ? AND number = ?")
+             .bind(fanIn->upstream, fanIn->upstreamBuild)
+             .exec();
+            queueJob(fanIn->job, fanIn->params);
+        }
+    }
+
+    if(r->result != RunState::SUCCESS)
+        return;
+
+    auto fanOut = jobFanOut.find(r->name);
+    auto fanIn = jobFanIn.find(r->name);
+    bool hasFanOut = fanOut != jobFanOut.end() && !fanOut->second.empty();
+    bool hasFanIn = fanIn != jobFanIn.end() && !fanIn->second.empty();
+
+    // downstream runs get the parameters of this one
+    ParamMap params = r->params;
+    params["=parentJob"] = r->name;
+    params["=parentBuild"] = std::to_string(r->build);
+
+    std::shared_ptr<FanIn> pending;
+    if(hasFanIn) {
+        pending = std::make_shared<FanIn>(FanIn{fanIn->second, params, 0, false, r->name, r->build});
+        pending->params["=reason"] = "Fan-in from " + r->name + " #" + std::to_string(r->build);
+        // without a fan-out, the fan-in job simply follows
+        if(!hasFanOut) {
+            queueJob(pending->job, pending->params);
+            return;
+        }
+    }
+    if(!hasFanOut)
+        return;
+
+    params["=reason"] = "Fan-out from " + r->name + " #" + std::to_string(r->build);
+    Json runs;
+    runs.startArray("runs");
+    for(const std::string& job : fanOut->second) {
+        std::shared_ptr<Run> run = queueJob(job, params);
+        if(!pending)
+            continue;
+        if(run) {
+            pending->remaining++;
+            pendingFanIns[{run->name, run->build}] = pending;
+            runs.StartObject();
+            runs.set("name", run->name).set("number", run->build);
+            runs.EndObject();
+        } else {
+            LLOG(ERROR, "Not queueing fan-in job because a fan-out job does not exist", pending->job, job);
+            pending->cancelled = true;
+        }
+    }
+    runs.EndArray();
+
+    // stored in the same transaction as the fan-out runs
+    if(pending && !pending->cancelled) {
+        Json storedParams;
+        for(const auto& param : pending->params)
+            storedParams.set(param.first.c_str(), param.second);
+        db->stmt("INSERT OR REPLACE INTO fanins(name,number,job,params,runs) VALUES(?,?,?,?,?)")
+         .bind(r->name, r->build, pending->job, storedParams.str(), runs.str())
+         .exec();
+    }
+}
+
 kj::Maybe<kj::Own<const kj::ReadableFile>> Laminar::getArtefact(std::string path) {
     return fsHome->openFile(kj::Path("archive").append(kj::Path::parse(path)));
 }
 
-bool Laminar::handleBadgeRequest(std::string job, std::string &badge) {
-    RunState rs = RunState::UNKNOWN;
-    db->stmt("SELECT result FROM builds WHERE name = ? AND result IS NOT NULL ORDER BY number DESC LIMIT 1")
-            .bind(job)
-            .fetch<int>([&](int result){
-        rs = RunState(result);
-    });
-    if(rs == RunState::UNKNOWN)
-        return false;
-
+static std::string renderBadge(const std::string& job, RunState rs) {
     std::string status = to_string(rs);
     // Empirical approximation of pixel width. Not particularly stable.
     const int jobNameWidth = job.size() * 7 + 10;
@@ -869,9 +1602,42 @@ R"x(
     <text x="%d" y="14" fill="#000">%s</text>
   </g>
 </svg>)x", jobNameWidth+statusWidth, jobNameWidth+statusWidth, gradient1, gradient2, jobNameWidth, jobNameWidth/2+1, job.data(), jobNameWidth, statusWidth, jobNameWidth+statusWidth/2, status.data()) < 0)
+        return std::string();
+
+    std::string badge = svg;
+    free(svg);
+    return badge;
+}
+
+void Laminar::updateBadge(std::string job, uint build, RunState result) {
+    Badge& badge = badges[job];
+    // runs of a job may finish out of order, the badge shows the latest one
+    if(build < badge.build)
+        return;
+    badge.build = build;
+    badge.result = result;
+    badge.svg = renderBadge(job, result);
+}
+
+bool Laminar::handleBadgeRequest(std::string job, std::string& badge, std::string& etag) {
+    auto it = badges.find(job);
+    if(it == badges.end()) {
+        db->stmt("SELECT number, result FROM builds WHERE name = ? AND result IS NOT NULL ORDER BY number DESC LIMIT 1")
+                .bind(job)
+                .fetch<uint, int>([&](uint build, int result){
+            updateBadge(job, build, RunState(result));
+        });
+        it = badges.find(job);
+        // unknown jobs are not cached, there is no limit on their names
+        if(it == badges.end())
+            return false;
+    }
+    if(it->second.svg.empty())
         return false;
 
-    badge = svg;
+    badge = it->second.svg;
+    // the job is identified by the URL of the badge already
+    etag = "\"" + std::to_string(it->second.build) + "-" + to_string(it->second.result) + "\"";
     return true;
 }
 
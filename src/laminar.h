@@ -22,9 +22,12 @@
 #include "monitorscope.h"
 #include "context.h"
 #include "database.h"
+#include "compression.h"
 
 #include <list>
+#include <map>
 #include <unordered_map>
+#include <vector>
 #include <kj/filesystem.h>
 #include <kj/async-io.h>
 
@@ -42,6 +45,13 @@ struct Settings {
     const char* bind_rpc;
     const char* bind_http;
     const char* archive_url;
+    // number of threads serving HTTP, 0 to serve on the main thread
+    int http_threads = 0;
+    // train per-job dictionaries for logs compressed with zstd
+    bool log_dictionaries = false;
+    // seconds between checkpoints of the logs of running jobs, 0 to
+    // store logs only when runs complete
+    int log_checkpoint_interval = 30;
 };
 
 // The main class implementing the application's business logic.
@@ -54,12 +64,34 @@ public:
     // the supplied name is not a known job.
     std::shared_ptr<Run> queueJob(std::string name, ParamMap params = ParamMap(), bool frontOfQueue = false);
 
+    // Queues several jobs at once. The runs are stored in a single database
+    // transaction, clients are sent one jobs_queued event per job name
+    // instead of a job_queued event per run, and the queue is only
+    // processed once. The result has a null entry for each job which
+    // does not exist.
+    struct JobRequest {
+        std::string name;
+        ParamMap params;
+    };
+    std::vector<std::shared_ptr<Run>> queueJobs(std::vector<JobRequest> jobs, bool frontOfQueue = false);
+
     // Return the latest known number of the named job
     uint latestRun(std::string job);
 
-    // Given a job name and number, return existence and (via reference params)
-    // its current log output and whether the job is ongoing
-    bool handleLogRequest(std::string name, uint num, std::string& output, bool& complete);
+    // The log output of a run so far, and whether the run has completed
+    struct RunLog {
+        std::string output;
+        bool complete;
+        // if set, output is still compressed in this HTTP content coding
+        const char* encoding = nullptr;
+        // RUNNING until the run has completed
+        RunState result = RunState::UNKNOWN;
+    };
+
+    // Given a job name and number, fetch its log output. Stored logs are
+    // decompressed off the event loop, unless they are stored in one of the
+    // given HTTP content codings. Resolves to nullptr if the run does not exist
+    kj::Promise<kj::Maybe<RunLog>> handleLogRequest(std::string name, uint num, std::set<std::string> acceptedEncodings = {});
 
     // Given a relevant scope, returns a JSON string describing the current
     // server status. Content differs depending on the page viewed by the user,
@@ -86,9 +118,15 @@ public:
     kj::Maybe<kj::Own<const kj::ReadableFile>> getArtefact(std::string path);
 
     // Given the name of a job, populate the provided string reference with
-    // SVG content describing the last known state of the job. Returns false
+    // SVG content describing the last known state of the job, and etag with
+    // a validator which changes whenever the content does. Returns false
     // if the job is unknown.
-    bool handleBadgeRequest(std::string job, std::string& badge);
+    bool handleBadgeRequest(std::string job, std::string& badge, std::string& etag);
+
+    // Resolves once the runs queued, started or finished so far have been
+    // written to the database. Clients are only told about a run after
+    // this, so that it is not lost if laminard is killed
+    kj::Promise<void> whenCommitted();
 
     // Aborts a single job
     bool abort(std::string job, uint buildNum);
@@ -98,11 +136,52 @@ public:
 
 private:
     bool loadConfiguration();
+    // Creates and stores a run of the job, or returns nullptr if the job
+    // does not exist. The caller has to add it to queuedJobs
+    std::shared_ptr<Run> createRun(std::string name, ParamMap params);
+    bool jobExists(const std::string& name) const;
+    // Requeues the runs which were still queued when laminard last exited,
+    // and aborts those which were running
+    void recoverRuns();
+    // Restores the fan-ins which were still waiting for their fan-out runs
+    // when laminard last exited. Must follow recoverRuns
+    void recoverFanIns();
+    // Opens a transaction for the lifecycle updates of runs, if there isn't
+    // one already, which is committed at the end of this turn of the event
+    // loop. Writes from runs queued, started or finished together then
+    // share a single sync to disk
+    void batchWrites();
     void loadCustomizations();
     void assignNewJobs();
+    // Periodically refreshes systemLoad while any context has load limits
+    kj::Promise<void> sampleLoad();
+    // Every logCheckpointInterval seconds, stores the log so far of each
+    // running job, which is what remains of it if laminard is killed
+    // before the run completes
+    kj::Promise<void> checkpointLogs();
     bool canQueue(const Context& ctx, const Run& run) const;
     bool tryStartRun(std::shared_ptr<Run> run, int queueIndex);
+    void notifyRunStarted(const Run& run, int queueIndex);
+    // Runs cfg/jobs/$JOB.cachekey to determine the cache key of the run,
+    // with the environment the run would have in the named context
+    kj::Promise<void> evaluateCacheKey(std::shared_ptr<Run> run, std::string context);
+    // Completes the run with the result of an earlier one with the same cache key
+    void reuseCachedRun(std::shared_ptr<Run> run, std::shared_ptr<Context> ctx, uint cachedBuild);
+    // Stores the run and notifies clients through handleRunFinished, then
+    // compresses its log off the event loop and stores it with storeLog
+    kj::Promise<void> finishRun(std::shared_ptr<Run> run);
     void handleRunFinished(Run*);
+    // Removes the cgroup of a finished run, retrying while killed
+    // processes are still exiting
+    void removeCgroup(std::string path, int attempts);
+    void storeLog(const Run& run, std::string storedLog, LogCodec codec, int dictId);
+    // Trains a new log dictionary for the job from its recent logs, if
+    // enough runs have completed since the last one was trained
+    void updateLogDictionary(std::string job, uint build);
+    // Replaces the cached badge of the job if build is its latest result
+    void updateBadge(std::string job, uint build, RunState result);
+    // Queues the jobs configured with FANOUT or FANIN to follow a finished run
+    void queueDownstream(Run*);
     // expects that Json has started an array
     void populateArtifacts(Json& out, std::string job, uint num, kj::Path subdir = kj::Path::parse(".")) const;
 
@@ -121,14 +200,67 @@ private:
 
     std::unordered_map<std::string, std::string> jobGroups;
 
+    std::unordered_map<std::string, CgroupLimits> jobCgroupLimits;
+
+    // The rendered badge of each job which has been requested or has
+    // completed a run since startup
+    struct Badge {
+        uint build = 0;
+        RunState result = RunState::UNKNOWN;
+        std::string svg;
+    };
+    std::unordered_map<std::string, Badge> badges;
+
+    // Jobs to be queued in parallel when a run of the key job succeeds,
+    // and the job to be queued once all of those have succeeded
+    std::unordered_map<std::string, std::vector<std::string>> jobFanOut;
+    std::unordered_map<std::string, std::string> jobFanIn;
+
+    // A fan-in job waiting for the runs of a fan-out to succeed. Runs
+    // are referenced by job name and number. Stored in the fanins table
+    // under the upstream run until it is queued or cancelled, so that
+    // recoverFanIns can pick it up again after a restart.
+    struct FanIn {
+        std::string job;
+        ParamMap params;
+        int remaining;
+        bool cancelled;
+        std::string upstream;
+        uint upstreamBuild;
+    };
+    std::map<std::pair<std::string, uint>, std::shared_ptr<FanIn>> pendingFanIns;
+
     RunSet activeJobs;
+    // finished runs whose log is still being compressed, served from here
+    std::map<std::pair<std::string, uint>, std::shared_ptr<Run>> storingLogs;
     Database* db;
+    // pending while batchWrites has an open transaction
+    kj::Maybe<kj::ForkedPromise<void>> pendingCommit;
     Server& srv;
     ContextMap contexts;
+    SystemLoad systemLoad;
+    // runs started since systemLoad was sampled
+    int runsSinceSample = 0;
+    kj::Maybe<kj::Promise<void>> loadSampler;
+    int logCheckpointInterval = 0;
+    kj::Maybe<kj::Promise<void>> logCheckpointer;
     kj::Path homePath;
     kj::Own<const kj::Directory> fsHome;
     uint numKeepRunDirs;
     std::string archiveUrl;
+    // The latest zstd dictionary of each job, and the build number at
+    // which it was trained (or training was last attempted)
+    struct LogDictionary {
+        int id = 0;
+        uint trainedAt = 0;
+        std::shared_ptr<const std::string> data;
+    };
+    std::unordered_map<std::string, LogDictionary> logDictionaries;
+    bool useLogDictionaries;
+    // incremented by every reload of the custom HTML template
+    uint indexGeneration = 0;
+    // if non-empty, each run is contained in a cgroup below this one
+    std::string cgroupRoot;
 
     kj::Own<Http> http;
     kj::Own<Rpc> rpc;
@@ -20,6 +20,10 @@
 #include <string>
 #include <unistd.h>
 #include <queue>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+#include <sstream>
 #include <dirent.h>
 #if defined(__FreeBSD__)
 #include <sys/procctl.h>
@@ -28,11 +32,18 @@
 #endif
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/file.h>
+#include <fcntl.h>
 #include <kj/async-io.h>
 #include <kj/async-unix.h>
 #include <kj/filesystem.h>
+#include <kj/vector.h>
 
 #include "run.h"
+#include "cgroup.h"
+#include "conf.h"
+#include "workspace.h"
 
 // short syntax helper for kj::Path
 template<typename T>
@@ -44,10 +55,28 @@ inline kj::Path operator/(const kj::PathPtr& p, const T& ext) {
     return p.append(ext);
 }
 
+// Size of the buffer for reading the output of steps
+#define STEP_OUTPUT_BUFSIZE 4096
+
 struct Script {
     kj::Path path;
     kj::Path cwd;
     bool runOnAbort;
+    // path is a directory of steps to be executed in parallel
+    bool parallelSteps = false;
+    // the script initialises the job's workspace
+    bool initWorkspace = false;
+};
+
+// A script in $JOB.d, which may run concurrently with other steps once
+// all the steps it depends on have succeeded
+struct Step {
+    std::string name;
+    kj::Path path = nullptr;
+    std::vector<std::string> depends;
+    enum { PENDING, RUNNING, SUCCEEDED, FAILED, SKIPPED } state = PENDING;
+    // also the process group of the step
+    pid_t pid = 0;
 };
 
 static void aggressive_recursive_kill(pid_t parent) {
@@ -55,6 +84,9 @@ static void aggressive_recursive_kill(pid_t parent) {
     if(!proc)
         return;
 
+    // Read the parent of every process in a single pass, rather than
+    // rescanning /proc for every level of descendants
+    std::unordered_multimap<pid_t, pid_t> children;
     while(struct dirent* de = readdir(proc)) {
         if(!isdigit(*de->d_name))
             continue;
@@ -68,30 +100,53 @@ static void aggressive_recursive_kill(pid_t parent) {
 
         char status_buffer[512];
         int n = fread(status_buffer, 1, 512, status_fp);
-        if(char* p = (char*)memmem(status_buffer, n, "PPid:\t", 6)) {
-            pid_t ppid = strtol(p + 6, NULL, 10);
-            if(ppid == parent) {
-                pid_t pid = atoi(de->d_name);
-                aggressive_recursive_kill(pid);
-                fprintf(stderr, "[laminar] sending SIGKILL to pid %d\n", pid);
-                kill(pid, SIGKILL);
-            }
-        }
+        if(char* p = (char*)memmem(status_buffer, n, "PPid:\t", 6))
+            children.emplace(strtol(p + 6, NULL, 10), atoi(de->d_name));
         fclose(status_fp);
     }
     closedir(proc);
+
+    std::vector<pid_t> descendants;
+    std::vector<pid_t> pending{parent};
+    while(!pending.empty()) {
+        pid_t p = pending.back();
+        pending.pop_back();
+        auto range = children.equal_range(p);
+        for(auto it = range.first; it != range.second; ++it) {
+            descendants.push_back(it->second);
+            pending.push_back(it->second);
+        }
+    }
+
+    // deepest descendants first, as they were found last
+    for(auto it = descendants.rbegin(); it != descendants.rend(); ++it) {
+        fprintf(stderr, "[laminar] sending SIGKILL to pid %d\n", *it);
+        kill(*it, SIGKILL);
+    }
 }
 
 
 class Leader final : public kj::TaskSet::ErrorHandler {
 public:
-    Leader(kj::AsyncIoContext& ioContext, kj::Filesystem& fs, const char* jobName, uint runNumber);
+    Leader(kj::AsyncIoContext& ioContext, kj::Filesystem& fs, const char* jobName, uint runNumber, std::string cgroup);
     RunState run();
+    // resources used by all reaped descendants and the leader itself
+    RunUsage usage() const;
 
 private:
     void taskFailed(kj::Exception&& exception) override;
     kj::Promise<void> step(std::queue<Script>& scripts);
     kj::Promise<void> reapChildProcesses();
+    kj::Promise<void> reapExitedProcesses();
+    kj::Promise<void> runSteps(const Script& script);
+    void startSteps();
+    void startStep(Step& step, const kj::Path& cwd);
+    void finishStep(Step& step, int status);
+    kj::Promise<void> readStepOutput(kj::AsyncInputStream* stream, std::string* prefix, std::string* line, char* buffer);
+    void accumulateUsage(const struct rusage& ru);
+    void killDescendants();
+    void snapshotWorkspace();
+    void releaseWorkspaceSnapshot();
     kj::Promise<void> readEnvPipe(kj::AsyncInputStream* stream, char* buffer);
 
     kj::TaskSet tasks;
@@ -106,9 +161,24 @@ private:
     std::queue<Script> scripts;
     int setEnvPipe[2];
     bool aborting;
+    RunUsage childUsage;
+    // cgroup of the run, and the child cgroup containing its scripts
+    std::string cgroup;
+    std::string scriptsCgroup;
+    // steps from $JOB.d, if any
+    std::vector<Step> steps;
+    kj::Path stepsCwd;
+    kj::Vector<kj::Promise<void>> stepOutput;
+    int runningSteps;
+    int stepParallelism;
+    bool terminating;
+    // WORKSPACE_SNAPSHOT is enabled for the job
+    bool useWorkspaceSnapshot;
+    bool snapshotAttempted;
+    kj::Maybe<kj::Path> workspaceSnapshot;
 };
 
-Leader::Leader(kj::AsyncIoContext &ioContext, kj::Filesystem &fs, const char *jobName, uint runNumber) :
+Leader::Leader(kj::AsyncIoContext &ioContext, kj::Filesystem &fs, const char *jobName, uint runNumber, std::string cgroup) :
     tasks(*this),
     result(RunState::SUCCESS),
     ioContext(ioContext),
@@ -116,16 +186,32 @@ Leader::Leader(kj::AsyncIoContext &ioContext, kj::Filesystem &fs, const char *jo
     rootPath(fs.getCurrentPath()),
     jobName(jobName),
     runNumber(runNumber),
-    aborting(false)
+    currentGroupId(0),
+    currentScriptPid(0),
+    aborting(false),
+    cgroup(kj::mv(cgroup)),
+    stepsCwd(nullptr),
+    runningSteps(0),
+    stepParallelism(1),
+    terminating(false),
+    useWorkspaceSnapshot(false),
+    snapshotAttempted(false)
 {
     tasks.add(ioContext.unixEventPort.onSignal(SIGTERM).then([this](siginfo_t) {
         while(scripts.size() && (!scripts.front().runOnAbort))
             scripts.pop();
+        // no further steps will be started
+        terminating = true;
         // TODO: probably shouldn't do this if we are already in a runOnAbort script
-        kill(-currentGroupId, SIGTERM);
+        if(currentGroupId)
+            kill(-currentGroupId, SIGTERM);
+        for(const Step& s : steps) {
+            if(s.state == Step::RUNNING)
+                kill(-s.pid, SIGTERM);
+        }
         return this->ioContext.provider->getTimer().afterDelay(2*kj::SECONDS).then([this]{
             aborting = true;
-            aggressive_recursive_kill(getpid());
+            killDescendants();
         });
     }));
 
@@ -164,13 +250,20 @@ RunState Leader::run()
         return RunState::FAILED;
     }
 
+    StringMap jobConf = parseConfFile((rootPath/cfgDir/"jobs"/(jobName+".conf")).toString(true).cStr());
+    std::string snapshotMode = jobConf.get<std::string>("WORKSPACE_SNAPSHOT");
+    if(snapshotMode == "reflink")
+        useWorkspaceSnapshot = true;
+    else if(!snapshotMode.empty())
+        fprintf(stderr, "[laminar] Unsupported WORKSPACE_SNAPSHOT %s, using the workspace directly\n", snapshotMode.c_str());
+
     // create a workspace for this job if it doesn't exist
     kj::Path ws{"run",jobName,"workspace"};
     if(!home.exists(ws)) {
         home.openSubdir(ws, kj::WriteMode::CREATE|kj::WriteMode::CREATE_PARENT);
         // prepend the workspace init script
         if(home.exists(cfgDir/"jobs"/(jobName+".init")))
-            scripts.push({cfgDir/"jobs"/(jobName+".init"), kj::mv(ws), false});
+            scripts.push({cfgDir/"jobs"/(jobName+".init"), kj::mv(ws), false, false, true});
     }
 
     // add scripts
@@ -180,8 +273,16 @@ RunState Leader::run()
     // job before-run script
     if(home.exists(cfgDir/"jobs"/(jobName+".before")))
         scripts.push({cfgDir/"jobs"/(jobName+".before"), rd.clone(), false});
-    // main run script. must exist.
-    scripts.push({cfgDir/"jobs"/(jobName+".run"), rd.clone(), false});
+    // main run script. must exist, unless the job consists of steps
+    kj::Path stepsDir = cfgDir/"jobs"/(jobName+".d");
+    bool hasSteps = home.exists(stepsDir);
+    if(!hasSteps || home.exists(cfgDir/"jobs"/(jobName+".run")))
+        scripts.push({cfgDir/"jobs"/(jobName+".run"), rd.clone(), false});
+    // steps which may run in parallel
+    if(hasSteps) {
+        stepParallelism = std::max(1, jobConf.get<int>("STEP_PARALLELISM", sysconf(_SC_NPROCESSORS_ONLN)));
+        scripts.push({kj::mv(stepsDir), rd.clone(), false, true});
+    }
     // job after-run script
     if(home.exists(cfgDir/"jobs"/(jobName+".after")))
         scripts.push({cfgDir/"jobs"/(jobName+".after"), rd.clone(), true});
@@ -189,10 +290,116 @@ RunState Leader::run()
     if(home.exists(cfgDir/"after"))
         scripts.push({cfgDir/"after", rd.clone(), true});
 
+    // The scripts get a cgroup of their own below that of the run, so that
+    // all of their descendants can be killed at once without the leader
+    if(!cgroup.empty())
+        scriptsCgroup = cgroupCreate(cgroup, "scripts", CgroupLimits());
+
     // Start executing scripts
-    return step(scripts).then([this](){
-        return result;
-    }).wait(ioContext.waitScope);
+    step(scripts).wait(ioContext.waitScope);
+
+    releaseWorkspaceSnapshot();
+    return result;
+}
+
+static ulong cpuTimeMs(const struct rusage& ru) {
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000
+        + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000;
+}
+
+void Leader::accumulateUsage(const struct rusage& ru)
+{
+    childUsage.cpuTime += cpuTimeMs(ru);
+    // ru_maxrss is in kilobytes. It is the peak of a single process, so
+    // concurrent processes are underestimated. Containing the run in a
+    // cgroup gives the true peak of the whole tree.
+    childUsage.peakMemory = std::max(childUsage.peakMemory, ulong(ru.ru_maxrss) * 1024);
+    // block counts are in units of 512 bytes
+    childUsage.ioBytes += ulong(ru.ru_inblock + ru.ru_oublock) * 512;
+}
+
+RunUsage Leader::usage() const
+{
+    RunUsage u = childUsage;
+    struct rusage self;
+    if(getrusage(RUSAGE_SELF, &self) == 0) {
+        u.cpuTime += cpuTimeMs(self);
+        u.peakMemory = std::max(u.peakMemory, ulong(self.ru_maxrss) * 1024);
+        u.ioBytes += ulong(self.ru_inblock + self.ru_oublock) * 512;
+    }
+    return u;
+}
+
+void Leader::killDescendants()
+{
+    if(!scriptsCgroup.empty()) {
+        fprintf(stderr, "[laminar] killing all processes in %s\n", scriptsCgroup.c_str());
+        if(cgroupKill(scriptsCgroup))
+            return;
+    }
+    // no cgroup, fall back to finding descendants through /proc
+    aggressive_recursive_kill(getpid());
+}
+
+// Snapshots are taken and promoted while holding an exclusive lock on
+// run/$JOB, so that a snapshot never sees a workspace which is being
+// exchanged or removed by a simultaneous run of the job. The lock is
+// released by closing the returned descriptor
+static int lockRunDir(const std::string& dir)
+{
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0)
+        return -1;
+    while(flock(fd, LOCK_EX) < 0 && errno == EINTR)
+        ;
+    return fd;
+}
+
+void Leader::snapshotWorkspace()
+{
+    snapshotAttempted = true;
+    kj::Path ws{"run",jobName,"workspace"};
+    // a sibling of the workspace, since reflinks cannot cross filesystems
+    kj::Path snapshot{"run",jobName,"workspace." + std::to_string(runNumber)};
+    std::string snapshotDir = (rootPath/snapshot).toString(true).cStr();
+
+    int lock = lockRunDir((rootPath/"run"/jobName).toString(true).cStr());
+    KJ_DEFER(if(lock >= 0) close(lock));
+
+    // left over by a leader which was killed
+    home.tryRemove(snapshot);
+
+    if(!workspaceClone((rootPath/ws).toString(true).cStr(), snapshotDir)) {
+        int err = errno;
+        home.tryRemove(snapshot);
+        fprintf(stderr, "[laminar] Could not snapshot workspace (%s), using it directly\n", strerror(err));
+        return;
+    }
+    fprintf(stderr, "[laminar] Using workspace snapshot %s\n", snapshotDir.c_str());
+    // inherited by all scripts from now on
+    setenv("WORKSPACE", snapshotDir.c_str(), true);
+    workspaceSnapshot = kj::mv(snapshot);
+}
+
+void Leader::releaseWorkspaceSnapshot()
+{
+    KJ_IF_MAYBE(snapshot, workspaceSnapshot) {
+        int lock = lockRunDir((rootPath/"run"/jobName).toString(true).cStr());
+        KJ_DEFER(if(lock >= 0) close(lock));
+        // The snapshot of a successful run becomes the workspace of the
+        // following runs, so that whatever it fetched or built is kept.
+        // When simultaneous runs succeed, the last to get here wins
+        if(result == RunState::SUCCESS) {
+            kj::Path ws{"run",jobName,"workspace"};
+            if(workspaceExchange((rootPath/(*snapshot)).toString(true).cStr(), (rootPath/ws).toString(true).cStr()))
+                fprintf(stderr, "[laminar] Workspace snapshot promoted\n");
+            else
+                fprintf(stderr, "[laminar] Could not promote workspace snapshot: %s\n", strerror(errno));
+        }
+        // either the discarded snapshot or the previous workspace
+        home.tryRemove(*snapshot);
+        workspaceSnapshot = nullptr;
+    }
 }
 
 void Leader::taskFailed(kj::Exception &&exception)
@@ -208,6 +415,17 @@ kj::Promise<void> Leader::step(std::queue<Script> &scripts)
     Script currentScript = kj::mv(scripts.front());
     scripts.pop();
 
+    // Everything after the init script works on a snapshot of the
+    // initialised workspace
+    if(useWorkspaceSnapshot && !snapshotAttempted && !currentScript.initWorkspace)
+        snapshotWorkspace();
+
+    if(currentScript.parallelSteps) {
+        return runSteps(currentScript).then([&](){
+            return step(scripts);
+        });
+    }
+
     pid_t pid = fork();
     if(pid == 0) { // child
         // unblock all signals
@@ -218,6 +436,9 @@ kj::Promise<void> Leader::step(std::queue<Script> &scripts)
         // create a new process group to help us deal with any wayward forks
         setpgid(0, 0);
 
+        if(!scriptsCgroup.empty() && !cgroupEnter(scriptsCgroup))
+            fprintf(stderr, "[laminar] Failed to enter cgroup %s\n", scriptsCgroup.c_str());
+
         std::string buildNum = std::to_string(runNumber);
 
         LSYSCALL(chdir(currentScript.cwd.toString(false).cStr()));
@@ -247,50 +468,249 @@ kj::Promise<void> Leader::step(std::queue<Script> &scripts)
 
 kj::Promise<void> Leader::reapChildProcesses()
 {
-    return ioContext.unixEventPort.onSignal(SIGCHLD).then([this](siginfo_t) -> kj::Promise<void> {
-        while(true) {
-            int status;
-            errno = 0;
-            pid_t pid = waitpid(-1, &status, WNOHANG);
-            if(pid == -1 && errno == ECHILD) {
-                // all children exited
-                return kj::READY_NOW;
-            } else if(pid == 0) {
-                // child processes are still running
-                if(currentScriptPid) {
-                    // We could get here if a more deeply nested process was reparented to us
-                    // before the primary script executed. Quietly wait until the process we're
-                    // waiting for is done
-                    return reapChildProcesses();
-                }
-                // we were aborted by the primary process already, just wait until all
-                // SIGKILLs are processed
-                if(aborting) {
-                    return reapChildProcesses();
-                }
-                // Otherwise, reparented orphans are on borrowed time
-                // TODO list wayward processes?
-                fprintf(stderr, "[laminar] sending SIGHUP to adopted child processes\n");
+    return ioContext.unixEventPort.onSignal(SIGCHLD).then([this](siginfo_t) {
+        return reapExitedProcesses();
+    });
+}
+
+kj::Promise<void> Leader::reapExitedProcesses()
+{
+    while(true) {
+        int status;
+        struct rusage ru;
+        errno = 0;
+        pid_t pid = wait4(-1, &status, WNOHANG, &ru);
+        if(pid > 0)
+            accumulateUsage(ru);
+        if(pid == -1 && errno == ECHILD) {
+            // all children exited
+            return kj::READY_NOW;
+        } else if(pid == 0) {
+            // child processes are still running
+            if(currentScriptPid || runningSteps) {
+                // We could get here if a more deeply nested process was reparented to us
+                // before the primary script executed. Quietly wait until the process we're
+                // waiting for is done
+                return reapChildProcesses();
+            }
+            // we were aborted by the primary process already, just wait until all
+            // SIGKILLs are processed
+            if(aborting) {
+                return reapChildProcesses();
+            }
+            // Otherwise, reparented orphans are on borrowed time
+            // TODO list wayward processes?
+            fprintf(stderr, "[laminar] sending SIGHUP to adopted child processes\n");
+            if(currentGroupId)
                 kill(-currentGroupId, SIGHUP);
-                return ioContext.provider->getTimer().afterDelay(5*kj::SECONDS).then([this]{
-                    // TODO: should we mark the job as failed if we had to kill reparented processes?
-                    aggressive_recursive_kill(getpid());
-                    return reapChildProcesses();
-                }).exclusiveJoin(reapChildProcesses());
-            } else if(pid == currentScriptPid) {
-                // the script we were waiting for is done
-                // if we already marked as failed, preserve that
-                if(result == RunState::SUCCESS) {
-                    if(WIFSIGNALED(status) && (WTERMSIG(status) == SIGTERM || WTERMSIG(status) == SIGKILL))
-                        result = RunState::ABORTED;
-                    else if(WEXITSTATUS(status) != 0)
+            for(const Step& s : steps) {
+                if(s.pid)
+                    kill(-s.pid, SIGHUP);
+            }
+            return ioContext.provider->getTimer().afterDelay(5*kj::SECONDS).then([this]{
+                // TODO: should we mark the job as failed if we had to kill reparented processes?
+                killDescendants();
+                return reapChildProcesses();
+            }).exclusiveJoin(reapChildProcesses());
+        } else if(pid == currentScriptPid) {
+            // the script we were waiting for is done
+            // if we already marked as failed, preserve that
+            if(result == RunState::SUCCESS) {
+                if(WIFSIGNALED(status) && (WTERMSIG(status) == SIGTERM || WTERMSIG(status) == SIGKILL))
+                    result = RunState::ABORTED;
+                else if(WEXITSTATUS(status) != 0)
+                    result = RunState::FAILED;
+            }
+            currentScriptPid = 0;
+        } else if(auto s = std::find_if(steps.begin(), steps.end(), [pid](const Step& s){
+                return s.state == Step::RUNNING && s.pid == pid; }); s != steps.end()) {
+            finishStep(*s, status);
+        } else {
+            // some reparented process was reaped
+        }
+    }
+}
+
+kj::Promise<void> Leader::runSteps(const Script& script)
+{
+    // Each step is $JOB.d/$STEP.run, optionally with $JOB.d/$STEP.conf
+    // containing DEPENDS=step1,step2
+    steps.clear();
+    for(kj::String& file : home.openSubdir(script.path)->listNames()) {
+        if(!file.endsWith(".run"))
+            continue;
+        Step s;
+        s.name = std::string(file.begin(), file.size() - 4);
+        s.path = script.path/file;
+        StringMap conf = parseConfFile((rootPath/script.path/(s.name+".conf")).toString(true).cStr());
+        std::istringstream deps(conf.get<std::string>("DEPENDS"));
+        for(std::string dep; std::getline(deps, dep, ',');) {
+            if(!dep.empty())
+                s.depends.push_back(dep);
+        }
+        steps.push_back(kj::mv(s));
+    }
+    stepsCwd = script.cwd.clone();
+
+    startSteps();
+
+    // Completes when all processes, including those of the steps, have
+    // exited. Then wait for their remaining output to be written.
+    return reapExitedProcesses().then([this](){
+        steps.clear();
+        return kj::joinPromises(stepOutput.releaseAsArray());
+    });
+}
+
+void Leader::startSteps()
+{
+    // Skip steps whose dependencies can no longer succeed. This may
+    // cascade, so repeat until nothing changes
+    for(bool changed = true; changed;) {
+        changed = false;
+        for(Step& s : steps) {
+            if(s.state != Step::PENDING)
+                continue;
+            for(const std::string& dep : s.depends) {
+                auto d = std::find_if(steps.begin(), steps.end(), [&](const Step& d){ return d.name == dep; });
+                if(d == steps.end() || d->state == Step::FAILED || d->state == Step::SKIPPED) {
+                    fprintf(stderr, "[laminar] Skipping step %s because %s %s\n", s.name.c_str(), dep.c_str(),
+                            d == steps.end() ? "does not exist" : "did not succeed");
+                    s.state = Step::SKIPPED;
+                    // a dependency that doesn't exist is a configuration
+                    // error, the run cannot be considered successful
+                    if(d == steps.end() && result == RunState::SUCCESS)
                         result = RunState::FAILED;
+                    changed = true;
+                    break;
                 }
-                currentScriptPid = 0;
-            } else {
-                // some reparented process was reaped
             }
         }
+    }
+
+    for(Step& s : steps) {
+        if(terminating || runningSteps >= stepParallelism)
+            break;
+        if(s.state == Step::PENDING && std::all_of(s.depends.begin(), s.depends.end(), [&](const std::string& dep){
+                return std::find_if(steps.begin(), steps.end(), [&](const Step& d){
+                    return d.name == dep && d.state == Step::SUCCEEDED; }) != steps.end(); }))
+            startStep(s, stepsCwd);
+    }
+
+    // If nothing is running now, whatever is left can never start,
+    // either because the run is being aborted or because of a cycle
+    if(runningSteps == 0) {
+        for(Step& s : steps) {
+            if(s.state == Step::PENDING) {
+                if(!terminating)
+                    fprintf(stderr, "[laminar] Skipping step %s because of circular dependencies\n", s.name.c_str());
+                s.state = Step::SKIPPED;
+                if(result == RunState::SUCCESS)
+                    result = RunState::FAILED;
+            }
+        }
+    }
+}
+
+void Leader::startStep(Step& step, const kj::Path& cwd)
+{
+    // Output of each step goes through a pipe so that its lines can be
+    // prefixed with the name of the step
+    int out[2];
+    LSYSCALL(pipe(out));
+
+    fprintf(stderr, "[laminar] Executing step %s\n", step.name.c_str());
+
+    pid_t pid = fork();
+    if(pid == 0) { // child
+        // unblock all signals
+        sigset_t mask;
+        sigfillset(&mask);
+        sigprocmask(SIG_UNBLOCK, &mask, nullptr);
+
+        // create a new process group to help us deal with any wayward forks
+        setpgid(0, 0);
+
+        if(!scriptsCgroup.empty() && !cgroupEnter(scriptsCgroup))
+            fprintf(stderr, "[laminar] Failed to enter cgroup %s\n", scriptsCgroup.c_str());
+
+        close(out[0]);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(out[1], STDERR_FILENO);
+        close(out[1]);
+
+        LSYSCALL(chdir(cwd.toString(false).cStr()));
+
+        setenv("RESULT", to_string(result).c_str(), true);
+        setenv("STEP", step.name.c_str(), true);
+
+        // pass the pipe through a variable to allow laminarc to send new env back
+        char pipeNum[4];
+        sprintf(pipeNum, "%d", setEnvPipe[1]);
+        setenv("__LAMINAR_SETENV_PIPE", pipeNum, 1);
+
+        kj::String execPath = (rootPath/step.path).toString(true);
+
+        execl(execPath.cStr(), execPath.cStr(), NULL);
+        fprintf(stderr, "[laminar] Failed to execute %s\n", step.path.toString().cStr());
+        _exit(1);
+    }
+    close(out[1]);
+
+    step.pid = pid;
+    step.state = Step::RUNNING;
+    runningSteps++;
+
+    auto stream = ioContext.lowLevelProvider->wrapInputFd(out[0], kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP);
+    auto prefix = kj::heap<std::string>("[" + step.name + "] ");
+    auto line = kj::heap<std::string>();
+    auto buffer = kj::heapArray<char>(STEP_OUTPUT_BUFSIZE);
+    stepOutput.add(readStepOutput(stream.get(), prefix.get(), line.get(), buffer.begin())
+            .attach(kj::mv(stream), kj::mv(prefix), kj::mv(line), kj::mv(buffer)));
+}
+
+void Leader::finishStep(Step& step, int status)
+{
+    runningSteps--;
+    if(WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        step.state = Step::SUCCEEDED;
+    } else {
+        step.state = Step::FAILED;
+        fprintf(stderr, "[laminar] Step %s failed\n", step.name.c_str());
+        // if we already marked as failed, preserve that
+        if(result == RunState::SUCCESS) {
+            if(WIFSIGNALED(status) && (WTERMSIG(status) == SIGTERM || WTERMSIG(status) == SIGKILL))
+                result = RunState::ABORTED;
+            else
+                result = RunState::FAILED;
+        }
+    }
+    startSteps();
+}
+
+kj::Promise<void> Leader::readStepOutput(kj::AsyncInputStream* stream, std::string* prefix, std::string* line, char* buffer)
+{
+    return stream->tryRead(buffer, 1, STEP_OUTPUT_BUFSIZE).then([this,stream,prefix,line,buffer](size_t sz) {
+        // write out complete lines, keeping any partial line for later
+        std::string out;
+        for(char* p = buffer, *end = buffer + sz; p < end;) {
+            char* nl = (char*) memchr(p, '\n', end - p);
+            if(!nl) {
+                line->append(p, end);
+                break;
+            }
+            line->append(p, nl + 1);
+            out += *prefix + *line;
+            line->clear();
+            p = nl + 1;
+        }
+        if(sz == 0 && !line->empty())
+            out += *prefix + *line + "\n";
+        fwrite(out.data(), 1, out.size(), stdout);
+        fflush(stdout);
+        if(sz == 0)
+            return kj::Promise<void>(kj::READY_NOW);
+        return readStepOutput(stream, prefix, line, buffer);
     });
 }
 
@@ -309,6 +729,11 @@ kj::Promise<void> Leader::readEnvPipe(kj::AsyncInputStream *stream, char *buffer
 }
 
 int leader_main(void) {
+    // laminard spawns us with $LAMINAR_HOME as PWD but cannot set the
+    // working directory itself
+    if(const char* home = getenv("PWD"))
+        LSYSCALL(chdir(home));
+
     auto ioContext = kj::setupAsyncIo();
     auto fs = kj::newDiskFilesystem();
 
@@ -331,6 +756,17 @@ int leader_main(void) {
     // will also get a kill signal when the run is aborted
     setpgid(0, 0);
 
+    // Join the cgroup laminard prepared for this run before forking anything,
+    // so that all descendants are contained and accounted to it
+    std::string cgroup;
+    if(const char* path = getenv("__LAMINAR_CGROUP")) {
+        if(cgroupEnter(path))
+            cgroup = path;
+        else
+            fprintf(stderr, "[laminar] Failed to enter cgroup %s\n", path);
+        unsetenv("__LAMINAR_CGROUP");
+    }
+
     // Environment inherited from main laminard process
     const char* jobName = getenv("JOB");
     std::string name(jobName);
@@ -339,8 +775,25 @@ int leader_main(void) {
     if(!jobName || !runNumber)
         return EXIT_FAILURE;
 
-    Leader leader(ioContext, *fs, jobName, runNumber);
+    // Resource usage is reported back to laminard through this pipe. Keep it
+    // from the scripts, which have no business writing to it.
+    int usageFd = -1;
+    if(const char* fd = getenv("__LAMINAR_USAGE_FD")) {
+        usageFd = atoi(fd);
+        fcntl(usageFd, F_SETFD, FD_CLOEXEC);
+        unsetenv("__LAMINAR_USAGE_FD");
+    }
+
+    Leader leader(ioContext, *fs, jobName, runNumber, cgroup);
+    RunState result = leader.run();
+
+    if(usageFd >= 0) {
+        RunUsage usage = leader.usage();
+        if(write(usageFd, &usage, sizeof(usage)) != sizeof(usage))
+            fprintf(stderr, "[laminar] Failed to report resource usage\n");
+        close(usageFd);
+    }
 
     // Parent process will cast back to RunState
-    return int(leader.run());
+    return int(result);
 }
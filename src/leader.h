@@ -32,3 +32,7 @@
 
 int leader_main(void);
 
+// The leader reports the resources used by the run to laminard through
+// this descriptor, if __LAMINAR_USAGE_FD is set
+#define LEADER_USAGE_FD 3
+
@@ -20,6 +20,7 @@
 #include "leader.h"
 #include "server.h"
 #include "log.h"
+#include "zygote.h"
 
 #include <fcntl.h>
 #include <iostream>
@@ -84,6 +85,10 @@ int main(int argc, char** argv) {
     close(STDIN_FILENO);
     LASSERT(open("/dev/null", O_RDONLY) == STDIN_FILENO);
 
+    // The zygote has to be forked before laminard sets up anything else
+    if(const char* zygote = getenv("LAMINAR_ZYGOTE"); zygote && atoi(zygote))
+        zygoteStart(argc, argv);
+
     auto ioContext = kj::setupAsyncIo();
 
     Settings settings;
@@ -92,8 +97,16 @@ int main(int argc, char** argv) {
     settings.bind_rpc = getenv("LAMINAR_BIND_RPC") ?: INTADDR_RPC_DEFAULT;
     settings.bind_http = getenv("LAMINAR_BIND_HTTP") ?: INTADDR_HTTP_DEFAULT;
     settings.archive_url = getenv("LAMINAR_ARCHIVE_URL") ?: ARCHIVE_URL_DEFAULT;
+    if(const char* threads = getenv("LAMINAR_HTTP_THREADS"))
+        settings.http_threads = atoi(threads);
+    if(const char* dicts = getenv("LAMINAR_LOG_DICTIONARIES"))
+        settings.log_dictionaries = atoi(dicts);
+    if(const char* interval = getenv("LAMINAR_LOG_CHECKPOINT_INTERVAL"))
+        settings.log_checkpoint_interval = atoi(interval);
 
     server = new Server(ioContext);
+    if(const char* uring = getenv("LAMINAR_IO_URING"); uring && !atoi(uring))
+        server->useIoUring(false);
     laminar = new Laminar(*server, settings);
 
     kj::UnixEventPort::captureChildExit();
@@ -108,6 +121,7 @@ int main(int argc, char** argv) {
 
     delete laminar;
     delete server;
+    zygoteStop();
 
     LLOG(INFO, "Clean exit");
     return 0;
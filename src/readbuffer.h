@@ -0,0 +1,77 @@
+///
+/// Copyright 2026 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#pragma once
+
+#include <kj/array.h>
+#include <fcntl.h>
+
+// Bounds of the buffer used to read from file descriptors. The lower bound
+// must hold at least one inotify event, see Server::watchPaths
+#define PROC_IO_BUFSIZE_MIN 4096
+#define PROC_IO_BUFSIZE_MAX (1024*1024)
+
+// A buffer for reading the output of a process, which grows while reads
+// keep filling it and shrinks again when the output slows down. If the
+// descriptor is a pipe, its capacity is grown along with the buffer, so
+// that a fast writer does not stall on the default 64 KiB between two
+// wakeups of the reader.
+class ReadBuffer {
+public:
+    explicit ReadBuffer(int fd) :
+        fd(fd),
+        buffer(kj::heapArray<char>(PROC_IO_BUFSIZE_MIN))
+    {
+#if defined(F_GETPIPE_SZ)
+        pipeSize = fcntl(fd, F_GETPIPE_SZ);
+#endif
+    }
+
+    char* begin() { return buffer.begin(); }
+    size_t size() const { return buffer.size(); }
+
+    // Adapts the buffer to the result of the last read into it. Invalidates
+    // the pointer returned by begin()
+    void update(size_t bytesRead) {
+        size_t sz = buffer.size();
+        if(bytesRead == sz && sz < PROC_IO_BUFSIZE_MAX) {
+            buffer = kj::heapArray<char>(sz * 2);
+            growPipe(sz * 4);
+        } else if(bytesRead < sz / 4 && sz > PROC_IO_BUFSIZE_MIN) {
+            buffer = kj::heapArray<char>(sz / 2);
+        }
+    }
+
+private:
+    void growPipe(size_t size) {
+#if defined(F_SETPIPE_SZ)
+        // Unprivileged processes are limited by /proc/sys/fs/pipe-max-size,
+        // in which case the pipe just stays as it is
+        if(pipeSize > 0 && size_t(pipeSize) < size) {
+            int newSize = fcntl(fd, F_SETPIPE_SZ, size);
+            if(newSize > 0)
+                pipeSize = newSize;
+        }
+#endif
+    }
+
+    int fd;
+    kj::Array<char> buffer;
+    // capacity of the pipe, or -1 if fd is not a pipe
+    int pipeSize = -1;
+};
@@ -18,14 +18,23 @@
 ///
 #include "resources.h"
 #include "log.h"
-#include "index_html_size.h"
+#include "resource_hashes.h"
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <zlib.h>
 
 #define INIT_RESOURCE(route, name, content_type) \
     extern const char _binary_##name##_z_start[];\
     extern const char _binary_##name##_z_end[]; \
-    resources.emplace(route, Resource{_binary_ ## name ## _z_start, _binary_ ## name ## _z_end, content_type})
+    resources.emplace(route, Resource{_binary_ ## name ## _z_start, _binary_ ## name ## _z_end, content_type, RESOURCE_HASH_ ## name})
+
+// Adds a variant of a resource in another content coding, see
+// generate_precompressed_bins in CMakeLists.txt
+#define INIT_ENCODED_RESOURCE(route, name, coding, suffix) \
+    extern const char _binary_##name##_##suffix##_start[];\
+    extern const char _binary_##name##_##suffix##_end[]; \
+    resources.at(route).coding = Encoded{_binary_ ## name ## _ ## suffix ## _start, _binary_ ## name ## _ ## suffix ## _end}
 
 #define CONTENT_TYPE_HTML     "text/html; charset=utf-8"
 #define CONTENT_TYPE_ICO      "image/x-icon"
@@ -36,6 +45,20 @@
 
 #define GZIP_FORMAT 16
 
+// Resources referenced from index.html, whose URLs there are versioned
+// with their content hash
+static const std::pair<const char*, const char*> versionedResources[] = {
+    {"favicon.ico", RESOURCE_HASH_favicon_ico},
+    {"favicon-152.png", RESOURCE_HASH_favicon_152_png},
+    {"icon.png", RESOURCE_HASH_icon_png},
+    {"manifest.webmanifest", RESOURCE_HASH_manifest_webmanifest},
+    {"js/vue.min.js", RESOURCE_HASH_js_vue_min_js},
+    {"js/ansi_up.js", RESOURCE_HASH_js_ansi_up_js},
+    {"js/Chart.min.js", RESOURCE_HASH_js_Chart_min_js},
+    {"js/app.js", RESOURCE_HASH_js_app_js},
+    {"style.css", RESOURCE_HASH_style_css},
+};
+
 Resources::Resources()
 {
     INIT_RESOURCE("/favicon.ico", favicon_ico, CONTENT_TYPE_ICO);
@@ -48,90 +71,145 @@ Resources::Resources()
     INIT_RESOURCE("/js/Chart.min.js", js_Chart_min_js, CONTENT_TYPE_JS);
     INIT_RESOURCE("/style.css", style_css, CONTENT_TYPE_CSS);
     INIT_RESOURCE("/manifest.webmanifest", manifest_webmanifest, CONTENT_TYPE_MANIFEST);
+#if defined(LAMINAR_RESOURCES_BROTLI)
+    INIT_ENCODED_RESOURCE("/js/app.js", js_app_js, br, br);
+    INIT_ENCODED_RESOURCE("/js/vue.min.js", js_vue_min_js, br, br);
+    INIT_ENCODED_RESOURCE("/js/Chart.min.js", js_Chart_min_js, br, br);
+    INIT_ENCODED_RESOURCE("/style.css", style_css, br, br);
+#endif
+#if defined(LAMINAR_RESOURCES_ZSTD)
+    INIT_ENCODED_RESOURCE("/js/app.js", js_app_js, zstd, zst);
+    INIT_ENCODED_RESOURCE("/js/vue.min.js", js_vue_min_js, zstd, zst);
+    INIT_ENCODED_RESOURCE("/js/Chart.min.js", js_Chart_min_js, zstd, zst);
+    INIT_ENCODED_RESOURCE("/style.css", style_css, zstd, zst);
+#endif
     // Configure the default template
-    setHtmlTemplate(std::string());
+    setIndex(renderIndex());
 }
 
-void Resources::setHtmlTemplate(std::string tmpl) {
-    extern const char _binary_index_html_z_start[];
-    extern const char _binary_index_html_z_end[];
+// Decompresses a gzip resource of unknown uncompressed size
+static std::string gunzip(const char* start, const char* end) {
+    std::string out;
+    z_stream strm;
+    memset(&strm, 0, sizeof(z_stream));
+    inflateInit2(&strm, MAX_WBITS|GZIP_FORMAT);
+    strm.next_in = (unsigned char*) start;
+    strm.avail_in = end - start;
+    int res = Z_OK;
+    while(res == Z_OK) {
+        out.resize(out.size() + 4 * (end - start));
+        strm.next_out = (unsigned char*) out.data() + strm.total_out;
+        strm.avail_out = out.size() - strm.total_out;
+        res = inflate(&strm, Z_NO_FLUSH);
+    }
+    if(res != Z_STREAM_END)
+        LLOG(ERROR, "Failed to uncompress resource", res);
+    out.resize(strm.total_out);
+    inflateEnd(&strm);
+    return out;
+}
 
+static std::string gzip(const std::string& data) {
     z_stream strm;
     memset(&strm, 0, sizeof(z_stream));
+    deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS|GZIP_FORMAT, 8, Z_DEFAULT_STRATEGY);
+    std::string out(deflateBound(&strm, data.size()), '\0');
+    strm.next_in = (unsigned char*) data.data();
+    strm.avail_in = data.size();
+    strm.next_out = (unsigned char*) out.data();
+    strm.avail_out = out.size();
+    if(deflate(&strm, Z_FINISH) != Z_STREAM_END) {
+        LLOG(FATAL, "Failed to compress index.html");
+    }
+    out.resize(strm.total_out);
+    deflateEnd(&strm);
+    return out;
+}
 
-    if(!tmpl.empty()) {
-        // deflate
-        index_html.resize(tmpl.size());
-        deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS|GZIP_FORMAT, 8, Z_DEFAULT_STRATEGY);
-        strm.next_in = (unsigned char*) tmpl.data();
-        strm.avail_in = tmpl.size();
-        strm.next_out = (unsigned char*) index_html.data();
-        strm.avail_out = tmpl.size();
-        if(deflate(&strm, Z_FINISH) != Z_STREAM_END) {
-            LLOG(FATAL, "Failed to compress index.html");
-        }
-        index_html.resize(strm.total_out);
-    } else {
+std::string Resources::renderIndex(std::string tmpl) {
+    extern const char _binary_index_html_z_start[];
+    extern const char _binary_index_html_z_end[];
+
+    if(tmpl.empty()) {
         // use the default template from compile-time asset
+        tmpl = gunzip(_binary_index_html_z_start, _binary_index_html_z_end);
         if(const char* baseUrl = getenv("LAMINAR_BASE_URL")) {
             // The administrator needs to customize the <base href>. Unfortunately this seems
             // to be the only thing that needs to be customizable but cannot be done via dynamic
-            // DOM manipulation without heavy compromises. So replace the static char array with
-            // a modified buffer accordingly.
-            std::string tmp;
-            tmp.resize(INDEX_HTML_UNCOMPRESSED_SIZE);
-            // inflate
-            inflateInit2(&strm, MAX_WBITS|GZIP_FORMAT);
-            strm.next_in = (unsigned char*) _binary_index_html_z_start;
-            strm.avail_in = _binary_index_html_z_end - _binary_index_html_z_start;
-            strm.next_out = (unsigned char*) tmp.data();
-            strm.avail_out = INDEX_HTML_UNCOMPRESSED_SIZE;
-            if(inflate(&strm, Z_FINISH) != Z_STREAM_END) {
-                LLOG(FATAL, "Failed to uncompress index_html");
-            }
-            // replace
+            // DOM manipulation without heavy compromises. So modify the template accordingly.
             // There's no validation on the replacement string, so you can completely mangle
             // the html if you like. This isn't really an issue because if you can modify laminar's
             // environment you already have elevated permissions
-            if(auto it = tmp.find("base href=\"/"))
-                tmp.replace(it+11, 1, baseUrl);
-            // deflate
-            index_html.resize(tmp.size());
-            deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS|GZIP_FORMAT, 8, Z_DEFAULT_STRATEGY);
-            strm.next_in = (unsigned char*) tmp.data();
-            strm.avail_in = tmp.size();
-            strm.next_out = (unsigned char*) index_html.data();
-            strm.avail_out = tmp.size();
-            if(deflate(&strm, Z_FINISH) != Z_STREAM_END) {
-                LLOG(FATAL, "Failed to compress index.html");
-            }
-            index_html.resize(strm.total_out);
-        } else {
-            index_html = std::string(_binary_index_html_z_start, _binary_index_html_z_end);
+            if(auto it = tmpl.find("base href=\"/"))
+                tmpl.replace(it+11, 1, baseUrl);
         }
     }
+
+    // Append ?v=HASH to quoted references such as src="js/app.js" or
+    // href="/manifest.webmanifest"
+    for(const auto& [path, hash] : versionedResources) {
+        std::string version = std::string("?v=") + hash;
+        for(const char* prefix : {"\"", "\"/"}) {
+            std::string needle = prefix + std::string(path) + "\"";
+            for(size_t pos = tmpl.find(needle); pos != std::string::npos; pos = tmpl.find(needle, pos + needle.size() + version.size()))
+                tmpl.insert(pos + needle.size() - 1, version);
+        }
+    }
+
+    return gzip(tmpl);
+}
+
+void Resources::setIndex(std::string index) {
+    index_html = std::move(index);
+    inflated.erase("/");
+    // FNV-1a, the index is not known at build time
+    uint64_t h = 14695981039346656037ull;
+    for(char c : index_html)
+        h = (h ^ uint8_t(c)) * 1099511628211ull;
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) h);
+    index_hash = hex;
     // update resource map
-    resources["/"] = Resource{index_html.data(), index_html.data() + index_html.size(), CONTENT_TYPE_HTML};
+    resources["/"] = Resource{index_html.data(), index_html.data() + index_html.size(), CONTENT_TYPE_HTML, index_hash.c_str()};
 }
 
 inline bool beginsWith(std::string haystack, const char* needle) {
     return strncmp(haystack.c_str(), needle, strlen(needle)) == 0;
 }
 
-bool Resources::handleRequest(std::string path, const char** start, const char** end, const char** content_type) {
+bool Resources::handleRequest(std::string path, const std::set<std::string>& acceptedEncodings, Content& content) {
     // need to keep the list of "application links" synchronised with the angular
     // application. We cannot return a 404 for any of these
-    auto it = beginsWith(path,"/jobs") || path == "/wallboard"
-            ? resources.find("/")
-            : resources.find(path);
-
-    if(it != resources.end()) {
-        *start = it->second.start;
-        *end = it->second.end;
-        *content_type = it->second.content_type;
-        return true;
-    }
+    if(beginsWith(path,"/jobs") || path == "/wallboard")
+        path = "/";
+    auto it = resources.find(path);
 
-    return false;
-}
+    if(it == resources.end())
+        return false;
 
+    // in order of preference, the smallest first
+    const Resource& r = it->second;
+    content.content_type = r.content_type;
+    content.hash = r.hash;
+    if(r.br.start && acceptedEncodings.count("br")) {
+        content.start = r.br.start;
+        content.end = r.br.end;
+        content.content_encoding = "br";
+    } else if(r.zstd.start && acceptedEncodings.count("zstd")) {
+        content.start = r.zstd.start;
+        content.end = r.zstd.end;
+        content.content_encoding = "zstd";
+    } else if(acceptedEncodings.count("gzip") || acceptedEncodings.count("*")) {
+        content.start = r.start;
+        content.end = r.end;
+        content.content_encoding = "gzip";
+    } else {
+        auto inf = inflated.find(path);
+        if(inf == inflated.end())
+            inf = inflated.emplace(path, gunzip(r.start, r.end)).first;
+        content.start = inf->second.data();
+        content.end = inf->second.data() + inf->second.size();
+        content.content_encoding = nullptr;
+    }
+    return true;
+}
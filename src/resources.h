@@ -18,6 +18,7 @@
 ///
 #pragma once
 
+#include <set>
 #include <unordered_map>
 #include <utility>
 #include <string>
@@ -28,21 +29,50 @@ class Resources {
 public:
     Resources();
 
-    // If a resource is known for the given path, set start and end to the
-    // binary data to send to the client, and content_type to its MIME
-    // type. Function returns false if no resource for the given path exists
-    bool handleRequest(std::string path, const char** start, const char** end, const char** content_type);
+    // A resource as it is to be sent to a client
+    struct Content {
+        const char* start;
+        const char* end;
+        const char* content_type;
+        // HTTP content coding of the data, nullptr if uncompressed
+        const char* content_encoding;
+        // identifies the resource's content regardless of its coding
+        const char* hash;
+    };
 
-    // Allows providing a custom HTML template. Pass an empty string to use the default.
-    void setHtmlTemplate(std::string templ = std::string());
+    // If a resource is known for the given path, fill content with it in
+    // the best of the given content codings accepted by the client. Function
+    // returns false if no resource for the given path exists
+    bool handleRequest(std::string path, const std::set<std::string>& acceptedEncodings, Content& content);
+
+    // Renders the index page from a custom HTML template, or from the default
+    // one if templ is empty, gzip-compressed and ready to be served. URLs of
+    // the other resources are versioned with their hash so that they can be
+    // cached indefinitely. Touches no instance, so it may be called from any thread.
+    static std::string renderIndex(std::string templ = std::string());
+
+    // Serves the given output of renderIndex as the index page
+    void setIndex(std::string index);
 
 private:
+    struct Encoded {
+        const char* start = nullptr;
+        const char* end = nullptr;
+    };
     struct Resource {
+        // gzip, which every resource has
         const char* start;
         const char* end;
         const char* content_type;
+        const char* hash;
+        // precompressed at build time, if the tools were available
+        Encoded br;
+        Encoded zstd;
     };
     std::unordered_map<std::string, Resource> resources;
     std::string index_html;
+    std::string index_hash;
+    // resources decompressed for clients which accept no compression,
+    // populated on demand
+    std::unordered_map<std::string, std::string> inflated;
 };
-
@@ -105,6 +105,16 @@ Vue.mixin({
         return Math.floor((end-start)/60) + ' minutes, ' + ((end-start)%60) + ' seconds';
       else
         return (end-start) + ' seconds';
+    },
+    // Pretty-print a size in bytes
+    formatBytes: bytes => {
+      const units = ['bytes', 'KiB', 'MiB', 'GiB', 'TiB'];
+      let i = 0;
+      while(bytes >= 1024 && i < units.length - 1) {
+        bytes /= 1024;
+        i++;
+      }
+      return (i ? bytes.toFixed(1) : bytes) + ' ' + units[i];
     }
   }
 });
@@ -394,6 +404,62 @@ const Charts = (() => {
         c.update();
       };
       return c;
+    },
+    createUsageChart: (id, usage) => {
+      const c = new Chart(document.getElementById(id), {
+        type: 'line',
+        data: {
+          labels: usage.map(e => '#' + e.number),
+          datasets: [{
+            label: 'CPU time',
+            yAxisID: 'cpu',
+            borderColor: '#7483af',
+            backgroundColor: 'transparent',
+            tension: 0.35,
+            data: usage.map(e => e.cpuTime / 1000)
+          },{
+            label: 'Peak memory',
+            yAxisID: 'mem',
+            borderColor: '#74af77',
+            backgroundColor: 'transparent',
+            tension: 0.35,
+            data: usage.map(e => e.peakMemory / 1048576)
+          }]
+        },
+        options: {
+          plugins: {
+            legend: { display: true, position: 'bottom' },
+            title: { display: true, text: 'Resource usage' },
+            tooltip: {
+              callbacks:{
+                label: (tip) => tip.dataset.label + ': ' + tip.raw.toFixed(1) + (tip.dataset.yAxisID == 'cpu' ? ' s' : ' MiB')
+              }
+            }
+          },
+          scales:{
+            cpu: {
+              position: 'left',
+              title: {display: true, text: 'CPU seconds'}
+            },
+            mem: {
+              position: 'right',
+              grid: {drawOnChartArea: false},
+              title: {display: true, text: 'MiB'}
+            }
+          },
+        }
+      });
+      c.jobCompleted = (num, cpuTime, peakMemory) => {
+        if(c.data.labels.length == 20) {
+          c.data.labels.shift();
+          c.data.datasets.forEach(d => d.data.shift());
+        }
+        c.data.labels.push('#' + num);
+        c.data.datasets[0].data.push(cpuTime / 1000);
+        c.data.datasets[1].data.push(peakMemory / 1048576);
+        c.update();
+      };
+      return c;
     }
   };
 })();
@@ -592,6 +658,7 @@ const Job = templateId => {
     sort: {}
   };
   let chtBuildTime = null;
+  let chtUsage = null;
   return {
     template: templateId,
     props: ['route'],
@@ -611,10 +678,13 @@ const Job = templateId => {
         // old chart and recreate it to prevent flickering of old data
         if(chtBuildTime)
           chtBuildTime.destroy();
+        if(chtUsage)
+          chtUsage.destroy();
 
         // defer chart to nextTick because they get DOM elements which aren't rendered yet
         this.$nextTick(() => {
           chtBuildTime = Charts.createRunTimeChart("chartBt", msg.recent, msg.averageRuntime);
+          chtUsage = Charts.createUsageChart("chartUsage", msg.usage);
         });
       },
       job_queued: function(data) {
@@ -634,6 +704,7 @@ const Job = templateId => {
             this.$forceUpdate();
         }
         chtBuildTime.jobCompleted(data.number, data.result, data.completed - data.started);
+        chtUsage.jobCompleted(data.number, data.cpuTime, data.peakMemory);
       },
       page_next: function() {
         state.sort.page++;
@@ -659,6 +730,94 @@ const Job = templateId => {
   };
 };
 
+// A single WebSocket shared by the subscriptions to the events of the
+// current view and to the output of running jobs, each on a channel of
+// its own. If the WebSocket cannot be established, for example because a
+// reverse proxy does not forward it, available() becomes false and the
+// callers fall back to EventSource and fetch.
+const realtime = {
+  ws: null,
+  useWebSocket: 'WebSocket' in window,
+  wasOpen: false,
+  retryInterval: 500,
+  nextChannel: 1,
+  channels: {},
+  // set by the router
+  onconnected: connected => {},
+  onfallback: () => {},
+
+  available() {
+    return this.useWebSocket;
+  },
+  // handlers may have event(data), log(bytes), eot() and error(message)
+  subscribe(command, handlers) {
+    const channel = this.nextChannel++;
+    this.channels[channel] = { command: Object.assign({ channel }, command), handlers };
+    if(this.ws && this.ws.readyState === WebSocket.OPEN)
+      this.ws.send(JSON.stringify(this.channels[channel].command));
+    else if(!this.ws)
+      this.connect();
+    return channel;
+  },
+  close(channel) {
+    delete this.channels[channel];
+    if(this.ws && this.ws.readyState === WebSocket.OPEN)
+      this.ws.send(JSON.stringify({ op: 'close', channel }));
+  },
+  connect() {
+    const url = new URL('ws', document.head.baseURI);
+    url.protocol = url.protocol === 'https:' ? 'wss:' : 'ws:';
+    this.ws = new WebSocket(url);
+    this.ws.binaryType = 'arraybuffer';
+    this.ws.onopen = () => {
+      this.wasOpen = true;
+      this.retryInterval = 500;
+      this.onconnected(true);
+      // (re)subscribe, resuming where the last connection left off
+      Object.values(this.channels).forEach(c => this.ws.send(JSON.stringify(c.command)));
+    };
+    this.ws.onmessage = msg => {
+      if(msg.data instanceof ArrayBuffer) {
+        // log output, prefixed by the channel
+        const c = this.channels[new DataView(msg.data).getUint32(0)];
+        if(c) {
+          c.command.offset = (c.command.offset || 0) + msg.data.byteLength - 4;
+          c.handlers.log(new Uint8Array(msg.data, 4));
+        }
+        return;
+      }
+      msg = JSON.parse(msg.data);
+      const c = this.channels[msg.channel];
+      if(!c)
+        return;
+      if(msg.data) {
+        c.command.lastEventId = msg.id;
+        c.handlers.event(msg.data);
+      } else if(msg.eot) {
+        delete this.channels[msg.channel];
+        c.handlers.eot();
+      } else if(msg.error && c.handlers.error) {
+        c.handlers.error(msg.error);
+      }
+    };
+    this.ws.onclose = () => {
+      this.ws = null;
+      this.onconnected(false);
+      if(!this.wasOpen) {
+        this.useWebSocket = false;
+        this.channels = {};
+        return this.onfallback();
+      }
+      setTimeout(() => {
+        if(!this.ws)
+          this.connect();
+      }, this.retryInterval);
+      if(this.retryInterval < 7500)
+        this.retryInterval *= 1.5;
+    };
+  }
+};
+
 // Component for the /job/:name/:number endpoint
 const Run = templateId => {
   const utf8decoder = new TextDecoder('utf-8');
@@ -686,71 +845,87 @@ const Run = templateId => {
     stickToBottom = window.innerHeight + window.scrollY >=
       document.documentElement.scrollHeight - 1;
   });
-  const logFetcher = (vm, name, num) => {
+  const logFetcher = (vm, name, num, running) => {
+    const target = document.getElementsByTagName('code')[0];
+    let logToRender = '';
+    let logComplete = false;
+    let tid = null;
+    let lastUiUpdate = 0;
+
+    function updateUI() {
+      // output may contain private ANSI CSI escape sequence to point to
+      // downstream jobs. ansi_up (correctly) discards unknown sequences,
+      // so they must be matched before passing through ansi_up. ansi_up
+      // also (correctly) escapes HTML, so they need to be converted back
+      // to links after going through ansi_up.
+      // A better solution one day would be if ansi_up were to provide
+      // a callback interface for handling unknown sequences.
+      // Also, update the DOM directly rather than using a binding through
+      // Vue, the performance is noticeably better with large logs.
+      target.insertAdjacentHTML('beforeend', ansi_up.ansi_to_html(
+        logToRender.replace(/\033\[\{([^:]+):(\d+)\033\\/g, (m, $1, $2) =>
+          '~~~~LAMINAR_RUN~'+$1+':'+$2+'~'
+        )
+      ).replace(/~~~~LAMINAR_RUN~([^:]+):(\d+)~/g, (m, $1, $2) =>
+        '<a href="jobs/'+$1+'" onclick="return LaminarApp.navigate(this.href);">'+$1+'</a>:'+
+        '<a href="jobs/'+$1+'/'+$2+'" onclick="return LaminarApp.navigate(this.href);">#'+$2+'</a>'
+      ));
+      logToRender = '';
+      if (logComplete) {
+        // output finished
+        state.logComplete = true;
+      }
+
+      if (stickToBottom)
+        window.scrollTo(0, document.documentElement.scrollHeight);
+
+      lastUiUpdate = Date.now();
+      tid = null;
+    }
+
+    function append(value) {
+      // sometimes logs can be very large, and we are receiving data
+      // furiously. To prevent straining the client renderer, buffer
+      // the data and delay the UI updates.
+      logToRender += utf8decoder.decode(value);
+      if(tid === null)
+        tid = setTimeout(updateUI, Math.max(500 - (Date.now() - lastUiUpdate), 0));
+    }
+
+    function complete() {
+      // do not set state.logComplete directly, because rendering
+      // may take some time, and we don't want the progress indicator
+      // to disappear before rendering is complete. Instead, delay
+      // it until after the entire log has been rendered
+      logComplete = true;
+      // if no render update is pending, schedule one immediately
+      // (do not use the delayed buffering mechanism from below), so
+      // that for the common case of short logs, the loading spinner
+      // disappears immediately as the log is rendered
+      if(tid === null)
+        setTimeout(updateUI, 0);
+    }
+
+    // The output of a running job is streamed over the shared connection.
+    // A completed log is fetched, which can be cached and compressed
+    if(running && realtime.available()) {
+      const channel = realtime.subscribe({ op: 'log', job: name, run: num }, {
+        log: append,
+        eot: complete
+      });
+      return { abort: () => realtime.close(channel) };
+    }
+
     const abort = new AbortController();
     fetch('log/'+name+'/'+num, {signal:abort.signal}).then(res => {
       // ATOW pipeThrough not supported in Firefox
       //const reader = res.body.pipeThrough(new TextDecoderStream).getReader();
       const reader = res.body.getReader();
-      const target = document.getElementsByTagName('code')[0];
-      let logToRender = '';
-      let logComplete = false;
-      let tid = null;
-      let lastUiUpdate = 0;
-
-      function updateUI() {
-        // output may contain private ANSI CSI escape sequence to point to
-        // downstream jobs. ansi_up (correctly) discards unknown sequences,
-        // so they must be matched before passing through ansi_up. ansi_up
-        // also (correctly) escapes HTML, so they need to be converted back
-        // to links after going through ansi_up.
-        // A better solution one day would be if ansi_up were to provide
-        // a callback interface for handling unknown sequences.
-        // Also, update the DOM directly rather than using a binding through
-        // Vue, the performance is noticeably better with large logs.
-        target.insertAdjacentHTML('beforeend', ansi_up.ansi_to_html(
-          logToRender.replace(/\033\[\{([^:]+):(\d+)\033\\/g, (m, $1, $2) =>
-            '~~~~LAMINAR_RUN~'+$1+':'+$2+'~'
-          )
-        ).replace(/~~~~LAMINAR_RUN~([^:]+):(\d+)~/g, (m, $1, $2) =>
-          '<a href="jobs/'+$1+'" onclick="return LaminarApp.navigate(this.href);">'+$1+'</a>:'+
-          '<a href="jobs/'+$1+'/'+$2+'" onclick="return LaminarApp.navigate(this.href);">#'+$2+'</a>'
-        ));
-        logToRender = '';
-        if (logComplete) {
-          // output finished
-          state.logComplete = true;
-        }
-
-        if (stickToBottom)
-          window.scrollTo(0, document.documentElement.scrollHeight);
-
-        lastUiUpdate = Date.now();
-        tid = null;
-      }
-
       return function pump() {
         return reader.read().then(({done, value}) => {
-          if (done) {
-            // do not set state.logComplete directly, because rendering
-            // may take some time, and we don't want the progress indicator
-            // to disappear before rendering is complete. Instead, delay
-            // it until after the entire log has been rendered
-            logComplete = true;
-            // if no render update is pending, schedule one immediately
-            // (do not use the delayed buffering mechanism from below), so
-            // that for the common case of short logs, the loading spinner
-            // disappears immediately as the log is rendered
-            if(tid === null)
-              setTimeout(updateUI, 0);
-            return;
-          }
-          // sometimes logs can be very large, and we are calling pump()
-          // furiously to get all the data to the client. To prevent straining
-          // the client renderer, buffer the data and delay the UI updates.
-          logToRender += utf8decoder.decode(value);
-          if(tid === null)
-            tid = setTimeout(updateUI, Math.max(500 - (Date.now() - lastUiUpdate), 0));
+          if (done)
+            return complete();
+          append(value);
           return pump();
         });
       }();
@@ -779,7 +954,7 @@ const Run = templateId => {
         if(this.logstream)
           this.logstream.abort();
         if(data.started)
-          this.logstream = logFetcher(this, params.name, params.number);
+          this.logstream = logFetcher(this, params.name, state.number, !data.completed);
       },
       job_queued: function(data) {
         state.latestNum = data.number;
@@ -843,49 +1018,86 @@ Vue.component('RouterView', (() => {
   }
 
   let eventSource = null;
+  let eventChannel = null;
+
+  // source holds the component of the view once it has been instantiated
+  const handleEvent = (view, path, source, msg) => {
+    if(msg.type === 'status') {
+      // Event source is connected. Update static data
+      document.title = view.$root.title = msg.title;
+      view.$root.version = msg.version;
+      // Calculate clock offset (used by ProgressUpdater)
+      view.$root.clockSkew = msg.time - Math.floor((new Date()).getTime()/1000);
+      view.$root.connected = true;
+      [view.currentView, route.params] = resolveRoute(path);
+      // the component won't be instantiated until nextTick
+      view.$nextTick(() => {
+        // component is ready, update it with the data from the eventsource
+        source.comp = view.$children[0];
+        // and finally run the component handler
+        source.comp[msg.type](msg.data);
+      });
+    } else if(msg.type === 'jobs_queued') {
+      // several runs queued at once, each as if it were queued on its own
+      msg.data.forEach(data => handleEvent(view, path, source, { type: 'job_queued', data }));
+    } else {
+      // at this point, the component must be defined
+      if (!source.comp)
+        return console.error("Page component was undefined");
+      view.$root.connected = true;
+      view.$root.showNotify(msg.type, msg.data);
+      if(typeof source.comp[msg.type] === 'function')
+        source.comp[msg.type](msg.data);
+    }
+  };
 
-  const setupEventSource = (view, query) => {
+  const setupEventSource = (view, query, resume) => {
     // drop any existing event source
     if(eventSource)
       eventSource.close();
+    if(eventChannel !== null)
+      realtime.close(eventChannel);
+    eventSource = eventChannel = null;
 
     const path = (location.origin+location.pathname).substr(document.head.baseURI.length);
-    const search = query ? '?' + Object.entries(query).map(([k,v])=>`${k}=${v}`).join('&') : '';
+    if(realtime.available()) {
+      // resuming after a lost connection is handled by realtime
+      const source = {};
+      eventChannel = realtime.subscribe({
+        op: 'watch',
+        path: '/' + path,
+        query: Object.entries(query || {}).map(([k,v])=>`${k}=${v}`).join('&')
+      }, {
+        event: msg => handleEvent(view, path, source, msg)
+      });
+      return;
+    }
+
+    const params = Object.entries(query || {}).map(([k,v])=>`${k}=${v}`);
+    // when reconnecting, the server only sends the events we missed,
+    // unless it no longer has all of them and sends the status again
+    if(resume && resume.lastEventId)
+      params.push(`lastEventId=${resume.lastEventId}`);
+    const search = params.length ? '?' + params.join('&') : '';
 
     eventSource = new EventSource(document.head.baseURI + path + search);
     eventSource.reconnectInterval = 500;
-    eventSource.onmessage = msg => {
-      msg = JSON.parse(msg.data);
-      if(msg.type === 'status') {
-        // Event source is connected. Update static data
-        document.title = view.$root.title = msg.title;
-        view.$root.version = msg.version;
-        // Calculate clock offset (used by ProgressUpdater)
-        view.$root.clockSkew = msg.time - Math.floor((new Date()).getTime()/1000);
-        view.$root.connected = true;
-        [view.currentView, route.params] = resolveRoute(path);
-        // the component won't be instantiated until nextTick
-        view.$nextTick(() => {
-          // component is ready, update it with the data from the eventsource
-          eventSource.comp = view.$children[0];
-          // and finally run the component handler
-          eventSource.comp[msg.type](msg.data);
-        });
-      } else {
-        // at this point, the component must be defined
-        if (!eventSource.comp)
-          return console.error("Page component was undefined");
+    if(resume) {
+      eventSource.comp = resume.comp;
+      eventSource.onopen = () => {
         view.$root.connected = true;
-        view.$root.showNotify(msg.type, msg.data);
-        if(typeof eventSource.comp[msg.type] === 'function')
-          eventSource.comp[msg.type](msg.data);
-      }
+      };
+    }
+    eventSource.onmessage = msg => {
+      eventSource.lastEventId = msg.lastEventId;
+      handleEvent(view, path, eventSource, JSON.parse(msg.data));
     }
     eventSource.onerror = err => {
       let ri = eventSource.reconnectInterval;
+      const resume = eventSource.comp ? { comp: eventSource.comp, lastEventId: eventSource.lastEventId } : null;
       view.$root.connected = false;
       setTimeout(() => {
-        setupEventSource(view);
+        setupEventSource(view, undefined, resume);
         if(ri < 7500)
           ri *= 1.5;
         eventSource.reconnectInterval = ri
@@ -904,6 +1116,13 @@ Vue.component('RouterView', (() => {
       route: route
     }),
     created: function() {
+      realtime.onconnected = connected => {
+        this.$root.connected = connected;
+      };
+      // subscribe again without the WebSocket
+      realtime.onfallback = () => {
+        this.$root.$emit('navigate');
+      };
       this.$root.$on('navigate', query => {
         setupEventSource(this, query);
       });
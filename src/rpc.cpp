@@ -19,8 +19,21 @@
 #include "rpc.h"
 #include "laminar.capnp.h"
 #include "laminar.h"
+#include "monitorscope.h"
 #include "log.h"
 
+#include <list>
+#include <set>
+#include <vector>
+
+// Largest chunk of log output sent in a single LogSink.write call
+#define RPC_LOG_CHUNK_SIZE 65536
+
+// How far a client of tail or watch may fall behind. Beyond this, new
+// output of the run is dropped, and a watch fails
+#define RPC_TAIL_BUFFER_MAX (4 << 20)
+#define RPC_WATCH_BUFFER_MAX 1024
+
 namespace {
 
 // Used for returning run state to RPC clients
@@ -34,6 +47,131 @@ LaminarCi::JobResult fromRunState(RunState state) {
     }
 }
 
+// A client of tail. Output of the run arriving before it can be written
+// to the sink is queued in pending, which also applies flow control. The
+// output so far comes first and is not limited, since it is in memory
+// anyway. Of what follows, at most RPC_TAIL_BUFFER_MAX bytes are kept.
+struct LogTail {
+    LogTail(std::set<LogTail*>& tails, std::string job, uint run, LaminarCi::LogSink::Client sink) :
+        job(job),
+        run(run),
+        sink(kj::mv(sink)),
+        tails(tails)
+    {
+        tails.insert(this);
+    }
+    ~LogTail() {
+        tails.erase(this);
+    }
+
+    // queues output arriving from the run, unless too much is pending
+    void append(std::string chunk) {
+        if(buffered + chunk.size() > RPC_TAIL_BUFFER_MAX) {
+            if(!dropping) {
+                static const std::string marker = "\n[laminar] Output skipped, the client is not keeping up\n";
+                pending.push_back(marker);
+                buffered += marker.size();
+                dropping = true;
+            }
+            return;
+        }
+        buffered += chunk.size();
+        pending.push_back(kj::mv(chunk));
+        dropping = false;
+    }
+
+    std::string job;
+    uint run;
+    LaminarCi::LogSink::Client sink;
+    std::list<std::string> pending;
+    // bytes at the front of pending which are the output so far
+    size_t snapshot = 0;
+    // bytes of pending which arrived later
+    size_t buffered = 0;
+    bool dropping = false;
+    bool complete = false;
+    kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+private:
+    std::set<LogTail*>& tails;
+};
+
+// A client of watch. If more than RPC_WATCH_BUFFER_MAX events are waiting
+// to be sent, the client would miss some, so the watch fails instead
+struct EventWatch {
+    EventWatch(std::set<EventWatch*>& watches, MonitorScope scope, LaminarCi::EventSink::Client sink) :
+        scope(scope),
+        sink(kj::mv(sink)),
+        watches(watches)
+    {
+        watches.insert(this);
+    }
+    ~EventWatch() {
+        watches.erase(this);
+    }
+
+    MonitorScope scope;
+    LaminarCi::EventSink::Client sink;
+    std::list<std::string> pending;
+    bool overflowed = false;
+    kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+private:
+    std::set<EventWatch*>& watches;
+};
+
+// Resolves once everything up to the end of the run has been written
+kj::Promise<void> writeTail(LogTail* tail) {
+    kj::Promise<void> ready = kj::READY_NOW;
+    if(tail->pending.empty() && !tail->complete) {
+        auto paf = kj::newPromiseAndFulfiller<void>();
+        tail->fulfiller = kj::mv(paf.fulfiller);
+        ready = kj::mv(paf.promise);
+    }
+    return ready.then([tail]{
+        if(tail->pending.empty())
+            return kj::Promise<void>(kj::READY_NOW);
+        // coalesce small chunks, split large ones (such as the output so far)
+        std::string chunk;
+        while(!tail->pending.empty() && chunk.size() < size_t(RPC_LOG_CHUNK_SIZE)) {
+            std::string& front = tail->pending.front();
+            size_t n = std::min<size_t>(front.size(), RPC_LOG_CHUNK_SIZE - chunk.size());
+            chunk.append(front, 0, n);
+            size_t fromSnapshot = std::min(n, tail->snapshot);
+            tail->snapshot -= fromSnapshot;
+            tail->buffered -= n - fromSnapshot;
+            if(n == front.size())
+                tail->pending.pop_front();
+            else
+                front.erase(0, n);
+        }
+        auto req = tail->sink.writeRequest();
+        req.setChunk(kj::arrayPtr(reinterpret_cast<const kj::byte*>(chunk.data()), chunk.size()));
+        // a streaming call resolves when the flow control allows another
+        return req.send().then([tail]{
+            return writeTail(tail);
+        });
+    });
+}
+
+// Never resolves, unless the client goes away or falls too far behind
+kj::Promise<void> writeEvents(EventWatch* watch) {
+    kj::Promise<void> ready = kj::READY_NOW;
+    if(watch->pending.empty() && !watch->overflowed) {
+        auto paf = kj::newPromiseAndFulfiller<void>();
+        watch->fulfiller = kj::mv(paf.fulfiller);
+        ready = kj::mv(paf.promise);
+    }
+    return ready.then([watch]() -> kj::Promise<void> {
+        if(watch->overflowed)
+            return KJ_EXCEPTION(OVERLOADED, "Too many events are waiting to be sent to the client");
+        auto req = watch->sink.eventRequest();
+        req.setJson(watch->pending.front());
+        watch->pending.pop_front();
+        return req.send().then([watch]{
+            return writeEvents(watch);
+        });
+    });
+}
+
 }
 // This is the implementation of the Laminar Cap'n Proto RPC interface.
 // As such, it implements the pure virtual interface generated from
@@ -57,19 +195,44 @@ public:
         if(Run* r = run.get()) {
             context.getResults().setResult(LaminarCi::MethodResult::SUCCESS);
             context.getResults().setBuildNum(r->build);
+            // don't hand out a build number which could be lost
+            return laminar.whenCommitted();
         } else {
             context.getResults().setResult(LaminarCi::MethodResult::FAILED);
         }
         return kj::READY_NOW;
     }
 
+    // Queue several jobs at once, without waiting for them to start
+    kj::Promise<void> queueBatch(QueueBatchContext context) override {
+        auto jobs = context.getParams().getJobs();
+        LLOG(INFO, "RPC queueBatch", jobs.size());
+        std::vector<Laminar::JobRequest> requests;
+        for(auto job : jobs)
+            requests.push_back({job.getJobName(), params(job.getParams())});
+        std::vector<std::shared_ptr<Run>> runs = laminar.queueJobs(kj::mv(requests), context.getParams().getFrontOfQueue());
+        auto res = context.getResults().initRuns(runs.size());
+        bool ok = true;
+        for(size_t i = 0; i < runs.size(); ++i) {
+            res[i].setJob(jobs[i].getJobName());
+            if(runs[i])
+                res[i].setBuildNum(runs[i]->build);
+            else
+                ok = false;
+        }
+        context.getResults().setResult(ok ? LaminarCi::MethodResult::SUCCESS : LaminarCi::MethodResult::FAILED);
+        return laminar.whenCommitted();
+    }
+
     // Start a job, without waiting for it to finish
     kj::Promise<void> start(StartContext context) override {
         std::string jobName = context.getParams().getJobName();
         LLOG(INFO, "RPC start", jobName);
         std::shared_ptr<Run> run = laminar.queueJob(jobName, params(context.getParams().getParams()), context.getParams().getFrontOfQueue());
         if(Run* r = run.get()) {
-            return r->whenStarted().then([context,r]() mutable {
+            return r->whenStarted().then([this]{
+                return laminar.whenCommitted();
+            }).then([context,r]() mutable {
                 context.getResults().setResult(LaminarCi::MethodResult::SUCCESS);
                 context.getResults().setBuildNum(r->build);
             });
@@ -143,7 +306,89 @@ public:
         return kj::READY_NOW;
     }
 
+    // Stream the output of a run to the client as it is produced
+    kj::Promise<void> tail(TailContext context) override {
+        std::string jobName = context.getParams().getRun().getJob();
+        uint buildNum = context.getParams().getRun().getBuildNum();
+        if(buildNum == 0)
+            buildNum = laminar.latestRun(jobName);
+        LLOG(INFO, "RPC tail", jobName, buildNum);
+        return tailRun(jobName, buildNum, context);
+    }
+
+    // Stream status events to the client until it cancels the call
+    kj::Promise<void> watch(WatchContext context) override {
+        std::string jobName = context.getParams().getJob();
+        LLOG(INFO, "RPC watch", jobName);
+        MonitorScope scope = jobName.empty() ? MonitorScope(MonitorScope::HOME) : MonitorScope(MonitorScope::JOB, jobName);
+        auto watch = kj::heap<EventWatch>(watches, scope, context.getParams().getSink());
+        watch->pending.push_back(laminar.getStatus(scope));
+        auto w = watch.get();
+        return writeEvents(w).attach(kj::mv(watch));
+    }
+
+    void notifyEvent(const char* data, std::string job) {
+        for(EventWatch* w : watches) {
+            if(w->scope.wantsStatus(job)) {
+                if(w->pending.size() >= RPC_WATCH_BUFFER_MAX) {
+                    w->pending.clear();
+                    w->overflowed = true;
+                } else if(!w->overflowed) {
+                    w->pending.push_back(data);
+                }
+                if(w->fulfiller)
+                    w->fulfiller->fulfill();
+            }
+        }
+    }
+
+    void notifyLog(std::string job, uint run, std::string chunk, bool eot) {
+        for(LogTail* t : tails) {
+            if(t->job == job && t->run == run) {
+                if(!chunk.empty())
+                    t->append(chunk);
+                t->complete = t->complete || eot;
+                if(t->fulfiller)
+                    t->fulfiller->fulfill();
+            }
+        }
+    }
+
 private:
+    kj::Promise<void> tailRun(std::string jobName, uint buildNum, TailContext context) {
+        for(const std::shared_ptr<Run>& run : laminar.listQueuedJobs()) {
+            if(run->name == jobName && run->build == buildNum) {
+                return run->whenStarted().then([this, jobName, buildNum, context]() mutable {
+                    return tailRun(jobName, buildNum, context);
+                });
+            }
+        }
+        std::shared_ptr<Run> active;
+        for(const std::shared_ptr<Run>& run : laminar.listRunningJobs()) {
+            if(run->name == jobName && run->build == buildNum)
+                active = run;
+        }
+        // Registered right away, so that no output is missed while the log
+        // so far is being fetched
+        auto tail = kj::heap<LogTail>(tails, jobName, buildNum, context.getParams().getSink());
+        return laminar.handleLogRequest(jobName, buildNum).then([context, active, tail = kj::mv(tail)](kj::Maybe<Laminar::RunLog> log) mutable -> kj::Promise<void> {
+            KJ_IF_MAYBE(l, log) {
+                tail->snapshot = l->output.size();
+                tail->pending.push_front(kj::mv(l->output));
+                tail->complete = tail->complete || l->complete;
+                auto t = tail.get();
+                kj::Promise<RunState> result = active ? active->whenFinished() : kj::Promise<RunState>(l->result);
+                return writeTail(t).attach(kj::mv(tail)).then([result = kj::mv(result)]() mutable {
+                    return kj::mv(result);
+                }).then([context](RunState state) mutable {
+                    context.getResults().setResult(fromRunState(state));
+                });
+            }
+            context.getResults().setResult(LaminarCi::JobResult::UNKNOWN);
+            return kj::READY_NOW;
+        });
+    }
+
     // Helper to convert an RPC parameter list to a hash map
     ParamMap params(const capnp::List<LaminarCi::JobParam>::Reader& paramReader) {
         ParamMap res;
@@ -155,11 +400,25 @@ private:
 
     Laminar& laminar;
     std::unordered_map<const Run*, std::list<kj::PromiseFulfillerPair<RunState>>> runWaiters;
+    std::set<LogTail*> tails;
+    std::set<EventWatch*> watches;
 };
 
 Rpc::Rpc(Laminar& li) :
-    rpcInterface(kj::heap<RpcImpl>(li))
-{}
+    rpcInterface(nullptr)
+{
+    auto server = kj::heap<RpcImpl>(li);
+    impl = server.get();
+    rpcInterface = kj::mv(server);
+}
+
+void Rpc::notifyEvent(const char* data, std::string job) {
+    impl->notifyEvent(data, job);
+}
+
+void Rpc::notifyLog(std::string job, uint run, std::string chunk, bool eot) {
+    impl->notifyLog(job, run, chunk, eot);
+}
 
 // Context for an RPC connection
 struct RpcConnection {
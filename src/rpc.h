@@ -21,14 +21,27 @@
 #include <capnp/ez-rpc.h>
 #include <capnp/rpc-twoparty.h>
 #include <capnp/rpc.capnp.h>
+#include <string>
 
 class Laminar;
+class RpcImpl;
+
+// Definition needed for musl
+typedef unsigned int uint;
 
 class Rpc {
 public:
     Rpc(Laminar&li);
     kj::Promise<void> accept(kj::Own<kj::AsyncIoStream>&& connection);
 
+    // Forward notifications to the clients of tail and watch
+    void notifyEvent(const char* data, std::string job);
+    void notifyLog(std::string job, uint run, std::string chunk, bool eot);
+
     capnp::Capability::Client rpcInterface;
+
+private:
+    // owned by rpcInterface
+    RpcImpl* impl;
 };
 
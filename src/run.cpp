@@ -20,11 +20,21 @@
 #include "context.h"
 #include "conf.h"
 #include "log.h"
+#include "server.h"
+#include "leader.h"
 
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <iostream>
+#include <map>
+#include <vector>
+#include <spawn.h>
+#include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
+
+extern char** environ;
 
 #if defined(__FreeBSD__)
 #include <sys/sysctl.h>
@@ -83,117 +93,231 @@ Run::~Run() {
     LLOG(INFO, "Run destroyed");
 }
 
-static void setEnvFromFile(const kj::Path& rootPath, kj::Path file) {
-    StringMap vars = parseConfFile((rootPath/file).toString(true).cStr());
-    for(auto& it : vars) {
-        setenv(it.first.c_str(), it.second.c_str(), true);
+// Parsing configuration files for every run adds up when many runs start
+// at once, so keep the parsed result until the file changes
+static StringMap& cachedConfFile(const std::string& path) {
+    struct Entry {
+        struct timespec mtime;
+        off_t size;
+        StringMap vars;
+    };
+    static std::unordered_map<std::string, Entry> cache;
+    static StringMap empty;
+
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0) {
+        cache.erase(path);
+        return empty;
+    }
+    auto it = cache.find(path);
+    if(it == cache.end() || it->second.size != st.st_size
+            || it->second.mtime.tv_sec != st.st_mtim.tv_sec
+            || it->second.mtime.tv_nsec != st.st_mtim.tv_nsec) {
+        it = cache.insert_or_assign(path, Entry{st.st_mtim, st.st_size, parseConfFile(path.c_str())}).first;
+    }
+    return it->second.vars;
+}
+
+// Spawns a leader process directly, when it cannot be forked from the
+// zygote. Returns 0 or an error number
+static int spawnLeader(std::string& procName, std::vector<char*>& envp, const int plog[2], const int pusage[2], pid_t* leader) {
+    std::string usageFdVar = "__LAMINAR_USAGE_FD=" + std::to_string(LEADER_USAGE_FD);
+    envp.insert(envp.end() - 1, usageFdVar.data());
+
+    // All output from the leader will be captured in the plog pipe. Both
+    // pipes are close-on-exec, so the leader gets only these duplicates,
+    // and none of the pipes of other runs being started at the same time
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, plog[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, plog[1], STDERR_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, pusage[1], LEADER_USAGE_FD);
+
+    // We could just fork/wait over all the steps here directly, but then we
+    // can't set a nice name for the process tree. There is pthread_setname_np,
+    // but it's limited to 16 characters, which most of the time probably isn't
+    // enough. Instead, we'll just exec ourselves and handle that in laminard's
+    // main() by calling leader_main(). posix_spawn avoids copying the page
+    // tables of laminard, which may be large, just to replace them immediately.
+    char* argv[] = { procName.data(), nullptr };
+#if defined(__FreeBSD__)
+    int  sysctl_rq[] = {CTL_KERN, KERN_PROC, KERN_PROC_PATHNAME, -1};
+    size_t self_exe_len = PATH_MAX;
+    char self_exe[PATH_MAX];
+    LSYSCALL(sysctl(sysctl_rq, 4, self_exe, &self_exe_len, NULL, 0));
+#else
+    const char* self_exe = "/proc/self/exe";
+#endif
+    int err = posix_spawn(leader, self_exe, &actions, nullptr, argv, envp.data());
+    posix_spawn_file_actions_destroy(&actions);
+    envp.erase(envp.end() - 2);
+    return err;
+}
+
+std::map<std::string, std::string> Run::environment(const std::string& context) const {
+    kj::Path cfgDir{"cfg"};
+    std::map<std::string, std::string> env;
+    for(char** e = environ; *e; ++e) {
+        if(const char* eq = strchr(*e, '='))
+            env.emplace(std::string(*e, eq), eq + 1);
+    }
+
+    // add environment files
+    for(const kj::Path& file : {cfgDir/"env", cfgDir/"contexts"/(context+".env"), cfgDir/"jobs"/(name+".env")}) {
+        for(auto& it : cachedConfFile((rootPath/file).toString(true).cStr()))
+            env[it.first] = it.second;
+    }
+
+    // parameterized vars
+    for(auto& pair : params) {
+        env.emplace(pair.first, pair.second);
+    }
+
+    std::string PATH = (rootPath/"cfg"/"scripts").toString(true).cStr();
+    if(auto p = env.find("PATH"); p != env.end()) {
+        PATH.append(":");
+        PATH.append(p->second);
     }
+
+    std::string runNumStr = std::to_string(build);
+
+    env["PATH"] = PATH;
+    env["RUN"] = runNumStr;
+    env["JOB"] = name;
+    env["CONTEXT"] = context;
+    env["WORKSPACE"] = (rootPath/"run"/name/"workspace").toString(true).cStr();
+    env["ARCHIVE"] = (rootPath/"archive"/name/runNumStr).toString(true).cStr();
+    return env;
 }
 
-kj::Promise<RunState> Run::start(RunState lastResult, std::shared_ptr<Context> ctx, const kj::Directory &fsHome, std::function<kj::Promise<int>(kj::Maybe<pid_t>&)> getPromise)
+kj::Promise<RunState> Run::start(RunState lastResult, std::shared_ptr<Context> ctx, const kj::Directory &fsHome, Server& srv)
 {
     kj::Path cfgDir{"cfg"};
 
     // add job timeout if specified
-    if(fsHome.exists(cfgDir/"jobs"/(name+".conf"))) {
-        timeout = parseConfFile((rootPath/cfgDir/"jobs"/(name+".conf")).toString(true).cStr()).get<int>("TIMEOUT", 0);
-    }
+    timeout = cachedConfFile((rootPath/cfgDir/"jobs"/(name+".conf")).toString(true).cStr()).get<int>("TIMEOUT", 0);
 
     int plog[2];
-    LSYSCALL(pipe(plog));
+    LSYSCALL(pipe2(plog, O_CLOEXEC));
+
+    // the leader reports the resources used by the run through this pipe
+    int pusage[2];
+    LSYSCALL(pipe2(pusage, O_CLOEXEC));
+
+    // Prepare the complete environment of the leader process up front, so
+    // that it can be spawned without first forking laminard. All initial/fixed
+    // env vars can be set here. Dynamic ones, including "RESULT" and any set
+    // by `laminarc set` have to be handled in the leader process.
+    std::map<std::string, std::string> env = environment(ctx->name);
+    std::string runNumStr = std::to_string(build);
+    env["LAST_RESULT"] = to_string(lastResult);
+    // RESULT set in leader process
+
+    // the leader process moves itself into this cgroup
+    if(!cgroup.empty())
+        env["__LAMINAR_CGROUP"] = cgroup;
 
-    // Fork a process leader to run all the steps of the job. This gives us a nice
+    // leader process changes to $LAMINAR_HOME, which it assumes as CWD
+    env["PWD"] = rootPath.toString(true).cStr();
+
+    std::vector<std::string> envStrings;
+    std::vector<char*> envp;
+    envStrings.reserve(env.size());
+    for(auto& it : env) {
+        envStrings.push_back(it.first + "=" + it.second);
+        envp.push_back(envStrings.back().data());
+    }
+    envp.push_back(nullptr);
+
+    // Create a process leader to run all the steps of the job. This gives us a nice
     // process tree output (job name and number as the process name) and helps
     // contain any wayward descendent processes.
-    pid_t leader;
-    LSYSCALL(leader = fork());
-
-    if(leader == 0) {
-        // All output from this process will be captured in the plog pipe
-        close(plog[0]);
-        dup2(plog[1], STDOUT_FILENO);
-        dup2(plog[1], STDERR_FILENO);
-        close(plog[1]);
+    std::string procName = "{laminar} " + name + ":" + runNumStr;
 
-        // All initial/fixed env vars can be set here. Dynamic ones, including
-        // "RESULT" and any set by `laminarc set` have to be handled in the subprocess.
+    // the leader waits for this before doing anything, see zygoteRequest
+    int pstart[2];
+    LSYSCALL(pipe2(pstart, O_CLOEXEC));
 
-        // add environment files
-        if(fsHome.exists(cfgDir/"env"))
-            setEnvFromFile(rootPath, cfgDir/"env");
-        if(fsHome.exists(cfgDir/"contexts"/(ctx->name+".env")))
-            setEnvFromFile(rootPath, cfgDir/"contexts"/(ctx->name+".env"));
-        if(fsHome.exists(cfgDir/"jobs"/(name+".env")))
-            setEnvFromFile(rootPath, cfgDir/"jobs"/(name+".env"));
+    // All good, we've "started". The leader follows shortly, its output
+    // can be read from now on
+    startedAt = time(nullptr);
+    context = ctx;
+    output_fd = plog[0];
+    spawning = true;
 
-        // parameterized vars
-        for(auto& pair : params) {
-            setenv(pair.first.c_str(), pair.second.c_str(), false);
+    // Forking from the zygote, if one is running, is cheapest
+    return srv.spawnFromZygote(procName.c_str(), envp.data(), plog[1], pusage[1], pstart[0]).then([](pid_t leader){
+        return leader;
+    }, [](kj::Exception&&){
+        // the zygote was lost before it replied
+        return pid_t(-1);
+    }).then([this, &srv, procName = kj::mv(procName), envStrings = kj::mv(envStrings), envp = kj::mv(envp),
+             plog = kj::heapArray<int>(plog, 2), pusage = kj::heapArray<int>(pusage, 2),
+             pstart = kj::heapArray<int>(pstart, 2)](pid_t leader) mutable -> kj::Promise<RunState> {
+        close(pstart[0]);
+        bool direct = leader < 0;
+        if(direct) {
+            // a leader from the zygote which was given up on exits now
+            close(pstart[1]);
+            int err = spawnLeader(procName, envp, plog.begin(), pusage.begin(), &leader);
+            if(err != 0) {
+                // e.g. out of memory or processes. This is no reason to bring
+                // down laminard, the run just fails with the reason in its log
+                LLOG(ERROR, "Failed to spawn leader process", strerror(err));
+                std::string msg = std::string("[laminar] Failed to start the run: ") + strerror(err) + "\n";
+                LSYSCALL(write(plog[1], msg.data(), msg.size()));
+                close(plog[1]);
+                close(pusage[0]);
+                close(pusage[1]);
+                spawning = false;
+                result = RunState::FAILED;
+                started.fulfiller->fulfill();
+                finished.fulfiller->fulfill(RunState(result));
+                return result;
+            }
         }
 
-        std::string PATH = (rootPath/"cfg"/"scripts").toString(true).cStr();
-        if(const char* p = getenv("PATH")) {
-            PATH.append(":");
-            PATH.append(p);
-        }
+        close(plog[1]);
+        close(pusage[1]);
+        // a leader which died abnormally writes nothing, don't block on it
+        fcntl(pusage[0], F_SETFL, O_NONBLOCK);
+        pid = leader;
+        spawning = false;
 
-        std::string runNumStr = std::to_string(build);
-
-        setenv("PATH", PATH.c_str(), true);
-        setenv("RUN", runNumStr.c_str(), true);
-        setenv("JOB", name.c_str(), true);
-        setenv("CONTEXT", ctx->name.c_str(), true);
-        setenv("LAST_RESULT", to_string(lastResult).c_str(), true);
-        setenv("WORKSPACE", (rootPath/"run"/name/"workspace").toString(true).cStr(), true);
-        setenv("ARCHIVE", (rootPath/"archive"/name/runNumStr).toString(true).cStr(), true);
-        // RESULT set in leader process
-
-        // leader process assumes $LAMINAR_HOME as CWD
-        LSYSCALL(chdir(rootPath.toString(true).cStr()));
-        setenv("PWD", rootPath.toString(true).cStr(), 1);
-
-        // We could just fork/wait over all the steps here directly, but then we
-        // can't set a nice name for the process tree. There is pthread_setname_np,
-        // but it's limited to 16 characters, which most of the time probably isn't
-        // enough. Instead, we'll just exec ourselves and handle that in laminard's
-        // main() by calling leader_main()
-        char* procName;
-        if(asprintf(&procName, "{laminar} %s:%d", name.data(), build) > 0)
-#if defined(__FreeBSD__)
-        {
-            int  sysctl_rq[] = {CTL_KERN, KERN_PROC, KERN_PROC_PATHNAME, -1};
-            size_t self_exe_len = PATH_MAX;
-            char self_exe[PATH_MAX];
+        // must be waited for before it can possibly exit
+        kj::Promise<int> exited = srv.onChildExit(pid);
+        if(!direct) {
+            // an abort while the leader was forked means it doesn't run at all
+            if(!abortRequested)
+                LSYSCALL(write(pstart[1], "", 1));
+            close(pstart[1]);
+        } else if(abortRequested) {
+            kill(leader, SIGTERM);
+        }
 
-            if (sysctl(sysctl_rq, 4, self_exe, &self_exe_len, NULL, 0))
-                _exit(EXIT_FAILURE);
+        // notifies the rpc client if the start command was used
+        started.fulfiller->fulfill();
 
-            execl(self_exe, procName, NULL); // does not return
-        }
-#else
-            execl("/proc/self/exe", procName, NULL); // does not return
-#endif
-        _exit(EXIT_FAILURE);
-    }
+        return exited.then([this,usageFd=pusage[0]](int status){
+            // The leader process passes a RunState through the return value.
+            // Check it didn't die abnormally, then cast to get it back.
+            result = WIFEXITED(status) && !abortRequested ? RunState(WEXITSTATUS(status)) : RunState::ABORTED;
+            RunUsage reported;
+            if(read(usageFd, &reported, sizeof(reported)) == sizeof(reported))
+                usage = reported;
+            close(usageFd);
+            finished.fulfiller->fulfill(RunState(result));
+            return result;
+        });
+    });
+}
 
-    // All good, we've "started"
+void Run::reuseResult(std::shared_ptr<Context> ctx, RunState rs) {
     startedAt = time(nullptr);
     context = ctx;
-
-    output_fd = plog[0];
-    close(plog[1]);
-    pid = leader;
-
-    // notifies the rpc client if the start command was used
+    result = rs;
     started.fulfiller->fulfill();
-
-    return getPromise(pid).then([this](int status){
-        // The leader process passes a RunState through the return value.
-        // Check it didn't die abnormally, then cast to get it back.
-        result = WIFEXITED(status) ? RunState(WEXITSTATUS(status)) : RunState::ABORTED;
-        finished.fulfiller->fulfill(RunState(result));
-        return result;
-    });
+    finished.fulfiller->fulfill(RunState(result));
 }
 
 std::string Run::reason() const {
@@ -206,5 +330,10 @@ bool Run::abort() {
         kill(-*p, SIGTERM);
         return true;
     }
+    // dealt with as soon as the leader exists
+    if(spawning) {
+        abortRequested = true;
+        return true;
+    }
     return false;
 }
@@ -21,12 +21,14 @@
 #include <string>
 #include <functional>
 #include <unordered_map>
+#include <map>
 #include <memory>
 #include <kj/async.h>
 #include <kj/filesystem.h>
 
 // Definition needed for musl
 typedef unsigned int uint;
+typedef unsigned long ulong;
 
 enum class RunState {
     UNKNOWN,
@@ -40,9 +42,17 @@ enum class RunState {
 std::string to_string(const RunState& rs);
 
 class Context;
+class Server;
 
 typedef std::unordered_map<std::string, std::string> ParamMap;
 
+// Resources consumed by a run, as far as they could be determined
+struct RunUsage {
+    ulong cpuTime = 0;    // user+system, milliseconds
+    ulong peakMemory = 0; // bytes
+    ulong ioBytes = 0;    // bytes read and written
+};
+
 // Represents an execution of a job.
 class Run {
 public:
@@ -53,7 +63,16 @@ public:
     Run(const Run&) = delete;
     Run& operator=(const Run&) = delete;
 
-    kj::Promise<RunState> start(RunState lastResult, std::shared_ptr<Context> ctx, const kj::Directory &fsHome, std::function<kj::Promise<int>(kj::Maybe<pid_t>&)> getPromise);
+    kj::Promise<RunState> start(RunState lastResult, std::shared_ptr<Context> ctx, const kj::Directory &fsHome, Server& srv);
+
+    // The environment of this run's scripts in the named context: that of
+    // laminard, the env files, the parameters and the fixed variables.
+    // Those which only exist once the run has started are not included
+    std::map<std::string, std::string> environment(const std::string& context) const;
+
+    // completes this run with the given result without executing anything,
+    // e.g. when the result of an earlier run can be reused
+    void reuseResult(std::shared_ptr<Context> ctx, RunState result);
 
     // aborts this run
     bool abort();
@@ -74,6 +93,15 @@ public:
     int output_fd;
     std::unordered_map<std::string, std::string> params;
     int timeout = 0;
+    // cgroup containing this run, if enabled
+    std::string cgroup;
+    RunUsage usage;
+    // output of cfg/jobs/$JOB.cachekey, if the job has one
+    std::string cacheKey;
+    bool cacheKeyPending = false;
+    bool cacheKeyEvaluated = false;
+    // length of the log when it was last stored by Laminar::checkpointLogs
+    size_t logCheckpoint = 0;
 
     time_t queuedAt;
     time_t startedAt;
@@ -92,6 +120,9 @@ private:
 
     kj::Path rootPath;
     std::string reasonMsg;
+    // while the leader is being forked, an abort has to wait for its pid
+    bool spawning = false;
+    bool abortRequested = false;
 
     kj::PromiseFulfillerPair<void> started;
     kj::ForkedPromise<void> startedFork;
@@ -21,27 +21,43 @@
 #include "rpc.h"
 #include "http.h"
 #include "laminar.h"
+#include "readbuffer.h"
+#include "uring.h"
+#include "compression.h"
+#include "zygote.h"
 
 #include <kj/async-io.h>
 #include <kj/async-unix.h>
 #include <kj/threadlocal.h>
 
+#include <algorithm>
 #include <sys/eventfd.h>
 #include <sys/stat.h>
 #include <sys/inotify.h>
+#include <sys/wait.h>
 
-// Size of buffer used to read from file descriptors. Should be
-// a multiple of sizeof(struct signalfd_siginfo) == 128
-#define PROC_IO_BUFSIZE 4096
+// Upper bound on the number of threads compressing logs
+#define COMPRESSION_THREADS_MAX 4
+
+// Interval in seconds at which orphaned processes are reaped, in case
+// none of the watched children exits for a while
+#define ORPHAN_REAP_INTERVAL 30
 
 Server::Server(kj::AsyncIoContext& io) :
     ioContext(io),
+    compressionPool(kj::heap<CompressionPool>(*io.lowLevelProvider,
+        std::max(1u, std::min(unsigned(COMPRESSION_THREADS_MAX), std::thread::hardware_concurrency())))),
     listeners(kj::heap<kj::TaskSet>(*this)),
     childTasks(*this)
 {
+    useIoUring(true);
+    listeners->add(reapOrphansPeriodically());
 }
 
 Server::~Server() {
+    // another Server would take the outstanding replies for its own
+    if(zygotePending)
+        stopZygote();
 }
 
 void Server::start() {
@@ -73,9 +89,30 @@ void Server::stop() {
 }
 
 kj::Promise<void> Server::readDescriptor(int fd, std::function<void(const char*,size_t)> cb) {
+#if defined(LAMINAR_IO_URING)
+    KJ_IF_MAYBE(reader, uring) {
+        return (*reader)->read(fd, kj::mv(cb));
+    }
+#endif
+    auto buffer = kj::heap<ReadBuffer>(fd);
     auto event = this->ioContext.lowLevelProvider->wrapInputFd(fd, kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP);
-    auto buffer = kj::heapArrayBuilder<char>(PROC_IO_BUFSIZE);
-    return handleFdRead(event, buffer.asPtr().begin(), cb).attach(std::move(event)).attach(std::move(buffer));
+    return handleFdRead(event, buffer, cb).attach(std::move(event)).attach(std::move(buffer));
+}
+
+bool Server::useIoUring(bool enable) {
+#if defined(LAMINAR_IO_URING)
+    if(!enable)
+        uring = nullptr;
+    else if(uring == nullptr)
+        uring = newUringReader(*ioContext.lowLevelProvider);
+    return uring != nullptr;
+#else
+    return false;
+#endif
+}
+
+kj::Promise<std::string> Server::compress(std::function<std::string()> job) {
+    return compressionPool->run(kj::mv(job));
 }
 
 void Server::addTask(kj::Promise<void>&& task) {
@@ -89,7 +126,77 @@ kj::Promise<void> Server::addTimeout(int seconds, std::function<void ()> cb) {
 }
 
 kj::Promise<int> Server::onChildExit(kj::Maybe<pid_t> &pid) {
-    return ioContext.unixEventPort.onChildExit(pid);
+    pid_t child = -1;
+    KJ_IF_MAYBE(p, pid) {
+        child = *p;
+        watchedChildren.insert(child);
+    }
+    return ioContext.unixEventPort.onChildExit(pid).then([this, child](int status){
+        watchedChildren.erase(child);
+        // orphans may well have exited along with their leader
+        reapOrphans();
+        return status;
+    });
+}
+
+void Server::reapOrphans() {
+    siginfo_t info;
+    while(true) {
+        info.si_pid = 0;
+        if(waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) != 0 || info.si_pid == 0)
+            return;
+        // kj reaps it, and anything behind it will be reaped next time
+        if(watchedChildren.count(info.si_pid))
+            return;
+        waitpid(info.si_pid, nullptr, WNOHANG);
+    }
+}
+
+kj::Promise<void> Server::reapOrphansPeriodically() {
+    return ioContext.lowLevelProvider->getTimer().afterDelay(ORPHAN_REAP_INTERVAL * kj::SECONDS).then([this](){
+        reapOrphans();
+        return reapOrphansPeriodically();
+    });
+}
+
+kj::Promise<pid_t> Server::spawnFromZygote(const char* procName, char* const envp[], int logFd, int usageFd, int startFd) {
+    if(!zygoteRequest(procName, envp, logFd, usageFd, startFd)) {
+        stopZygote();
+        return pid_t(-1);
+    }
+    if(!zygoteReplies)
+        zygoteReplies = ioContext.lowLevelProvider->wrapInputFd(zygoteReplyFd());
+    auto reply = kj::newPromiseAndFulfiller<pid_t>();
+    zygotePending++;
+    zygoteQueue = zygoteQueue.then([this, fulfiller = kj::mv(reply.fulfiller)]() mutable {
+        auto leader = kj::heap<pid_t>(-1);
+        pid_t* buf = leader.get();
+        return zygoteReplies->tryRead(buf, sizeof(pid_t), sizeof(pid_t))
+                .then([this, leader = kj::mv(leader), fulfiller = kj::mv(fulfiller)](size_t n) mutable {
+            zygotePending--;
+            if(n != sizeof(pid_t)) {
+                // the socket can't be closed while this read completes
+                addTask(kj::evalLater([this](){ stopZygote(); }));
+                *leader = -1;
+            }
+            fulfiller->fulfill(kj::cp(*leader));
+        });
+    }).eagerlyEvaluate([this](kj::Exception&& e){
+        LLOG(ERROR, "Failed to read from zygote", e.getDescription());
+        addTask(kj::evalLater([this](){ stopZygote(); }));
+    });
+    return kj::mv(reply.promise);
+}
+
+void Server::stopZygote() {
+    if(zygoteReplyFd() < 0)
+        return;
+    LLOG(ERROR, "Lost connection to zygote, leaders will be spawned directly");
+    // pending replies are abandoned, their leaders exit without running
+    zygoteQueue = kj::READY_NOW;
+    zygoteReplies = nullptr;
+    zygotePending = 0;
+    zygoteStop();
 }
 
 Server::PathWatcher& Server::watchPaths(std::function<void()> fn)
@@ -157,11 +264,12 @@ kj::Promise<void> Server::acceptRpcClient(Rpc& rpc, kj::Own<kj::ConnectionReceiv
 // returns a promise which will read a chunk of data from the file descriptor
 // wrapped by stream and invoke the provided callback with the read data.
 // Repeats until ::read returns <= 0
-kj::Promise<void> Server::handleFdRead(kj::AsyncInputStream* stream, char* buffer, std::function<void(const char*,size_t)> cb) {
-    return stream->tryRead(buffer, 1, PROC_IO_BUFSIZE).then([this,stream,buffer,cb](size_t sz) {
+kj::Promise<void> Server::handleFdRead(kj::AsyncInputStream* stream, ReadBuffer* buffer, std::function<void(const char*,size_t)> cb) {
+    return stream->tryRead(buffer->begin(), 1, buffer->size()).then([this,stream,buffer,cb](size_t sz) {
         if(sz > 0) {
-            cb(buffer, sz);
-            return handleFdRead(stream, kj::mv(buffer), cb);
+            cb(buffer->begin(), sz);
+            buffer->update(sz);
+            return handleFdRead(stream, buffer, cb);
         }
         return kj::Promise<void>(kj::READY_NOW);
     });
@@ -23,11 +23,16 @@
 #include <capnp/message.h>
 #include <capnp/capability.h>
 #include <functional>
+#include <set>
+#include <string>
 #include <sys/types.h>
 
 class Laminar;
 class Http;
 class Rpc;
+class UringReader;
+class CompressionPool;
+class ReadBuffer;
 
 // This class manages the program's asynchronous event loop
 class Server final : public kj::TaskSet::ErrorHandler {
@@ -41,6 +46,15 @@ public:
     // invoked with the read data
     kj::Promise<void> readDescriptor(int fd, std::function<void(const char*,size_t)> cb);
 
+    // Whether readDescriptor goes through io_uring, which is the default
+    // when built with LAMINAR_IO_URING and supported by the kernel. Returns
+    // whether io_uring is in use afterwards.
+    bool useIoUring(bool enable);
+
+    // Runs a (de)compression job on a worker thread. The promise resolves
+    // on the event loop with the result of the job
+    kj::Promise<std::string> compress(std::function<std::string()> job);
+
     void addTask(kj::Promise<void> &&task);
     // add a one-shot timer callback
     kj::Promise<void> addTimeout(int seconds, std::function<void()> cb);
@@ -48,6 +62,11 @@ public:
     // get a promise which resolves when a child process exits
     kj::Promise<int> onChildExit(kj::Maybe<pid_t>& pid);
 
+    // Forks a leader process from the zygote, see zygoteRequest. Resolves to
+    // its pid, or -1 if the zygote is not running or failed, in which case
+    // the caller has to spawn the leader itself
+    kj::Promise<pid_t> spawnFromZygote(const char* procName, char* const envp[], int logFd, int usageFd, int startFd);
+
     struct PathWatcher {
         virtual PathWatcher& addPath(const char* path) = 0;
     };
@@ -59,15 +78,31 @@ public:
 
 private:
     kj::Promise<void> acceptRpcClient(Rpc& rpc, kj::Own<kj::ConnectionReceiver>&& listener);
-    kj::Promise<void> handleFdRead(kj::AsyncInputStream* stream, char* buffer, std::function<void(const char*,size_t)> cb);
+    kj::Promise<void> handleFdRead(kj::AsyncInputStream* stream, ReadBuffer* buffer, std::function<void(const char*,size_t)> cb);
 
     void taskFailed(kj::Exception&& exception) override;
 
+    // Reaps exited children which nothing is waiting for with onChildExit,
+    // such as processes orphaned below a leader forked from the zygote
+    void reapOrphans();
+    kj::Promise<void> reapOrphansPeriodically();
+    void stopZygote();
+
 private:
     int efd_quit;
     kj::AsyncIoContext& ioContext;
+    // must outlive the tasks which may be reading through it
+    kj::Maybe<kj::Own<UringReader>> uring;
+    // must outlive the tasks which may be waiting for it
+    kj::Own<CompressionPool> compressionPool;
     kj::Own<kj::TaskSet> listeners;
     kj::TaskSet childTasks;
     kj::Maybe<kj::Promise<void>> reapWatch;
+    // children with a pending onChildExit
+    std::set<pid_t> watchedChildren;
+    // replies of the zygote are read in the order of the requests
+    kj::Own<kj::AsyncInputStream> zygoteReplies;
+    kj::Promise<void> zygoteQueue = kj::READY_NOW;
+    int zygotePending = 0;
 };
 
@@ -0,0 +1,60 @@
+///
+/// Copyright 2026 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "sysload.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Returns the "some avg10" value from a PSI file, whose first line is
+// of the form "some avg10=0.00 avg60=0.00 avg300=0.00 total=0"
+static double readPressure(const char* path) {
+    double avg10 = 0;
+    if(FILE* fp = fopen(path, "r")) {
+        if(fscanf(fp, "some avg10=%lf", &avg10) != 1)
+            avg10 = 0;
+        fclose(fp);
+    }
+    return avg10;
+}
+
+SystemLoad sampleSystemLoad() {
+    SystemLoad load;
+
+    double loadavg[1];
+    if(getloadavg(loadavg, 1) == 1)
+        load.loadAvg = loadavg[0];
+
+    load.cpuPressure = readPressure("/proc/pressure/cpu");
+    load.memoryPressure = readPressure("/proc/pressure/memory");
+    load.ioPressure = readPressure("/proc/pressure/io");
+
+    if(FILE* fp = fopen("/proc/meminfo", "r")) {
+        char line[128];
+        long kb;
+        while(fgets(line, sizeof(line), fp)) {
+            if(sscanf(line, "MemAvailable: %ld kB", &kb) == 1) {
+                load.memAvailable = kb / 1024;
+                break;
+            }
+        }
+        fclose(fp);
+    }
+
+    return load;
+}
@@ -0,0 +1,64 @@
+///
+/// Copyright 2026 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#pragma once
+
+// A snapshot of how busy the build host is. Values which could not be
+// determined (e.g. PSI is not available on this kernel) are left at
+// their defaults, which never exceed any limit.
+struct SystemLoad {
+    // 1-minute load average
+    double loadAvg = 0;
+    // "some avg10" from /proc/pressure/{cpu,memory,io}, in percent
+    double cpuPressure = 0;
+    double memoryPressure = 0;
+    double ioPressure = 0;
+    // MemAvailable from /proc/meminfo in MiB, or -1 if unknown
+    long memAvailable = -1;
+};
+
+// Thresholds above which a context should not accept new runs. A value
+// of zero disables the corresponding check.
+struct LoadLimits {
+    double maxLoad = 0;
+    double maxCpuPressure = 0;
+    double maxMemoryPressure = 0;
+    double maxIoPressure = 0;
+    long minFreeMemory = 0;
+
+    bool enabled() const {
+        return maxLoad > 0 || maxCpuPressure > 0 || maxMemoryPressure > 0
+                || maxIoPressure > 0 || minFreeMemory > 0;
+    }
+
+    // recentRuns have been started since the load was sampled, so are not
+    // reflected in it yet. Each is assumed to add one to the load average,
+    // so that a burst of queued runs cannot all start on a single sample.
+    // Pressure and free memory cannot be estimated this way.
+    bool exceededBy(const SystemLoad& load, int recentRuns = 0) const {
+        return (maxLoad > 0 && load.loadAvg + recentRuns > maxLoad)
+            || (maxCpuPressure > 0 && load.cpuPressure > maxCpuPressure)
+            || (maxMemoryPressure > 0 && load.memoryPressure > maxMemoryPressure)
+            || (maxIoPressure > 0 && load.ioPressure > maxIoPressure)
+            || (minFreeMemory > 0 && load.memAvailable >= 0 && load.memAvailable < minFreeMemory);
+    }
+};
+
+// Reads the current load from the kernel. Cheap enough to call every
+// few seconds: only a handful of small files in /proc are read.
+SystemLoad sampleSystemLoad();
@@ -0,0 +1,217 @@
+///
+/// Copyright 2026 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "uring.h"
+#include "readbuffer.h"
+#include "log.h"
+
+#include <kj/async-unix.h>
+#include <liburing.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <unordered_map>
+
+// Number of submission queue entries. More concurrent reads than this
+// are fine, the queue is just flushed more often
+#define URING_QUEUE_DEPTH 256
+
+namespace {
+
+class UringReaderImpl final : public UringReader, private kj::TaskSet::ErrorHandler {
+public:
+    UringReaderImpl() : tasks(*this) {}
+
+    ~UringReaderImpl() {
+        if(ringInitialized) {
+            // Every source has exactly one read in flight. Cancel them and
+            // wait until the kernel is done with their buffers
+            for(auto& s : sources) {
+                io_uring_sqe* sqe = getSqe();
+                io_uring_prep_cancel(sqe, s.second.get(), 0);
+                io_uring_sqe_set_data(sqe, nullptr);
+            }
+            io_uring_submit(&ring);
+            size_t pending = sources.size();
+            io_uring_cqe* cqe;
+            while(pending > 0 && io_uring_wait_cqe(&ring, &cqe) == 0) {
+                if(io_uring_cqe_get_data(cqe))
+                    pending--;
+                io_uring_cqe_seen(&ring, cqe);
+            }
+            io_uring_queue_exit(&ring);
+        }
+        for(auto& s : sources)
+            close(s.second->fd);
+    }
+
+    bool init(kj::LowLevelAsyncIoProvider& provider) {
+        int err = io_uring_queue_init(URING_QUEUE_DEPTH, &ring, 0);
+        if(err < 0) {
+            LLOG(WARNING, "Could not set up io_uring", strerror(-err));
+            return false;
+        }
+        ringInitialized = true;
+        int efd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if(efd < 0 || io_uring_register_eventfd(&ring, efd) < 0) {
+            LLOG(WARNING, "Could not register eventfd with io_uring", strerror(errno));
+            if(efd >= 0)
+                close(efd);
+            return false;
+        }
+        wake = provider.wrapInputFd(efd, kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP |
+                                         kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC |
+                                         kj::LowLevelAsyncIoProvider::ALREADY_NONBLOCK);
+        tasks.add(processCompletions());
+        return true;
+    }
+
+    kj::Promise<void> read(int fd, std::function<void(const char*,size_t)> cb) override {
+        // io_uring would fail reads from a non-blocking descriptor with
+        // EAGAIN instead of waiting for data. The descriptor is ours now,
+        // so make it blocking; io_uring still polls it internally rather
+        // than blocking a thread.
+        int flags = fcntl(fd, F_GETFL);
+        if(flags >= 0 && (flags & O_NONBLOCK))
+            fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+
+        auto paf = kj::newPromiseAndFulfiller<void>();
+        auto source = kj::heap<Source>();
+        Source* s = source.get();
+        s->id = nextId++;
+        s->fd = fd;
+        s->buffer = kj::heap<ReadBuffer>(fd);
+        s->cb = kj::mv(cb);
+        s->done = kj::mv(paf.fulfiller);
+        sources.emplace(s->id, kj::mv(source));
+        queueRead(s);
+        io_uring_submit(&ring);
+
+        // If the caller loses interest, the read in flight must be cancelled
+        // before the buffer it writes to may be freed
+        return paf.promise.attach(kj::defer([this, id = s->id]() {
+            cancel(id);
+        }));
+    }
+
+private:
+    struct Source {
+        uint64_t id;
+        int fd;
+        kj::Own<ReadBuffer> buffer;
+        std::function<void(const char*,size_t)> cb;
+        kj::Own<kj::PromiseFulfiller<void>> done;
+        bool cancelled = false;
+    };
+
+    void taskFailed(kj::Exception&& exception) override {
+        LLOG(ERROR, "io_uring completion handling failed", exception.getDescription());
+    }
+
+    io_uring_sqe* getSqe() {
+        io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+        if(!sqe) {
+            // the submission queue is full, flush it
+            io_uring_submit(&ring);
+            sqe = io_uring_get_sqe(&ring);
+        }
+        return sqe;
+    }
+
+    void queueRead(Source* s) {
+        io_uring_sqe* sqe = getSqe();
+        // offset -1 reads from the current position, as read(2) would
+        io_uring_prep_read(sqe, s->fd, s->buffer->begin(), s->buffer->size(), -1);
+        io_uring_sqe_set_data(sqe, s);
+    }
+
+    void cancel(uint64_t id) {
+        auto it = sources.find(id);
+        // already completed
+        if(it == sources.end() || it->second->cancelled)
+            return;
+        it->second->cancelled = true;
+        io_uring_sqe* sqe = getSqe();
+        io_uring_prep_cancel(sqe, it->second.get(), 0);
+        // the completion of the cancellation itself is of no interest
+        io_uring_sqe_set_data(sqe, nullptr);
+        io_uring_submit(&ring);
+    }
+
+    void remove(Source* s) {
+        close(s->fd);
+        sources.erase(s->id);
+    }
+
+    void complete(Source* s, int res) {
+        if(s->cancelled) {
+            remove(s);
+            return;
+        }
+        if(res == -EINTR || res == -EAGAIN) {
+            queueRead(s);
+            return;
+        }
+        if(res <= 0) {
+            if(res < 0)
+                LLOG(WARNING, "io_uring read failed", s->fd, strerror(-res));
+            s->done->fulfill();
+            remove(s);
+            return;
+        }
+
+        s->cb(s->buffer->begin(), res);
+        s->buffer->update(res);
+        queueRead(s);
+    }
+
+    kj::Promise<void> processCompletions() {
+        return wake->read(&wakeups, sizeof(wakeups)).then([this]() {
+            unsigned head;
+            unsigned n = 0;
+            io_uring_cqe* cqe;
+            io_uring_for_each_cqe(&ring, head, cqe) {
+                if(Source* s = (Source*) io_uring_cqe_get_data(cqe))
+                    complete(s, cqe->res);
+                n++;
+            }
+            io_uring_cq_advance(&ring, n);
+            // all the follow-up reads in a single system call
+            io_uring_submit(&ring);
+            return processCompletions();
+        });
+    }
+
+    io_uring ring;
+    bool ringInitialized = false;
+    uint64_t wakeups;
+    kj::Own<kj::AsyncInputStream> wake;
+    uint64_t nextId = 0;
+    std::unordered_map<uint64_t, kj::Own<Source>> sources;
+    kj::TaskSet tasks;
+};
+
+}
+
+kj::Maybe<kj::Own<UringReader>> newUringReader(kj::LowLevelAsyncIoProvider& provider) {
+    auto reader = kj::heap<UringReaderImpl>();
+    if(!reader->init(provider))
+        return nullptr;
+    return kj::Own<UringReader>(kj::mv(reader));
+}
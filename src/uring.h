@@ -0,0 +1,40 @@
+///
+/// Copyright 2026 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#pragma once
+
+#include <kj/async-io.h>
+#include <functional>
+
+// Reads from many file descriptors, typically the output pipes of runs,
+// through a single io_uring instead of the epoll-based kj event loop.
+// Reads are submitted and their completions harvested in batches, one
+// eventfd wakeup of the kj loop covering every pipe which has produced
+// output in the meantime.
+class UringReader {
+public:
+    virtual ~UringReader() = default;
+
+    // Same contract as Server::readDescriptor: takes ownership of fd and
+    // invokes cb with the data read until EOF, when the promise resolves
+    virtual kj::Promise<void> read(int fd, std::function<void(const char*,size_t)> cb) = 0;
+};
+
+// Returns nullptr if the kernel does not support io_uring or it is not
+// permitted (e.g. by a seccomp filter)
+kj::Maybe<kj::Own<UringReader>> newUringReader(kj::LowLevelAsyncIoProvider& provider);
@@ -0,0 +1,153 @@
+///
+/// Copyright 2026 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "workspace.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/fs.h>
+#endif
+
+static bool cloneEntries(int src, int dst);
+
+// Closes fd without clobbering errno of a preceding failure
+static void closeKeepErrno(int fd) {
+    int err = errno;
+    close(fd);
+    errno = err;
+}
+
+static bool cloneFile(int src, int dst, const char* name, const struct stat& st) {
+#if defined(FICLONE)
+    int in = openat(src, name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+    if(in < 0)
+        return false;
+    int out = openat(dst, name, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, st.st_mode & 07777);
+    bool ok = out >= 0 && ioctl(out, FICLONE, in) == 0;
+    // keep mtimes, otherwise build systems would consider everything stale
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    ok = ok && futimens(out, times) == 0;
+    if(out >= 0)
+        closeKeepErrno(out);
+    closeKeepErrno(in);
+    return ok;
+#else
+    errno = EOPNOTSUPP;
+    return false;
+#endif
+}
+
+static bool cloneEntry(int src, int dst, const char* name) {
+    struct stat st;
+    if(fstatat(src, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return false;
+
+    if(S_ISREG(st.st_mode))
+        return cloneFile(src, dst, name, st);
+
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    if(S_ISDIR(st.st_mode)) {
+        if(mkdirat(dst, name, st.st_mode & 07777) != 0)
+            return false;
+        int in = openat(src, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+        int out = openat(dst, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+        // the timestamp of a directory changes as it is filled, so set it last
+        bool ok = in >= 0 && out >= 0 && cloneEntries(in, out) && futimens(out, times) == 0;
+        if(out >= 0)
+            closeKeepErrno(out);
+        if(in >= 0)
+            closeKeepErrno(in);
+        return ok;
+    }
+
+    if(S_ISLNK(st.st_mode)) {
+        char target[PATH_MAX];
+        ssize_t n = readlinkat(src, name, target, sizeof(target) - 1);
+        if(n < 0)
+            return false;
+        target[n] = '\0';
+        return symlinkat(target, dst, name) == 0
+            && utimensat(dst, name, times, AT_SYMLINK_NOFOLLOW) == 0;
+    }
+
+    // sockets, fifos and devices have no place in a workspace
+    return true;
+}
+
+static bool cloneEntries(int src, int dst) {
+    // fdopendir takes ownership of the descriptor
+    int fd = dup(src);
+    if(fd < 0)
+        return false;
+    DIR* dir = fdopendir(fd);
+    if(!dir) {
+        closeKeepErrno(fd);
+        return false;
+    }
+    bool ok = true;
+    while(ok) {
+        errno = 0;
+        struct dirent* de = readdir(dir);
+        if(!de) {
+            ok = (errno == 0);
+            break;
+        }
+        if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        ok = cloneEntry(src, dst, de->d_name);
+    }
+    int err = errno;
+    closedir(dir);
+    errno = err;
+    return ok;
+}
+
+bool workspaceClone(const std::string& from, const std::string& to) {
+    int src = open(from.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(src < 0)
+        return false;
+    struct stat st;
+    bool ok = fstat(src, &st) == 0 && mkdir(to.c_str(), st.st_mode & 07777) == 0;
+    int dst = ok ? open(to.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC) : -1;
+    if(dst >= 0) {
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+        ok = cloneEntries(src, dst) && futimens(dst, times) == 0;
+        closeKeepErrno(dst);
+    } else {
+        ok = false;
+    }
+    closeKeepErrno(src);
+    return ok;
+}
+
+bool workspaceExchange(const std::string& snapshot, const std::string& workspace) {
+#if defined(__linux__) && defined(RENAME_EXCHANGE)
+    return renameat2(AT_FDCWD, snapshot.c_str(), AT_FDCWD, workspace.c_str(), RENAME_EXCHANGE) == 0;
+#else
+    errno = ENOSYS;
+    return false;
+#endif
+}
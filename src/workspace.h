@@ -0,0 +1,39 @@
+///
+/// Copyright 2026 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#pragma once
+
+#include <string>
+
+// Workspace snapshots give each run a private copy of the job's workspace
+// which shares its data with the original through reflinks (copy-on-write
+// clones of files, as supported by btrfs, XFS and bcachefs). Creating one
+// costs metadata operations only, so concurrent runs of a job can each
+// start from the warmed workspace without copying it or stepping on each
+// other's toes.
+
+// Recreates the directory tree at from as the new directory to, cloning
+// regular files and preserving modes and timestamps. Fails with errno set
+// to EOPNOTSUPP or EXDEV if the filesystem does not support reflinks; the
+// partially created tree is left for the caller to remove.
+bool workspaceClone(const std::string& from, const std::string& to);
+
+// Atomically swaps the directories snapshot and workspace, so that the
+// snapshot becomes the workspace of subsequent runs. The previous workspace
+// is left at the path of the snapshot.
+bool workspaceExchange(const std::string& snapshot, const std::string& workspace);
@@ -0,0 +1,303 @@
+///
+/// Copyright 2026 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "zygote.h"
+#include "leader.h"
+#include "log.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#if defined(__FreeBSD__)
+#include <sys/procctl.h>
+#else
+#include <sys/prctl.h>
+#endif
+
+extern char** environ;
+
+// A request is this header, sent along with the log, usage and start file
+// descriptors, followed by the process name and the environment as a
+// sequence of null-terminated strings. The reply is the leader's pid.
+struct ZygoteRequest {
+    uint32_t nameLen;
+    uint32_t envLen;
+};
+
+static int zygoteFd = -1;
+static pid_t zygotePid = -1;
+
+// The area occupied by the original argv, which can be overwritten to
+// change the name of the process as shown by ps
+static char* procNameBegin;
+static size_t procNameLen;
+
+static bool readAll(int fd, void* buf, size_t len) {
+    for(char* p = (char*) buf; len > 0;) {
+        ssize_t n = read(fd, p, len);
+        if(n <= 0) {
+            if(n < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Waits until fd can be written to after EAGAIN. laminard's end of the
+// socket is non-blocking because replies are read on the event loop, but
+// requests are small enough that this should hardly ever happen.
+static bool waitWritable(int fd) {
+    struct pollfd pfd = { fd, POLLOUT, 0 };
+    while(poll(&pfd, 1, -1) < 0) {
+        if(errno != EINTR)
+            return false;
+    }
+    return true;
+}
+
+static bool sendAll(int fd, const void* buf, size_t len) {
+    for(const char* p = (const char*) buf; len > 0;) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if(n <= 0) {
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n < 0 && errno == EAGAIN && waitWritable(fd))
+                continue;
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void setProcName(const std::string& name) {
+#if defined(__FreeBSD__)
+    setproctitle("-%s", name.c_str());
+#else
+    memset(procNameBegin, 0, procNameLen);
+    memcpy(procNameBegin, name.data(), std::min(name.size(), procNameLen - 1));
+    prctl(PR_SET_NAME, name.c_str(), 0, 0, 0);
+#endif
+}
+
+// Runs in the grandchild of the zygote and never returns
+[[noreturn]] static void execLeader(int sock, const std::string& name, std::string& env, int logFd, int usageFd, int startFd) {
+    close(sock);
+
+    // laminard writes to startFd once it is ready to wait for this process.
+    // If it closes it instead, it has given up on the zygote and spawned a
+    // leader of its own, so this one must not run.
+    char go;
+    while(true) {
+        ssize_t n = read(startFd, &go, 1);
+        if(n == 1)
+            break;
+        if(n < 0 && errno == EINTR)
+            continue;
+        _exit(EXIT_FAILURE);
+    }
+    close(startFd);
+
+    dup2(logFd, STDOUT_FILENO);
+    dup2(logFd, STDERR_FILENO);
+    close(logFd);
+    if(usageFd != LEADER_USAGE_FD) {
+        dup2(usageFd, LEADER_USAGE_FD);
+        close(usageFd);
+    }
+
+    std::string usageVar = "__LAMINAR_USAGE_FD=" + std::to_string(LEADER_USAGE_FD);
+    std::vector<char*> envp;
+    for(size_t i = 0; i < env.size(); i += strlen(&env[i]) + 1)
+        envp.push_back(&env[i]);
+    envp.push_back(usageVar.data());
+    envp.push_back(nullptr);
+    environ = envp.data();
+
+    setProcName(name);
+
+    int result = leader_main();
+    fflush(nullptr);
+    _exit(result);
+}
+
+[[noreturn]] static void zygoteMain(int sock) {
+    // leave the process group of laminard, so that signals from a
+    // controlling terminal don't reach the zygote
+    setpgid(0, 0);
+
+    while(true) {
+        ZygoteRequest req;
+        int fds[3];
+        union {
+            char buf[CMSG_SPACE(sizeof(fds))];
+            struct cmsghdr align;
+        } control;
+        struct iovec iov = { &req, sizeof(req) };
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        // laminard closed the socket, time to go
+        if(recvmsg(sock, &msg, MSG_WAITALL) != sizeof(req))
+            _exit(EXIT_SUCCESS);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if(!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+            _exit(EXIT_FAILURE);
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+        std::string name(req.nameLen, '\0');
+        std::string env(req.envLen, '\0');
+        if(!readAll(sock, name.data(), name.size()) || !readAll(sock, env.data(), env.size()))
+            _exit(EXIT_FAILURE);
+
+        pid_t leader = -1;
+        int pidPipe[2];
+        if(pipe(pidPipe) == 0) {
+            pid_t child = fork();
+            if(child == 0) {
+                close(pidPipe[0]);
+                pid_t grandchild = fork();
+                if(grandchild == 0) {
+                    close(pidPipe[1]);
+                    execLeader(sock, name, env, fds[0], fds[1], fds[2]);
+                }
+                if(write(pidPipe[1], &grandchild, sizeof(grandchild)) != sizeof(grandchild))
+                    _exit(EXIT_FAILURE);
+                _exit(EXIT_SUCCESS);
+            }
+            close(pidPipe[1]);
+            if(child > 0) {
+                if(!readAll(pidPipe[0], &leader, sizeof(leader)))
+                    leader = -1;
+                waitpid(child, nullptr, 0);
+            }
+            close(pidPipe[0]);
+        }
+        for(int fd : fds)
+            close(fd);
+
+        if(!sendAll(sock, &leader, sizeof(leader)))
+            _exit(EXIT_FAILURE);
+    }
+}
+
+bool zygoteStart(int argc, char** argv) {
+    // The strings of argv are usually contiguous in memory. Find out how
+    // much of that is available for process names
+    procNameBegin = argv[0];
+    procNameLen = strlen(argv[0]) + 1;
+    for(int i = 1; i < argc && argv[i] == procNameBegin + procNameLen; ++i)
+        procNameLen += strlen(argv[i]) + 1;
+
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv) != 0) {
+        LLOG(ERROR, "Could not create zygote socket", strerror(errno));
+        return false;
+    }
+
+    pid_t pid = fork();
+    if(pid < 0) {
+        LLOG(ERROR, "Could not fork zygote", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+    if(pid == 0) {
+        close(sv[0]);
+        zygoteMain(sv[1]);
+    }
+    close(sv[1]);
+
+    // Leaders are orphaned by their parent in the zygote. Make sure they
+    // are reparented to this process so that they can be waited for.
+#if defined(__FreeBSD__)
+    procctl(P_PID, 0, PROC_REAP_ACQUIRE, NULL);
+#else
+    prctl(PR_SET_CHILD_SUBREAPER, 1, NULL, NULL, NULL);
+#endif
+
+    zygoteFd = sv[0];
+    zygotePid = pid;
+    return true;
+}
+
+void zygoteStop() {
+    if(zygoteFd < 0)
+        return;
+    // the zygote exits when it reads EOF
+    close(zygoteFd);
+    waitpid(zygotePid, nullptr, 0);
+    zygoteFd = -1;
+    zygotePid = -1;
+}
+
+bool zygoteRequest(const char* procName, char* const envp[], int logFd, int usageFd, int startFd) {
+    if(zygoteFd < 0)
+        return false;
+
+    std::string env;
+    for(char* const* e = envp; *e; ++e)
+        env.append(*e, strlen(*e) + 1);
+
+    ZygoteRequest req = { uint32_t(strlen(procName)), uint32_t(env.size()) };
+    int fds[3] = { logFd, usageFd, startFd };
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { &req, sizeof(req) };
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t sent;
+    while((sent = sendmsg(zygoteFd, &msg, MSG_NOSIGNAL)) < 0 && (errno == EINTR || (errno == EAGAIN && waitWritable(zygoteFd))));
+    if(sent != sizeof(req)
+            || !sendAll(zygoteFd, procName, req.nameLen)
+            || !sendAll(zygoteFd, env.data(), env.size())) {
+        LLOG(ERROR, "Lost connection to zygote");
+        return false;
+    }
+    return true;
+}
+
+int zygoteReplyFd() {
+    return zygoteFd;
+}
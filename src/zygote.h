@@ -0,0 +1,53 @@
+///
+/// Copyright 2026 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#pragma once
+
+#include <sys/types.h>
+
+// The zygote is a helper process forked from laminard before it has set
+// up any state. Leader processes are forked from it and call leader_main
+// directly, which avoids the cost of exec, dynamic linking and the
+// copy-on-write setup of a large laminard process for every run.
+//
+// Leaders are forked through an intermediate process which exits
+// immediately, so they are reparented to laminard, which makes itself a
+// subreaper for this purpose. This way laminard can wait for them as if
+// it had forked them itself. As a subreaper, laminard also inherits any
+// process orphaned below a leader; Server reaps those.
+
+// Forks the zygote. Should be called as early as possible, and must be
+// called before any threads are started. argv is used to set the process
+// name of the leaders; since it cannot be grown, names may be truncated.
+bool zygoteStart(int argc, char** argv);
+
+// Terminates the zygote. Further calls to zygoteSpawn will fail.
+void zygoteStop();
+
+// Asks the zygote for a new leader process with the given name and
+// environment, whose stdout and stderr are connected to logFd and which
+// reports resource usage to usageFd. The leader does nothing until a byte
+// is written to startFd, so that it cannot exit before laminard is ready
+// to wait for it, and exits if startFd is closed instead. Returns false
+// if the zygote is not running or the request could not be sent.
+bool zygoteRequest(const char* procName, char* const envp[], int logFd, int usageFd, int startFd);
+
+// The zygote answers each request in turn with the pid of the leader, or
+// -1 if it failed, on this socket. Replies are read asynchronously by
+// Server::spawnFromZygote. Returns -1 if the zygote is not running.
+int zygoteReplyFd();
@@ -0,0 +1,79 @@
+///
+/// Copyright 2026 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "laminar-fixture.h"
+#include "zygote.h"
+
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+// Benchmarks print their results rather than asserting on them, so they
+// are kept out of laminar-tests and built as laminar-benchmarks
+
+TEST_F(LaminarFixture, OutputThroughput) {
+    auto throughput = [&]() {
+        const size_t total = 128 << 20;
+        int fds[2];
+        if(pipe(fds) != 0)
+            return 0.0;
+        std::thread writer([fd = fds[1]](){
+            std::vector<char> chunk(64 << 10, 'x');
+            for(size_t n = 0; n < total;) {
+                ssize_t w = write(fd, chunk.data(), std::min(chunk.size(), total - n));
+                if(w <= 0)
+                    break;
+                n += w;
+            }
+            close(fd);
+        });
+        size_t received = 0;
+        auto start = std::chrono::steady_clock::now();
+        server->readDescriptor(fds[0], [&](const char*, size_t n){
+            received += n;
+        }).wait(ioContext->waitScope);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        writer.join();
+        EXPECT_EQ(total, received);
+        return received / seconds / (1 << 20);
+    };
+    server->useIoUring(false);
+    double epoll = throughput();
+    if(server->useIoUring(true))
+        printf("[ benchmark] output ingestion: %.0f MiB/s with epoll, %.0f MiB/s with io_uring\n", epoll, throughput());
+    else
+        printf("[ benchmark] output ingestion: %.0f MiB/s with epoll, io_uring unavailable\n", epoll);
+}
+
+// Stops the zygote, so any benchmark after this one spawns leaders directly
+TEST_F(LaminarFixture, StartLatency) {
+    defineJob("foo", "true");
+    auto meanRunTime = [&](int n) {
+        auto start = std::chrono::steady_clock::now();
+        for(int i = 0; i < n; ++i)
+            EXPECT_EQ(LaminarCi::JobResult::SUCCESS, runJob("foo").result);
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / n;
+    };
+    double zygote = meanRunTime(20);
+    restartLaminar([]{
+        zygoteStop();
+    });
+    double spawn = meanRunTime(20);
+    printf("[ benchmark] mean time of a trivial run: %.2fms with zygote, %.2fms without\n", zygote, spawn);
+}
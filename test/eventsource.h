@@ -22,50 +22,76 @@
 #include <kj/async-io.h>
 #include <kj/compat/http.h>
 #include <rapidjson/document.h>
+#include <string>
 #include <vector>
 
 class EventSource {
 public:
-    EventSource(kj::AsyncIoContext& ctx, const char* httpConnectAddr, const char* path) :
+    EventSource(kj::AsyncIoContext& ctx, const char* httpConnectAddr, const char* path, const char* lastEventId = nullptr) :
         networkAddress(ctx.provider->getNetwork().parseAddress(httpConnectAddr).wait(ctx.waitScope)),
         httpClient(kj::newHttpClient(ctx.lowLevelProvider->getTimer(), headerTable, *networkAddress)),
         headerTable(),
-        headers(headerTable),
-        buffer(kj::heapArrayBuilder<char>(BUFFER_SIZE))
+        headers(headerTable)
     {
         headers.add("Accept", "text/event-stream");
+        if(lastEventId)
+            headers.add("Last-Event-ID", lastEventId);
         auto resp = httpClient->request(kj::HttpMethod::GET, path, headers).response.wait(ctx.waitScope);
-        promise = waitForMessages(resp.body.get(), 0).attach(kj::mv(resp));
+        promise = waitForMessages(resp.body.get()).attach(kj::mv(resp));
     }
 
     const std::vector<rapidjson::Document>& messages() {
         return receivedMessages;
     }
 
+    // The id of the latest message, as a client would send it on reconnection
+    const std::string& lastEventId() {
+        return eventId;
+    }
+
 private:
+    static const int BUFFER_SIZE = 1024;
+
     kj::Own<kj::NetworkAddress> networkAddress;
     kj::Own<kj::HttpClient> httpClient;
     kj::HttpHeaderTable headerTable;
     kj::HttpHeaders headers;
-    kj::ArrayBuilder<char> buffer;
+    char buffer[BUFFER_SIZE];
+    std::string pending;
+    std::string eventId;
     kj::Maybe<kj::Promise<void>> promise;
     std::vector<rapidjson::Document> receivedMessages;
 
-    kj::Promise<void> waitForMessages(kj::AsyncInputStream* stream, ulong offset) {
-        return stream->read(buffer.asPtr().begin() + offset, 1, BUFFER_SIZE).then([=, this](size_t s) {
-            ulong end = offset + s;
-            buffer.asPtr().begin()[end] = '\0';
-            if(strcmp(&buffer.asPtr().begin()[end - 2], "\n\n") == 0) {
-                rapidjson::Document d;
-                d.Parse(buffer.begin() + strlen("data: "));
-                receivedMessages.emplace_back(kj::mv(d));
-                end = 0;
+    kj::Promise<void> waitForMessages(kj::AsyncInputStream* stream) {
+        return stream->tryRead(buffer, 1, BUFFER_SIZE).then([=, this](size_t s) {
+            pending.append(buffer, s);
+            // an event ends with an empty line. Events without data, such
+            // as keepalive comments, are not messages
+            for(size_t end; (end = pending.find("\n\n")) != std::string::npos;) {
+                std::string data;
+                size_t line = 0;
+                while(line <= end) {
+                    size_t eol = pending.find('\n', line);
+                    std::string field = pending.substr(line, eol - line);
+                    if(field.rfind("data: ", 0) == 0)
+                        data += field.substr(strlen("data: "));
+                    else if(field.rfind("id: ", 0) == 0)
+                        eventId = field.substr(strlen("id: "));
+                    line = eol + 1;
+                }
+                pending.erase(0, end + 2);
+                if(!data.empty()) {
+                    rapidjson::Document d;
+                    d.Parse(data.c_str());
+                    receivedMessages.emplace_back(kj::mv(d));
+                }
             }
-            return waitForMessages(stream, end);
+            if(s == 0)
+                return kj::Promise<void>(kj::READY_NOW);
+            return waitForMessages(stream);
         });
     }
 
-    static const int BUFFER_SIZE = 1024;
 };
 
 #endif // LAMINAR_EVENTSOURCE_H_
@@ -55,8 +55,42 @@ public:
         tmp.clean();
     }
 
-    kj::Own<EventSource> eventSource(const char* path) {
-        return kj::heap<EventSource>(*ioContext, bind_http.c_str(), path);
+    // Stops laminard and starts it again on the same home directory,
+    // calling whileStopped in between
+    void restartLaminar(std::function<void()> whileStopped = nullptr) {
+        rpc = nullptr;
+        delete server;
+        delete laminar;
+        if(whileStopped)
+            whileStopped();
+        server = new Server(*ioContext);
+        laminar = new Laminar(*server, settings);
+    }
+
+    // Runs the event loop until nothing is queued or running, and then
+    // a little longer so that the last completion is stored
+    void waitForIdle() {
+        for(int i = 0; i < 100 && (!laminar->listQueuedJobs().empty() || !laminar->listRunningJobs().empty()); ++i)
+            ioContext->provider->getTimer().afterDelay(50 * kj::MILLISECONDS).wait(ioContext->waitScope);
+        ioContext->provider->getTimer().afterDelay(50 * kj::MILLISECONDS).wait(ioContext->waitScope);
+    }
+
+    // The resource usage stored for a completed run
+    RunUsage storedUsage(const char* job, uint build) {
+        RunUsage usage;
+        Database db((home + "/laminar.sqlite").c_str());
+        db.stmt("SELECT IFNULL(cpuTime, 0), IFNULL(peakMemory, 0), IFNULL(ioBytes, 0) FROM builds WHERE name = ? AND number = ?")
+         .bind(job, build)
+         .fetch<ulong,ulong,ulong>([&](ulong cpuTime, ulong peakMemory, ulong ioBytes){
+            usage.cpuTime = cpuTime;
+            usage.peakMemory = peakMemory;
+            usage.ioBytes = ioBytes;
+        });
+        return usage;
+    }
+
+    kj::Own<EventSource> eventSource(const char* path, const char* lastEventId = nullptr) {
+        return kj::heap<EventSource>(*ioContext, bind_http.c_str(), path, lastEventId);
     }
 
     void defineJob(const char* name, const char* scriptContent, const char* configContent = nullptr) {
@@ -19,9 +19,11 @@
 #include <kj/async-unix.h>
 #include "laminar-fixture.h"
 #include "conf.h"
+#include "cgroup.h"
 
-// TODO: consider handling this differently
-kj::AsyncIoContext* LaminarFixture::ioContext;
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fstream>
 
 TEST_F(LaminarFixture, EmptyStatusMessageStructure) {
     auto es = eventSource("/");
@@ -92,6 +94,279 @@ TEST_F(LaminarFixture, OnlyRelevantNotifications) {
     EXPECT_EQ(4, es2Run->messages().size());
 }
 
+TEST_F(LaminarFixture, ResumeEvents) {
+    defineJob("foo", "true");
+    auto es = eventSource("/");
+    ioContext->waitScope.poll();
+    ASSERT_EQ(1, es->messages().size());
+    std::string lastEventId = es->lastEventId();
+    ASSERT_FALSE(lastEventId.empty());
+
+    runJob("foo");
+
+    // only the missed events are sent to a resuming client
+    auto resumed = eventSource("/", lastEventId.c_str());
+    ioContext->waitScope.poll();
+    ASSERT_EQ(3, resumed->messages().size());
+    EXPECT_STREQ("job_queued", resumed->messages().at(0)["type"].GetString());
+    EXPECT_STREQ("job_completed", resumed->messages().at(2)["type"].GetString());
+    EXPECT_EQ(es->lastEventId(), resumed->lastEventId());
+
+    // an unknown id gets the whole status
+    auto unknown = eventSource("/", "1");
+    ioContext->waitScope.poll();
+    ASSERT_EQ(1, unknown->messages().size());
+    EXPECT_STREQ("status", unknown->messages().front()["type"].GetString());
+}
+
+TEST_F(LaminarFixture, WebSocketSubscriptions) {
+    defineJob("foo", "echo hello");
+    kj::HttpHeaderTable table;
+    auto address = ioContext->provider->getNetwork().parseAddress(bind_http.c_str()).wait(ioContext->waitScope);
+    auto client = kj::newHttpClient(ioContext->lowLevelProvider->getTimer(), table, *address);
+    auto response = client->openWebSocket("/ws", kj::HttpHeaders(table)).wait(ioContext->waitScope);
+    ASSERT_EQ(101, response.statusCode);
+    auto ws = kj::mv(response.webSocketOrBody.get<kj::Own<kj::WebSocket>>());
+    auto receive = [&]{
+        rapidjson::Document d;
+        auto message = ws->receive().wait(ioContext->waitScope);
+        d.Parse(message.get<kj::String>().cStr());
+        return d;
+    };
+
+    ws->send(kj::StringPtr("{\"op\":\"watch\",\"channel\":1,\"path\":\"/\"}")).wait(ioContext->waitScope);
+    auto status = receive();
+    EXPECT_EQ(1, status["channel"].GetInt());
+    EXPECT_STREQ("status", status["data"]["type"].GetString());
+
+    runJob("foo");
+    EXPECT_STREQ("job_queued", receive()["data"]["type"].GetString());
+    EXPECT_STREQ("job_started", receive()["data"]["type"].GetString());
+    EXPECT_STREQ("job_completed", receive()["data"]["type"].GetString());
+
+    // logs are multiplexed on the same connection
+    ws->send(kj::StringPtr("{\"op\":\"log\",\"channel\":2,\"job\":\"foo\",\"run\":1}")).wait(ioContext->waitScope);
+    auto log = ws->receive().wait(ioContext->waitScope);
+    auto& bytes = log.get<kj::Array<kj::byte>>();
+    ASSERT_GT(bytes.size(), 4);
+    EXPECT_EQ(2, bytes[3]);
+    kj::String output = kj::heapString(reinterpret_cast<const char*>(bytes.begin() + 4), bytes.size() - 4);
+    EXPECT_STREQ("hello\n", stripLaminarLogLines(output).cStr());
+    auto eot = receive();
+    EXPECT_EQ(2, eot["channel"].GetInt());
+    EXPECT_TRUE(eot["eot"].GetBool());
+
+    // an open channel has to be closed before it is reused
+    ws->send(kj::StringPtr("{\"op\":\"watch\",\"channel\":1,\"path\":\"/\"}")).wait(ioContext->waitScope);
+    auto inUse = receive();
+    EXPECT_EQ(1, inUse["channel"].GetInt());
+    EXPECT_STREQ("Channel in use", inUse["error"].GetString());
+    ws->send(kj::StringPtr("{\"op\":\"watch\"}")).wait(ioContext->waitScope);
+    auto invalid = receive();
+    EXPECT_FALSE(invalid.HasMember("channel"));
+    EXPECT_STREQ("Invalid command", invalid["error"].GetString());
+
+    // the log on channel 2 has ended, so only channel 1 counts
+    for(int channel = 2; channel <= 64; ++channel) {
+        ws->send(kj::str("{\"op\":\"watch\",\"channel\":", channel, ",\"path\":\"/\"}")).wait(ioContext->waitScope);
+        ASSERT_EQ(channel, receive()["channel"].GetInt());
+    }
+    ws->send(kj::StringPtr("{\"op\":\"watch\",\"channel\":65,\"path\":\"/\"}")).wait(ioContext->waitScope);
+    auto tooMany = receive();
+    EXPECT_EQ(65, tooMany["channel"].GetInt());
+    EXPECT_STREQ("Too many channels", tooMany["error"].GetString());
+}
+
+TEST_F(LaminarFixture, TailRun) {
+    struct LogCollector : public LaminarCi::LogSink::Server {
+        LogCollector(std::string& log) : log(log) {}
+        kj::Promise<void> write(WriteContext context) override {
+            auto chunk = context.getParams().getChunk();
+            log.append(reinterpret_cast<const char*>(chunk.begin()), chunk.size());
+            return kj::READY_NOW;
+        }
+        std::string& log;
+    };
+    defineJob("foo", "echo hello; sleep 0.2; echo world");
+    auto start = client().startRequest();
+    start.setJobName("foo");
+    start.send().wait(ioContext->waitScope);
+
+    // follows the latest run while it is running
+    std::string log;
+    auto req = client().tailRequest();
+    req.getRun().setJob("foo");
+    req.setSink(kj::heap<LogCollector>(log));
+    auto res = req.send().wait(ioContext->waitScope);
+    EXPECT_EQ(LaminarCi::JobResult::SUCCESS, res.getResult());
+    EXPECT_STREQ("hello\nworld\n", stripLaminarLogLines(kj::heapString(log.data(), log.size())).cStr());
+
+    // and completed runs
+    std::string stored;
+    auto completed = client().tailRequest();
+    completed.getRun().setJob("foo");
+    completed.getRun().setBuildNum(1);
+    completed.setSink(kj::heap<LogCollector>(stored));
+    EXPECT_EQ(LaminarCi::JobResult::SUCCESS, completed.send().wait(ioContext->waitScope).getResult());
+    EXPECT_EQ(log, stored);
+}
+
+TEST_F(LaminarFixture, QueueBatch) {
+    defineJob("foo", "true");
+    defineJob("bar", "true");
+    auto es = eventSource("/");
+
+    auto req = client().queueBatchRequest();
+    auto jobs = req.initJobs(4);
+    jobs[0].setJobName("foo");
+    jobs[1].setJobName("bar");
+    jobs[2].setJobName("nonexistent");
+    jobs[3].setJobName("foo");
+    auto res = req.send().wait(ioContext->waitScope);
+    EXPECT_EQ(LaminarCi::MethodResult::FAILED, res.getResult());
+    ASSERT_EQ(4, res.getRuns().size());
+    EXPECT_EQ(1, res.getRuns()[0].getBuildNum());
+    EXPECT_EQ(1, res.getRuns()[1].getBuildNum());
+    EXPECT_EQ(0, res.getRuns()[2].getBuildNum());
+    EXPECT_EQ(2, res.getRuns()[3].getBuildNum());
+
+    waitForIdle();
+
+    // one event for each job, before any of them started
+    ASSERT_LE(3, es->messages().size());
+    auto foo = es->messages().at(1).GetObject();
+    EXPECT_STREQ("jobs_queued", foo["type"].GetString());
+    ASSERT_EQ(2, foo["data"].Size());
+    EXPECT_EQ(2, foo["data"][1]["number"].GetInt());
+    EXPECT_STREQ("jobs_queued", es->messages().at(2)["type"].GetString());
+    EXPECT_STREQ("bar", es->messages().at(2)["data"][0]["name"].GetString());
+}
+
+TEST_F(LaminarFixture, RecoverRuns) {
+    defineJob("foo", "echo $greeting");
+    std::string dbPath = home + "/laminar.sqlite";
+
+    // as if laminard had been killed with one run started and two queued,
+    // one of them by a version which did not store parameters yet
+    restartLaminar([&]{
+        Database db(dbPath.c_str());
+        ASSERT_TRUE(db.exec("INSERT INTO builds(name,number,queuedAt,startedAt) VALUES('foo',1,1,2)"));
+        ASSERT_TRUE(db.exec("INSERT INTO builds(name,number,queuedAt,reason,params) "
+                            "VALUES('foo',2,3,'testing','{\"greeting\":\"hello\"}')"));
+        ASSERT_TRUE(db.exec("INSERT INTO builds(name,number,queuedAt) VALUES('foo',3,4)"));
+    });
+
+    waitForIdle();
+
+    KJ_IF_MAYBE(log, laminar->handleLogRequest("foo", 2).wait(ioContext->waitScope)) {
+        EXPECT_EQ(RunState::SUCCESS, log->result);
+        EXPECT_NE(std::string::npos, log->output.find("hello"));
+    } else {
+        FAIL() << "queued run was not recovered";
+    }
+
+    Database db(dbPath.c_str());
+    int n = 0;
+    db.stmt("SELECT number, result, reason FROM builds WHERE name = 'foo' ORDER BY number")
+    .fetch<uint, int, std::string>([&](uint build, int result, std::string reason){
+        n++;
+        if(build == 2) {
+            EXPECT_EQ(int(RunState::SUCCESS), result);
+            EXPECT_EQ("testing", reason);
+        } else {
+            EXPECT_EQ(int(RunState::ABORTED), result);
+        }
+    });
+    EXPECT_EQ(3, n);
+    EXPECT_EQ(3, laminar->latestRun("foo"));
+}
+
+TEST_F(LaminarFixture, LogCheckpoint) {
+    settings.log_checkpoint_interval = 1;
+    restartLaminar();
+    defineJob("foo", "echo hello; sleep inf");
+    auto start = client().startRequest();
+    start.setJobName("foo");
+    start.send().wait(ioContext->waitScope);
+
+    // the log so far is stored while the run is still going
+    auto checkpoint = [&]{
+        std::string output;
+        Database db((home + "/laminar.sqlite").c_str());
+        db.stmt("SELECT IFNULL(output, '') FROM builds WHERE name = 'foo' AND number = 1 AND completedAt IS NULL")
+         .fetch<std::string>([&](std::string o){ output = kj::mv(o); });
+        return output;
+    };
+    for(int i = 0; i < 60 && checkpoint().find("hello") == std::string::npos; ++i)
+        ioContext->provider->getTimer().afterDelay(50 * kj::MILLISECONDS).wait(ioContext->waitScope);
+    EXPECT_NE(std::string::npos, checkpoint().find("hello"));
+
+    laminar->abort("foo", 1);
+    waitForIdle();
+}
+
+TEST_F(LaminarFixture, RunUsage) {
+    defineJob("spin", "i=0; while [ $i -lt 300000 ]; do i=$((i+1)); done");
+    auto run = runJob("spin");
+    ASSERT_EQ(LaminarCi::JobResult::SUCCESS, run.result);
+    waitForIdle();
+    // reported by the leader from the processes it reaped
+    RunUsage usage = storedUsage("spin", 1);
+    EXPECT_GT(usage.cpuTime, 0ul);
+    EXPECT_GT(usage.peakMemory, 0ul);
+}
+
+TEST_F(LaminarFixture, EnvFileChanges) {
+    auto writeFile = [this](kj::Path path, const char* content) {
+        tmp.fs->openFile(path, kj::WriteMode::CREATE | kj::WriteMode::MODIFY | kj::WriteMode::CREATE_PARENT)
+            ->writeAll(content);
+    };
+    defineJob("foo", "echo $A$B$C");
+    writeFile(kj::Path{"cfg", "env"}, "A=1");
+    writeFile(kj::Path{"cfg", "contexts", "default.env"}, "B=2");
+    writeFile(kj::Path{"cfg", "jobs", "foo.env"}, "C=3");
+    EXPECT_STREQ("123\n", stripLaminarLogLines(runJob("foo").log).cStr());
+
+    // parsed env files are cached, but edits must still be seen
+    writeFile(kj::Path{"cfg", "env"}, "A=4");
+    writeFile(kj::Path{"cfg", "contexts", "default.env"}, "B=5");
+    writeFile(kj::Path{"cfg", "jobs", "foo.env"}, "C=67");
+    EXPECT_STREQ("4567\n", stripLaminarLogLines(runJob("foo").log).cStr());
+
+    tmp.fs->remove(kj::Path{"cfg", "jobs", "foo.env"});
+    EXPECT_STREQ("45\n", stripLaminarLogLines(runJob("foo").log).cStr());
+}
+
+TEST_F(LaminarFixture, CgroupUsage) {
+    // needs a cgroup v2 directory below our own which we may write to
+    std::string own;
+    std::ifstream procCgroup("/proc/self/cgroup");
+    for(std::string line; std::getline(procCgroup, line);) {
+        if(line.compare(0, 3, "0::") == 0)
+            own = "/sys/fs/cgroup" + line.substr(3);
+    }
+    std::string root = own + "/laminar-test-" + std::to_string(getpid());
+    if(own.empty() || mkdir(root.c_str(), 0755) != 0)
+        GTEST_SKIP() << "no writable cgroup v2 hierarchy";
+    KJ_DEFER({
+        // laminard moved this process into the test cgroup
+        std::ofstream(own + "/cgroup.procs") << getpid();
+        cgroupRemove(root);
+    });
+
+    setenv("LAMINAR_CGROUP", root.c_str(), 1);
+    restartLaminar();
+    unsetenv("LAMINAR_CGROUP");
+
+    defineJob("spin", "i=0; while [ $i -lt 300000 ]; do i=$((i+1)); done");
+    auto run = runJob("spin");
+    ASSERT_EQ(LaminarCi::JobResult::SUCCESS, run.result);
+    waitForIdle();
+    EXPECT_GT(storedUsage("spin", 1).cpuTime, 0ul);
+    // the run's cgroup is removed when it completes
+    EXPECT_NE(0, access((root + "/run-spin-1").c_str(), F_OK));
+}
+
 TEST_F(LaminarFixture, FailedStatus) {
     defineJob("job1", "false");
     auto run = runJob("job1");
@@ -107,6 +382,156 @@ TEST_F(LaminarFixture, WorkingDirectory) {
 }
 
 
+TEST_F(LaminarFixture, JobSteps) {
+    auto defineStep = [&](const char* job, const char* name, const char* scriptContent, const char* depends = nullptr) {
+        KJ_IF_MAYBE(f, tmp.fs->tryOpenFile(kj::Path{"cfg", "jobs", std::string(job) + ".d", std::string(name) + ".run"},
+                kj::WriteMode::CREATE | kj::WriteMode::CREATE_PARENT | kj::WriteMode::EXECUTABLE)) {
+            (*f)->writeAll(std::string("#!/bin/sh\n") + scriptContent + "\n");
+        }
+        if(depends) {
+            KJ_IF_MAYBE(f, tmp.fs->tryOpenFile(kj::Path{"cfg", "jobs", std::string(job) + ".d", std::string(name) + ".conf"}, kj::WriteMode::CREATE)) {
+                (*f)->writeAll(std::string("DEPENDS=") + depends);
+            }
+        }
+    };
+    defineStep("foo", "a", "echo a");
+    defineStep("foo", "b", "echo b", "a");
+    defineStep("foo", "c", "false");
+    defineStep("foo", "d", "echo d", "b,c");
+    auto run = runJob("foo");
+    ASSERT_EQ(LaminarCi::JobResult::FAILED, run.result);
+    std::string log = stripLaminarLogLines(run.log).cStr();
+    EXPECT_NE(std::string::npos, log.find("[a] a\n"));
+    EXPECT_GT(log.find("[b] b\n"), log.find("[a] a\n"));
+    EXPECT_EQ(std::string::npos, log.find("[d]"));
+
+    // a dependency on a step which doesn't exist fails the run
+    defineStep("bar", "a", "echo a");
+    defineStep("bar", "b", "echo b", "x");
+    run = runJob("bar");
+    ASSERT_EQ(LaminarCi::JobResult::FAILED, run.result);
+    log = stripLaminarLogLines(run.log).cStr();
+    EXPECT_NE(std::string::npos, log.find("[a] a\n"));
+    EXPECT_EQ(std::string::npos, log.find("[b]"));
+
+    // a parallelism below one still runs the steps one at a time
+    defineStep("baz", "a", "echo a");
+    defineStep("baz", "b", "echo b", "a");
+    KJ_IF_MAYBE(f, tmp.fs->tryOpenFile(kj::Path{"cfg", "jobs", "baz.conf"}, kj::WriteMode::CREATE)) {
+        (*f)->writeAll("STEP_PARALLELISM=0");
+    }
+    run = runJob("baz");
+    ASSERT_EQ(LaminarCi::JobResult::SUCCESS, run.result);
+    EXPECT_STREQ("[a] a\n[b] b\n", stripLaminarLogLines(run.log).cStr());
+}
+
+TEST_F(LaminarFixture, FanOutFanIn) {
+    defineJob("a", "true", "FANOUT=b1,b2\nFANIN=c");
+    defineJob("b1", "true");
+    defineJob("b2", "true");
+    defineJob("c", "true");
+    runJob("a");
+    // b1 and b2 are queued when a completes, c when both of them complete
+    for(int i = 0; i < 100 && (laminar->latestRun("c") == 0 || !laminar->listQueuedJobs().empty()
+            || !laminar->listRunningJobs().empty()); ++i)
+        ioContext->provider->getTimer().afterDelay(50 * kj::MILLISECONDS).wait(ioContext->waitScope);
+    EXPECT_EQ(1, laminar->latestRun("b1"));
+    EXPECT_EQ(1, laminar->latestRun("b2"));
+    ASSERT_EQ(1, laminar->latestRun("c"));
+    rapidjson::Document status;
+    status.Parse(laminar->getStatus(MonitorScope(MonitorScope::RUN, "c", 1)).c_str());
+    EXPECT_STREQ("success", status["data"]["result"].GetString());
+    EXPECT_STREQ("a", status["data"]["upstream"]["name"].GetString());
+}
+
+TEST_F(LaminarFixture, RecoverFanIn) {
+    defineJob("a", "true", "FANOUT=b1,b2\nFANIN=c");
+    defineJob("b1", "true");
+    defineJob("b2", "true");
+    defineJob("c", "true");
+    std::string dbPath = home + "/laminar.sqlite";
+
+    // as if laminard had been killed after b1 completed but with b2 queued
+    restartLaminar([&]{
+        Database db(dbPath.c_str());
+        ASSERT_TRUE(db.exec("INSERT INTO builds(name,number,queuedAt,startedAt,completedAt,result) "
+                            "VALUES('a',1,1,2,3,5)"));
+        ASSERT_TRUE(db.exec("INSERT INTO builds(name,number,queuedAt,startedAt,completedAt,result,parentJob,parentBuild) "
+                            "VALUES('b1',1,3,4,5,5,'a',1)"));
+        ASSERT_TRUE(db.exec("INSERT INTO builds(name,number,queuedAt,parentJob,parentBuild) VALUES('b2',1,3,'a',1)"));
+        ASSERT_TRUE(db.exec("INSERT INTO fanins(name,number,job,params,runs) VALUES('a',1,'c',"
+                            "'{\"=parentJob\":\"a\",\"=parentBuild\":\"1\"}',"
+                            "'{\"runs\":[{\"name\":\"b1\",\"number\":1},{\"name\":\"b2\",\"number\":1}]}')"));
+    });
+
+    for(int i = 0; i < 100 && laminar->latestRun("c") == 0; ++i)
+        ioContext->provider->getTimer().afterDelay(50 * kj::MILLISECONDS).wait(ioContext->waitScope);
+    waitForIdle();
+    ASSERT_EQ(1, laminar->latestRun("c"));
+    rapidjson::Document status;
+    status.Parse(laminar->getStatus(MonitorScope(MonitorScope::RUN, "c", 1)).c_str());
+    EXPECT_STREQ("success", status["data"]["result"].GetString());
+    EXPECT_STREQ("a", status["data"]["upstream"]["name"].GetString());
+
+    int n = -1;
+    Database db(dbPath.c_str());
+    db.stmt("SELECT COUNT(*) FROM fanins").fetch<int>([&](int count){ n = count; });
+    EXPECT_EQ(0, n);
+}
+
+TEST_F(LaminarFixture, WorkspaceSnapshot) {
+    // cloning the empty initial workspace does not need reflink support
+    defineJob("foo", "touch \"$WORKSPACE/built\"", "WORKSPACE_SNAPSHOT=reflink");
+    auto run = runJob("foo");
+    ASSERT_EQ(LaminarCi::JobResult::SUCCESS, run.result);
+    EXPECT_NE(std::string::npos, std::string(run.log.cStr()).find("Using workspace snapshot"));
+    // the snapshot of a successful run is promoted
+    EXPECT_TRUE(tmp.fs->exists(kj::Path{"run", "foo", "workspace", "built"}));
+    EXPECT_FALSE(tmp.fs->exists(kj::Path{"run", "foo", "workspace.1"}));
+
+    // and that of a failed run is discarded
+    defineJob("bar", "touch \"$WORKSPACE/partial\"; false", "WORKSPACE_SNAPSHOT=reflink");
+    run = runJob("bar");
+    ASSERT_EQ(LaminarCi::JobResult::FAILED, run.result);
+    EXPECT_NE(std::string::npos, std::string(run.log.cStr()).find("Using workspace snapshot"));
+    EXPECT_TRUE(tmp.fs->exists(kj::Path{"run", "bar", "workspace"}));
+    EXPECT_FALSE(tmp.fs->exists(kj::Path{"run", "bar", "workspace", "partial"}));
+    EXPECT_FALSE(tmp.fs->exists(kj::Path{"run", "bar", "workspace.1"}));
+}
+
+TEST_F(LaminarFixture, JobResultCache) {
+    defineJob("foo", "echo built");
+    KJ_IF_MAYBE(f, tmp.fs->tryOpenFile(kj::Path{"cfg", "jobs", "foo.cachekey"},
+            kj::WriteMode::CREATE | kj::WriteMode::EXECUTABLE)) {
+        (*f)->writeAll("#!/bin/sh\necho key-$variant$suffix\n");
+    }
+    StringMap params;
+    params["variant"] = "a";
+    auto first = runJob("foo", params);
+    ASSERT_EQ(LaminarCi::JobResult::SUCCESS, first.result);
+    EXPECT_STREQ("built\n", stripLaminarLogLines(first.log).cStr());
+
+    // same key, the result of the first run is reused
+    auto second = runJob("foo", params);
+    ASSERT_EQ(LaminarCi::JobResult::SUCCESS, second.result);
+    EXPECT_STREQ("", stripLaminarLogLines(second.log).cStr());
+    rapidjson::Document status;
+    status.Parse(laminar->getStatus(MonitorScope(MonitorScope::RUN, "foo", 2)).c_str());
+    EXPECT_EQ(1, status["data"]["cacheHit"].GetInt());
+
+    // a different key runs the job again
+    params["variant"] = "b";
+    auto third = runJob("foo", params);
+    EXPECT_STREQ("built\n", stripLaminarLogLines(third.log).cStr());
+
+    // the script sees the environment files, so this changes the key too
+    KJ_IF_MAYBE(f, tmp.fs->tryOpenFile(kj::Path{"cfg", "jobs", "foo.env"}, kj::WriteMode::CREATE)) {
+        (*f)->writeAll("suffix=-x\n");
+    }
+    auto fourth = runJob("foo", params);
+    EXPECT_STREQ("built\n", stripLaminarLogLines(fourth.log).cStr());
+}
+
 TEST_F(LaminarFixture, Environment) {
     defineJob("foo", "env");
     auto run = runJob("foo");
@@ -151,6 +576,35 @@ TEST_F(LaminarFixture, Abort) {
     EXPECT_EQ(LaminarCi::JobResult::ABORTED, res.wait(ioContext->waitScope).getResult());
 }
 
+TEST_F(LaminarFixture, AbortKillsDescendants) {
+    // the grandchild leaves the process group, so killing that isn't enough
+    defineJob("job1", "setsid sleep inf & echo $! > ../grandchild.pid; sleep inf");
+    auto req = client().runRequest();
+    req.setJobName("job1");
+    auto res = req.send();
+    kj::Path pidFile{"run", "job1", "grandchild.pid"};
+    for(int i = 0; i < 100 && !(tmp.fs->exists(pidFile) && tmp.fs->openFile(pidFile)->stat().size > 0); ++i)
+        ioContext->provider->getTimer().afterDelay(50 * kj::MILLISECONDS).wait(ioContext->waitScope);
+    pid_t grandchild = atoi(tmp.fs->openFile(pidFile)->readAllText().cStr());
+    ASSERT_GT(grandchild, 0);
+
+    // a zombie is as good as gone, it just has not been reaped yet
+    auto alive = [](pid_t pid) {
+        std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+        std::string line;
+        std::getline(stat, line);
+        size_t end = line.rfind(')');
+        return end != std::string::npos && end + 2 < line.size() && line[end + 2] != 'Z';
+    };
+    EXPECT_TRUE(alive(grandchild));
+
+    ASSERT_TRUE(laminar->abort("job1", 1));
+    EXPECT_EQ(LaminarCi::JobResult::ABORTED, res.wait(ioContext->waitScope).getResult());
+    for(int i = 0; i < 40 && alive(grandchild); ++i)
+        ioContext->provider->getTimer().afterDelay(50 * kj::MILLISECONDS).wait(ioContext->waitScope);
+    EXPECT_FALSE(alive(grandchild));
+}
+
 TEST_F(LaminarFixture, JobDescription) {
     defineJob("foo", "true", "DESCRIPTION=bar");
     auto es = eventSource("/jobs/foo");
@@ -163,6 +617,31 @@ TEST_F(LaminarFixture, JobDescription) {
     EXPECT_STREQ("bar", data["description"].GetString());
 }
 
+TEST_F(LaminarFixture, ConcurrentStarts) {
+    defineJob("short", "true");
+    defineJob("long", "sleep inf");
+    // started in the same turn of the event loop, so that the pipes of
+    // both runs exist while each leader is spawned
+    laminar->queueJobs({{"short", ParamMap()}, {"long", ParamMap()}});
+    auto running = [&](const char* job){
+        for(const std::shared_ptr<Run>& run : laminar->listRunningJobs())
+            if(run->name == job)
+                return true;
+        return false;
+    };
+    for(int i = 0; i < 100 && (laminar->latestRun("long") == 0 || !running("long") || running("short")); ++i)
+        ioContext->provider->getTimer().afterDelay(50 * kj::MILLISECONDS).wait(ioContext->waitScope);
+    // the short run completes on its own while the long one goes on
+    EXPECT_FALSE(running("short"));
+    EXPECT_TRUE(running("long"));
+    rapidjson::Document status;
+    status.Parse(laminar->getStatus(MonitorScope(MonitorScope::RUN, "short", 1)).c_str());
+    EXPECT_STREQ("success", status["data"]["result"].GetString());
+
+    laminar->abort("long", 1);
+    waitForIdle();
+}
+
 TEST_F(LaminarFixture, QueueFront) {
     setNumExecutors(0);
     defineJob("foo", "true");
@@ -186,3 +665,215 @@ TEST_F(LaminarFixture, QueueFront) {
     EXPECT_STREQ("job_started", started2["type"].GetString());
     EXPECT_STREQ("foo", started2["data"]["name"].GetString());
 }
+
+TEST_F(LaminarFixture, CompressedLog) {
+    // long enough to be compressed on the pool when the run finishes
+    defineJob("foo", "seq 1 20000");
+    auto run = runJob("foo");
+    ASSERT_EQ(LaminarCi::JobResult::SUCCESS, run.result);
+    std::string log = stripLaminarLogLines(run.log).cStr();
+    EXPECT_EQ(0u, log.find("1\n2\n3\n"));
+    EXPECT_NE(std::string::npos, log.find("\n20000\n"));
+
+    // once completed, the log is served from memory until it has been
+    // compressed and stored, then decompressed from the database
+    kj::HttpHeaderTable headerTable;
+    kj::String stored = kj::newHttpClient(ioContext->lowLevelProvider->getTimer(), headerTable,
+                                          *ioContext->provider->getNetwork().parseAddress(bind_http.c_str()).wait(ioContext->waitScope))
+            ->request(kj::HttpMethod::GET, "/log/foo/1", kj::HttpHeaders(headerTable)).response.wait(ioContext->waitScope).body
+            ->readAllText().wait(ioContext->waitScope);
+    EXPECT_EQ(run.log, stored);
+    auto logStored = [&]{
+        size_t length = 0;
+        Database db((home + "/laminar.sqlite").c_str());
+        db.stmt("SELECT IFNULL(outputLen, 0) FROM builds WHERE name = 'foo' AND number = 1")
+         .fetch<ulong>([&](ulong l){ length = l; });
+        return length == run.log.size();
+    };
+    for(int i = 0; i < 100 && !logStored(); ++i)
+        ioContext->provider->getTimer().afterDelay(50 * kj::MILLISECONDS).wait(ioContext->waitScope);
+
+    // a client accepting the codec gets the stored log as it is
+    kj::HttpHeaderTable::Builder builder;
+    kj::HttpHeaderId contentEncoding = builder.add("Content-Encoding");
+    auto table = builder.build();
+    kj::HttpHeaders headers(*table);
+    headers.add("Accept-Encoding", "gzip, deflate, zstd");
+    auto response = kj::newHttpClient(ioContext->lowLevelProvider->getTimer(), *table,
+                                      *ioContext->provider->getNetwork().parseAddress(bind_http.c_str()).wait(ioContext->waitScope))
+            ->request(kj::HttpMethod::GET, "/log/foo/1", headers).response.wait(ioContext->waitScope);
+    kj::StringPtr encoding = response.headers->get(contentEncoding).orDefault("");
+    ASSERT_TRUE(encoding == "deflate" || encoding == "zstd");
+    kj::String body = response.body->readAllText().wait(ioContext->waitScope);
+    std::string compressed(body.begin(), body.size());
+    EXPECT_EQ(std::string(run.log.cStr()), uncompressLog(compressed, run.log.size(), encoding == "zstd" ? LOG_CODEC_ZSTD : LOG_CODEC_ZLIB));
+}
+
+TEST_F(LaminarFixture, ResourceEncodings) {
+    kj::HttpHeaderTable::Builder builder;
+    kj::HttpHeaderId contentEncoding = builder.add("Content-Encoding");
+    auto table = builder.build();
+    auto fetch = [&](const char* acceptEncoding) {
+        kj::HttpHeaders headers(*table);
+        if(acceptEncoding)
+            headers.add("Accept-Encoding", acceptEncoding);
+        auto response = kj::newHttpClient(ioContext->lowLevelProvider->getTimer(), *table,
+                                          *ioContext->provider->getNetwork().parseAddress(bind_http.c_str()).wait(ioContext->waitScope))
+                ->request(kj::HttpMethod::GET, "/js/app.js", headers).response.wait(ioContext->waitScope);
+        EXPECT_EQ(200, response.statusCode);
+        std::string encoding = response.headers->get(contentEncoding).orDefault("").cStr();
+        std::string body = response.body->readAllText().wait(ioContext->waitScope).cStr();
+        return std::make_pair(encoding, body);
+    };
+
+    // decompressed for clients which accept no compression
+    auto plain = fetch(nullptr);
+    EXPECT_EQ("", plain.first);
+    EXPECT_EQ(0u, plain.second.find("/* laminar.js"));
+
+    EXPECT_EQ("gzip", fetch("gzip").first);
+    EXPECT_EQ("gzip", fetch("deflate, gzip;q=0.5").first);
+    EXPECT_EQ("", fetch("gzip;q=0").first);
+}
+
+TEST_F(LaminarFixture, ResourceCaching) {
+    kj::HttpHeaderTable::Builder builder;
+    kj::HttpHeaderId etagId = builder.add("ETag");
+    kj::HttpHeaderId cacheControlId = builder.add("Cache-Control");
+    auto table = builder.build();
+    auto address = ioContext->provider->getNetwork().parseAddress(bind_http.c_str()).wait(ioContext->waitScope);
+    auto client = kj::newHttpClient(ioContext->lowLevelProvider->getTimer(), *table, *address);
+    struct Response {
+        uint statusCode;
+        std::string etag;
+        std::string cacheControl;
+        std::string body;
+    };
+    auto fetch = [&](kj::StringPtr url, kj::StringPtr ifNoneMatch = nullptr) {
+        kj::HttpHeaders headers(*table);
+        if(ifNoneMatch != nullptr)
+            headers.add("If-None-Match", ifNoneMatch);
+        auto response = client->request(kj::HttpMethod::GET, url, headers).response.wait(ioContext->waitScope);
+        return Response{
+            response.statusCode,
+            response.headers->get(etagId).orDefault("").cStr(),
+            response.headers->get(cacheControlId).orDefault("").cStr(),
+            response.body->readAllText().wait(ioContext->waitScope).cStr()
+        };
+    };
+
+    // the index refers to resources by versioned URLs
+    std::string html = fetch("/").body;
+    size_t pos = html.find("js/app.js?v=");
+    ASSERT_NE(std::string::npos, pos);
+    std::string url = "/" + html.substr(pos, html.find('"', pos) - pos);
+
+    auto versioned = fetch(url);
+    EXPECT_EQ(200, versioned.statusCode);
+    EXPECT_EQ("public, max-age=31536000, immutable", versioned.cacheControl);
+    ASSERT_NE("", versioned.etag);
+
+    auto unversioned = fetch("/js/app.js");
+    EXPECT_EQ("no-cache", unversioned.cacheControl);
+    EXPECT_EQ(versioned.etag, unversioned.etag);
+
+    EXPECT_EQ(304, fetch("/js/app.js", versioned.etag).statusCode);
+    EXPECT_EQ(200, fetch("/js/app.js", "\"outdated\"").statusCode);
+}
+
+TEST_F(LaminarFixture, BadgeCaching) {
+    kj::HttpHeaderTable::Builder builder;
+    kj::HttpHeaderId etagId = builder.add("ETag");
+    auto table = builder.build();
+    auto address = ioContext->provider->getNetwork().parseAddress(bind_http.c_str()).wait(ioContext->waitScope);
+    auto client = kj::newHttpClient(ioContext->lowLevelProvider->getTimer(), *table, *address);
+    auto fetch = [&](kj::StringPtr ifNoneMatch = nullptr) {
+        kj::HttpHeaders headers(*table);
+        if(ifNoneMatch != nullptr)
+            headers.add("If-None-Match", ifNoneMatch);
+        auto response = client->request(kj::HttpMethod::GET, "/badge/foo.svg", headers).response.wait(ioContext->waitScope);
+        response.body->readAllText().wait(ioContext->waitScope);
+        return std::make_pair(response.statusCode, std::string(response.headers->get(etagId).orDefault("").cStr()));
+    };
+
+    EXPECT_EQ(404, fetch().first);
+
+    defineJob("foo", "true");
+    runJob("foo");
+    auto first = fetch();
+    EXPECT_EQ(200, first.first);
+    EXPECT_EQ(304, fetch(first.second.c_str()).first);
+
+    // a new run changes the badge even if the result is the same
+    runJob("foo");
+    auto second = fetch(first.second.c_str());
+    EXPECT_EQ(200, second.first);
+    EXPECT_NE(first.second, second.second);
+}
+
+#if defined(LAMINAR_ZSTD)
+class LaminarLogDictionaryFixture : public LaminarFixture {
+public:
+    LaminarLogDictionaryFixture() {
+        settings.log_dictionaries = true;
+    }
+};
+
+TEST_F(LaminarLogDictionaryFixture, TrainLogDictionary) {
+    defineJob("foo", "seq 1 2000 | sed \"s/^/compiling module /\"; echo $RUN");
+    for(int i = 0; i < 16; ++i)
+        ASSERT_EQ(LaminarCi::JobResult::SUCCESS, runJob("foo").result);
+
+    // training happens on the compression pool after the 16th run
+    Database db((tmp.path/"laminar.sqlite").toString(true).cStr());
+    auto trained = [&](){
+        int n = 0;
+        db.stmt("SELECT COUNT(*) FROM logdicts WHERE name = 'foo'").fetch<int>([&](int c){ n = c; });
+        return n > 0;
+    };
+    for(int i = 0; i < 500 && !trained(); ++i)
+        ioContext->provider->getTimer().afterDelay(10 * kj::MILLISECONDS).wait(ioContext->waitScope);
+    ASSERT_TRUE(trained());
+
+    // the next log is compressed with it and still reads back the same
+    auto run = runJob("foo");
+    int dict = 0;
+    db.stmt("SELECT outputDict FROM builds WHERE name = 'foo' AND number = 17").fetch<int>([&](int d){ dict = d; });
+    EXPECT_NE(0, dict);
+    kj::HttpHeaderTable headerTable;
+    kj::String stored = kj::newHttpClient(ioContext->lowLevelProvider->getTimer(), headerTable,
+                                          *ioContext->provider->getNetwork().parseAddress(bind_http.c_str()).wait(ioContext->waitScope))
+            ->request(kj::HttpMethod::GET, "/log/foo/17", kj::HttpHeaders(headerTable)).response.wait(ioContext->waitScope).body
+            ->readAllText().wait(ioContext->waitScope);
+    EXPECT_EQ(run.log, stored);
+}
+#endif
+
+class LaminarHttpThreadsFixture : public LaminarFixture {
+public:
+    LaminarHttpThreadsFixture() {
+        settings.http_threads = 2;
+    }
+};
+
+TEST_F(LaminarHttpThreadsFixture, ServeFromWorkerThreads) {
+    auto es = eventSource("/");
+    defineJob("foo", "echo hello");
+    auto run = runJob("foo");
+    ASSERT_EQ(LaminarCi::JobResult::SUCCESS, run.result);
+    EXPECT_STREQ("hello\n", stripLaminarLogLines(run.log).cStr());
+
+    // events are forwarded to the thread serving the event source
+    auto completed = [&](){
+        for(const rapidjson::Document& m : es->messages()) {
+            if(m.IsObject() && m.HasMember("type") && strcmp(m["type"].GetString(), "job_completed") == 0)
+                return true;
+        }
+        return false;
+    };
+    for(int i = 0; i < 100 && !completed(); ++i)
+        ioContext->provider->getTimer().afterDelay(10 * kj::MILLISECONDS).wait(ioContext->waitScope);
+    ASSERT_LE(1, es->messages().size());
+    EXPECT_STREQ("status", es->messages().front()["type"].GetString());
+    EXPECT_TRUE(completed());
+}
@@ -22,12 +22,19 @@
 
 #include "laminar-fixture.h"
 #include "leader.h"
+#include "zygote.h"
+
+kj::AsyncIoContext* LaminarFixture::ioContext;
 
 // gtest main supplied in order to call captureChildExit and handle process leader
 int main(int argc, char **argv) {
     if(argv[0][0] == '{')
         return leader_main();
 
+    // Runs are started through the zygote, except in the benchmark
+    // which compares it against spawning leaders directly
+    zygoteStart(argc, argv);
+
     // TODO: consider handling this differently
     auto ioContext = kj::setupAsyncIo();
     LaminarFixture::ioContext = &ioContext;
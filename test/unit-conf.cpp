@@ -59,6 +59,12 @@ TEST_F(ConfTest, Parse) {
     EXPECT_EQ(3, cfg.get("bar", 0));
 }
 
+TEST_F(ConfTest, ParseDouble) {
+    parseConf("load=2.5");
+    EXPECT_DOUBLE_EQ(2.5, cfg.get<double>("load", 0));
+    EXPECT_DOUBLE_EQ(1.5, cfg.get<double>("missing", 1.5));
+}
+
 TEST_F(ConfTest, Fallback) {
     EXPECT_EQ("foo", cfg.get("test", std::string("foo")));
 }
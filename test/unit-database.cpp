@@ -74,6 +74,30 @@ TEST_F(DatabaseTest, MultiRow) {
     EXPECT_EQ(10, i);
 }
 
+TEST_F(DatabaseTest, Transaction) {
+    ASSERT_TRUE(db.exec("create table test(id int)"));
+    EXPECT_FALSE(db.inTransaction());
+    db.begin();
+    db.begin();
+    EXPECT_TRUE(db.stmt("insert into test values(?)").bind(1).exec());
+    db.commit();
+    // still in the outer transaction
+    EXPECT_TRUE(db.inTransaction());
+    EXPECT_FALSE(db.exec("begin transaction"));
+    EXPECT_TRUE(db.stmt("insert into test values(?)").bind(2).exec());
+    db.commit();
+    EXPECT_FALSE(db.inTransaction());
+    // an unmatched commit is harmless
+    db.commit();
+    int n = 0;
+    db.stmt("select count(*) from test").fetch<int>([&](int c){
+        n = c;
+    });
+    EXPECT_EQ(2, n);
+    EXPECT_TRUE(db.exec("begin transaction"));
+    EXPECT_TRUE(db.exec("rollback"));
+}
+
 TEST_F(DatabaseTest, StdevFunc) {
     double res = 0;
     db.stmt("with a (x) as (values (7),(3),(45),(23)) select stdev(x) from a").fetch<double>([&](double r){
@@ -0,0 +1,86 @@
+///
+/// Copyright 2026 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "readbuffer.h"
+#include <gtest/gtest.h>
+#include <fstream>
+#include <unistd.h>
+
+class ReadBufferTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        ASSERT_EQ(0, pipe(fds));
+    }
+    void TearDown() override {
+        close(fds[0]);
+        close(fds[1]);
+    }
+    int fds[2];
+};
+
+TEST_F(ReadBufferTest, GrowsOnFullReads) {
+    ReadBuffer rb(fds[0]);
+    EXPECT_EQ(size_t(PROC_IO_BUFSIZE_MIN), rb.size());
+    for(size_t expected = PROC_IO_BUFSIZE_MIN; expected < PROC_IO_BUFSIZE_MAX; expected *= 2) {
+        ASSERT_EQ(expected, rb.size());
+        rb.update(rb.size());
+    }
+    EXPECT_EQ(size_t(PROC_IO_BUFSIZE_MAX), rb.size());
+    // no further than the upper bound
+    rb.update(rb.size());
+    EXPECT_EQ(size_t(PROC_IO_BUFSIZE_MAX), rb.size());
+}
+
+TEST_F(ReadBufferTest, ShrinksOnShortReads) {
+    ReadBuffer rb(fds[0]);
+    while(rb.size() < PROC_IO_BUFSIZE_MAX)
+        rb.update(rb.size());
+    // a read which fills a quarter of the buffer or more keeps its size
+    rb.update(rb.size() / 4);
+    EXPECT_EQ(size_t(PROC_IO_BUFSIZE_MAX), rb.size());
+    for(size_t expected = PROC_IO_BUFSIZE_MAX / 2; expected >= PROC_IO_BUFSIZE_MIN; expected /= 2) {
+        rb.update(0);
+        ASSERT_EQ(expected, rb.size());
+    }
+    // no further than the lower bound
+    rb.update(0);
+    EXPECT_EQ(size_t(PROC_IO_BUFSIZE_MIN), rb.size());
+}
+
+#if defined(F_GETPIPE_SZ)
+TEST_F(ReadBufferTest, GrowsPipe) {
+    int initial = fcntl(fds[0], F_GETPIPE_SZ);
+    ASSERT_GT(initial, 0);
+    // unprivileged processes may not grow a pipe beyond this
+    int maxSize = 0;
+    std::ifstream("/proc/sys/fs/pipe-max-size") >> maxSize;
+    if(maxSize <= initial)
+        GTEST_SKIP() << "pipes cannot be grown beyond " << initial << " bytes";
+
+    ReadBuffer rb(fds[0]);
+    while(rb.size() < PROC_IO_BUFSIZE_MAX)
+        rb.update(rb.size());
+    EXPECT_GT(fcntl(fds[0], F_GETPIPE_SZ), initial);
+
+    // shrinking the buffer leaves the pipe as it is
+    int grown = fcntl(fds[0], F_GETPIPE_SZ);
+    while(rb.size() > PROC_IO_BUFSIZE_MIN)
+        rb.update(0);
+    EXPECT_EQ(grown, fcntl(fds[0], F_GETPIPE_SZ));
+}
+#endif
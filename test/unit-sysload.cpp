@@ -0,0 +1,89 @@
+///
+/// Copyright 2026 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "sysload.h"
+#include <gtest/gtest.h>
+
+TEST(LoadLimitsTest, DisabledByDefault) {
+    LoadLimits limits;
+    EXPECT_FALSE(limits.enabled());
+    SystemLoad load;
+    load.loadAvg = 1000;
+    load.cpuPressure = load.memoryPressure = load.ioPressure = 100;
+    load.memAvailable = 0;
+    EXPECT_FALSE(limits.exceededBy(load, 100));
+}
+
+TEST(LoadLimitsTest, LoadAverage) {
+    LoadLimits limits;
+    limits.maxLoad = 4;
+    EXPECT_TRUE(limits.enabled());
+    SystemLoad load;
+    load.loadAvg = 3.5;
+    EXPECT_FALSE(limits.exceededBy(load));
+    load.loadAvg = 4;
+    EXPECT_FALSE(limits.exceededBy(load));
+    load.loadAvg = 4.1;
+    EXPECT_TRUE(limits.exceededBy(load));
+}
+
+TEST(LoadLimitsTest, RecentRuns) {
+    LoadLimits limits;
+    limits.maxLoad = 4;
+    SystemLoad load;
+    load.loadAvg = 1.5;
+    EXPECT_FALSE(limits.exceededBy(load, 2));
+    EXPECT_TRUE(limits.exceededBy(load, 3));
+    // pressure cannot be extrapolated, so recent runs don't count against it
+    limits.maxLoad = 0;
+    limits.maxCpuPressure = 50;
+    load.cpuPressure = 40;
+    EXPECT_FALSE(limits.exceededBy(load, 10));
+}
+
+TEST(LoadLimitsTest, Pressure) {
+    LoadLimits limits;
+    limits.maxCpuPressure = 50;
+    limits.maxMemoryPressure = 10;
+    limits.maxIoPressure = 40;
+    SystemLoad load;
+    load.cpuPressure = 50;
+    load.memoryPressure = 10;
+    load.ioPressure = 40;
+    EXPECT_FALSE(limits.exceededBy(load));
+    load.cpuPressure = 50.1;
+    EXPECT_TRUE(limits.exceededBy(load));
+    load.cpuPressure = 0;
+    load.memoryPressure = 10.1;
+    EXPECT_TRUE(limits.exceededBy(load));
+    load.memoryPressure = 0;
+    load.ioPressure = 41;
+    EXPECT_TRUE(limits.exceededBy(load));
+}
+
+TEST(LoadLimitsTest, FreeMemory) {
+    LoadLimits limits;
+    limits.minFreeMemory = 4096;
+    SystemLoad load;
+    // unknown never holds back a run
+    EXPECT_FALSE(limits.exceededBy(load));
+    load.memAvailable = 4096;
+    EXPECT_FALSE(limits.exceededBy(load));
+    load.memAvailable = 4095;
+    EXPECT_TRUE(limits.exceededBy(load));
+}